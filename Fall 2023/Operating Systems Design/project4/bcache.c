@@ -0,0 +1,475 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	
+ *	Tiny File System
+ *
+ *	File:	bcache.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "block.h"
+#include "bcache.h"
+
+/*
+ * The buffer cache sits between rufs.c and the disk: bio_read_multi() and bio_write_multi() are served from
+ * here, while bio_read_range() and bio_write_range() in block.c perform the actual (uncached) transfers.
+ * Buffers are found through a chained hash table and reclaimed with the CLOCK algorithm. Writes are
+ * write-back; dirty buffers reach the disk when they are evicted or when bcache_flush() is called.
+ * Cache misses are read with bcache_mutex released, so readers of different blocks overlap their I/O; a
+ * block read that way is only inserted if nobody else cached it in the meantime.
+ */
+
+struct buffer {
+	unsigned int block_num;			/* disk block held by this buffer */
+	unsigned char valid;			/* buffer holds a block */
+	unsigned char dirty;			/* buffer differs from the disk */
+	unsigned char referenced;		/* CLOCK reference bit */
+	unsigned char prefetched;		/* loaded by bcache_prefetch() and not read since */
+	struct buffer *hash_next;		/* next buffer in the same hash bucket */
+	char *data;						/* BLOCK_SIZE bytes of block contents */
+};
+
+static pthread_mutex_t bcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer *buffers = NULL;
+static char *buffer_data = NULL;
+static struct buffer **hash_table = NULL;
+static size_t buffer_count = 0,
+	hash_size = 0,
+	clock_hand = 0;
+static struct bcache_stats stats;
+
+static size_t hash_block(unsigned int block_num) {
+	return (block_num * 2654435761u) & (hash_size - 1);
+}
+
+static struct buffer *lookup_buffer(unsigned int block_num) {
+	for (struct buffer *buf = hash_table[hash_block(block_num)]; buf; buf = buf->hash_next) {
+		if (buf->block_num == block_num) return buf;
+	}
+	return NULL;
+}
+
+static void remove_buffer(struct buffer *buf) {
+	struct buffer **link = &hash_table[hash_block(buf->block_num)];
+	while (*link != buf) link = &(*link)->hash_next;
+	*link = buf->hash_next;
+	buf->hash_next = NULL;
+	buf->valid = 0;
+}
+
+static void insert_buffer(struct buffer *buf, unsigned int block_num) {
+	size_t bucket = hash_block(block_num);
+	buf->block_num = block_num;
+	buf->valid = 1;
+	buf->dirty = 0;
+	buf->referenced = 1;
+	buf->prefetched = 0;
+	buf->hash_next = hash_table[bucket];
+	hash_table[bucket] = buf;
+}
+
+static void count_hit(struct buffer *buf) {
+	stats.hits++;
+	if (buf->prefetched) {
+		buf->prefetched = 0;
+		stats.prefetch_hits++;
+	}
+}
+
+// Advances the CLOCK hand until an unreferenced buffer is found; a dirty victim is written back first.
+// Returns NULL only if that write-back fails.
+static struct buffer *evict_buffer() {
+	for (;;) {
+		struct buffer *buf = &buffers[clock_hand];
+		clock_hand = (clock_hand + 1) % buffer_count;
+		if (!buf->valid) return buf;
+		if (buf->referenced) {
+			buf->referenced = 0;
+			continue;
+		}
+		if (buf->dirty) {
+			if (bio_write_range(buf->block_num, 1, buf->data) != EXIT_SUCCESS) return NULL;
+			stats.writebacks++;
+		}
+		if (buf->prefetched) stats.prefetch_unused++;
+		remove_buffer(buf);
+		stats.evictions++;
+		return buf;
+	}
+}
+
+// Allocates a buffer cache that uses at most max_bytes of block memory.
+// Status: COMPLETE
+int bcache_init(size_t max_bytes) {
+	if (buffers) return EXIT_SUCCESS;
+	buffer_count = max_bytes / BLOCK_SIZE;
+	if (buffer_count < 16) buffer_count = 16;
+	for (hash_size = 1; hash_size < buffer_count; hash_size <<= 1);
+	buffers = calloc(buffer_count, sizeof(struct buffer));
+	buffer_data = malloc(buffer_count * BLOCK_SIZE);
+	hash_table = calloc(hash_size, sizeof(struct buffer *));
+	if (!buffers || !buffer_data || !hash_table) {
+		free(buffers);
+		free(buffer_data);
+		free(hash_table);
+		buffers = NULL;
+		buffer_data = NULL;
+		hash_table = NULL;
+		return -1;
+	}
+	for (size_t i = 0; i < buffer_count; i++) buffers[i].data = buffer_data + i * BLOCK_SIZE;
+	clock_hand = 0;
+	memset(&stats, 0, sizeof(struct bcache_stats));
+	return EXIT_SUCCESS;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+	unsigned int start_a = ((const struct block_range *)a)->start,
+		start_b = ((const struct block_range *)b)->start;
+	return start_a < start_b ? -1 : start_a > start_b;
+}
+
+// True if block_num lies in one of the count ranges, which are sorted by start and do not overlap.
+static int in_ranges(struct block_range *ranges, unsigned int count, unsigned int block_num) {
+	unsigned int low = 0,
+		high = count;
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		if (block_num < ranges[mid].start) high = mid;
+		else if (block_num - ranges[mid].start >= ranges[mid].count) low = mid + 1;
+		else return 1;
+	}
+	return 0;
+}
+
+// Writes back the dirty buffers inside the sorted ranges, or all of them if ranges is NULL.
+static int write_back(struct block_range *ranges, unsigned int range_count) {
+	pthread_mutex_lock(&bcache_mutex);
+	unsigned int *block_nums = malloc(buffer_count * sizeof(unsigned int));
+	void **bufs = malloc(buffer_count * sizeof(void *));
+	struct buffer **dirty = malloc(buffer_count * sizeof(struct buffer *));
+	if (!block_nums || !bufs || !dirty) {
+		pthread_mutex_unlock(&bcache_mutex);
+		free(block_nums);
+		free(bufs);
+		free(dirty);
+		return -1;
+	}
+	unsigned int dirty_count = 0;
+	for (size_t i = 0; i < buffer_count; i++) {
+		if (!buffers[i].valid || !buffers[i].dirty) continue;
+		if (ranges && !in_ranges(ranges, range_count, buffers[i].block_num)) continue;
+		dirty[dirty_count] = &buffers[i];
+		block_nums[dirty_count] = buffers[i].block_num;
+		bufs[dirty_count++] = buffers[i].data;
+	}
+	int retstat = bio_writev_range(block_nums, dirty_count, bufs);
+	if (retstat == EXIT_SUCCESS) {
+		for (unsigned int i = 0; i < dirty_count; i++) dirty[i]->dirty = 0;
+		stats.writebacks += dirty_count;
+	}
+	pthread_mutex_unlock(&bcache_mutex);
+	free(block_nums);
+	free(bufs);
+	free(dirty);
+	return retstat;
+}
+
+// Writes every dirty buffer to the disk in block order, issuing one write per run of consecutive blocks.
+// Status: COMPLETE
+int bcache_flush() {
+	if (!buffers) return EXIT_SUCCESS;
+	return write_back(NULL, 0);
+}
+
+// Like bcache_flush(), but only for the dirty buffers inside the given ranges (e.g., the extents of one
+// file). The ranges are sorted in place.
+// Status: COMPLETE
+int bcache_flush_ranges(struct block_range *ranges, unsigned int range_count) {
+	if (!buffers || range_count == 0) return EXIT_SUCCESS;
+	qsort(ranges, range_count, sizeof(struct block_range), compare_ranges);
+	return write_back(ranges, range_count);
+}
+
+// Releases the cache; bcache_flush() must be called first for dirty data to survive.
+// Status: COMPLETE
+void bcache_destroy() {
+	pthread_mutex_lock(&bcache_mutex);
+	free(buffers);
+	free(buffer_data);
+	free(hash_table);
+	buffers = NULL;
+	buffer_data = NULL;
+	hash_table = NULL;
+	buffer_count = hash_size = clock_hand = 0;
+	pthread_mutex_unlock(&bcache_mutex);
+}
+
+// Drops the cached copy of a block, if any, without writing it back; used when the block's current contents
+// are kept elsewhere (see journal.c).
+// Status: COMPLETE
+void bcache_invalidate(unsigned int block_num) {
+	if (!buffers) return;
+	pthread_mutex_lock(&bcache_mutex);
+	struct buffer *cached = lookup_buffer(block_num);
+	if (cached) remove_buffer(cached);
+	pthread_mutex_unlock(&bcache_mutex);
+}
+
+// Status: COMPLETE
+void bcache_get_stats(struct bcache_stats *out_stats) {
+	pthread_mutex_lock(&bcache_mutex);
+	memcpy(out_stats, &stats, sizeof(struct bcache_stats));
+	pthread_mutex_unlock(&bcache_mutex);
+}
+
+// Cached read of any number of consecutive blocks. Runs of missing blocks are read from the disk together.
+// Transfers larger than a quarter of the cache are not inserted so that they cannot flush the working set.
+// Status: COMPLETE
+int bio_read_multi(unsigned int block_num, unsigned int block_count, void *buf) {
+	if (!buffers) return bio_read_range(block_num, block_count, buf);
+	char *buf_ptr = (char *)buf;
+	unsigned char streaming = block_count > buffer_count / 4;
+	pthread_mutex_lock(&bcache_mutex);
+	for (unsigned int i = 0; i < block_count;) {
+		struct buffer *cached = lookup_buffer(block_num + i);
+		if (cached) {
+			memcpy(buf_ptr + (size_t)i * BLOCK_SIZE, cached->data, BLOCK_SIZE);
+			cached->referenced = 1;
+			count_hit(cached);
+			i++;
+			continue;
+		}
+		unsigned int run = 1;
+		while (i + run < block_count && !lookup_buffer(block_num + i + run)) run++;
+		pthread_mutex_unlock(&bcache_mutex);
+		int retstat = bio_read_range(block_num + i, run, buf_ptr + (size_t)i * BLOCK_SIZE);
+		if (retstat != EXIT_SUCCESS) return retstat;
+		pthread_mutex_lock(&bcache_mutex);
+		stats.misses += run;
+		for (unsigned int j = 0; j < run && !streaming; j++) {
+			if (lookup_buffer(block_num + i + j)) continue;
+			struct buffer *fresh = evict_buffer();
+			if (!fresh) break;
+			insert_buffer(fresh, block_num + i + j);
+			memcpy(fresh->data, buf_ptr + (size_t)(i + j) * BLOCK_SIZE, BLOCK_SIZE);
+		}
+		i += run;
+	}
+	pthread_mutex_unlock(&bcache_mutex);
+	return EXIT_SUCCESS;
+}
+
+// Cached (write-back) write of any number of consecutive blocks. Transfers larger than a quarter of the
+// cache are written straight to the disk, refreshing any copies that are already cached.
+// Status: COMPLETE
+int bio_write_multi(unsigned int block_num, unsigned int block_count, void *buf) {
+	if (!buffers) return bio_write_range(block_num, block_count, buf);
+	char *buf_ptr = (char *)buf;
+	int retstat = EXIT_SUCCESS;
+	pthread_mutex_lock(&bcache_mutex);
+	if (block_count > buffer_count / 4) {
+		retstat = bio_write_range(block_num, block_count, buf);
+		for (unsigned int i = 0; i < block_count && retstat == EXIT_SUCCESS; i++) {
+			struct buffer *cached = lookup_buffer(block_num + i);
+			if (!cached) continue;
+			memcpy(cached->data, buf_ptr + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+			cached->dirty = 0;
+		}
+		pthread_mutex_unlock(&bcache_mutex);
+		return retstat;
+	}
+	for (unsigned int i = 0; i < block_count; i++) {
+		struct buffer *cached = lookup_buffer(block_num + i);
+		if (!cached) {
+			cached = evict_buffer();
+			if (!cached) {
+				// Write-back of the victim failed; write this block through instead of caching it.
+				retstat = bio_write_range(block_num + i, 1, buf_ptr + (size_t)i * BLOCK_SIZE);
+				if (retstat != EXIT_SUCCESS) break;
+				continue;
+			}
+			insert_buffer(cached, block_num + i);
+		}
+		memcpy(cached->data, buf_ptr + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+		cached->dirty = 1;
+		cached->referenced = 1;
+	}
+	pthread_mutex_unlock(&bcache_mutex);
+	return retstat;
+}
+
+// Cached scatter read: block_nums[i] is copied into bufs[i]. Cache misses are gathered and read together,
+// so physically consecutive misses cost a single preadv().
+// Status: COMPLETE
+int bio_readv(const unsigned int *block_nums, unsigned int block_count, void **bufs) {
+	if (!buffers) return bio_readv_range(block_nums, block_count, bufs);
+	unsigned int *miss_nums = malloc(block_count * sizeof(unsigned int));
+	void **miss_bufs = malloc(block_count * sizeof(void *));
+	if (!miss_nums || !miss_bufs) {
+		free(miss_nums);
+		free(miss_bufs);
+		return -1;
+	}
+	unsigned int miss_count = 0;
+	pthread_mutex_lock(&bcache_mutex);
+	for (unsigned int i = 0; i < block_count; i++) {
+		struct buffer *cached = lookup_buffer(block_nums[i]);
+		if (cached) {
+			memcpy(bufs[i], cached->data, BLOCK_SIZE);
+			cached->referenced = 1;
+			count_hit(cached);
+			continue;
+		}
+		miss_nums[miss_count] = block_nums[i];
+		miss_bufs[miss_count++] = bufs[i];
+	}
+	pthread_mutex_unlock(&bcache_mutex);
+	int retstat = bio_readv_range(miss_nums, miss_count, miss_bufs);
+	pthread_mutex_lock(&bcache_mutex);
+	if (retstat == EXIT_SUCCESS) {
+		stats.misses += miss_count;
+		for (unsigned int i = 0; i < miss_count && miss_count <= buffer_count / 4; i++) {
+			if (lookup_buffer(miss_nums[i])) continue; // Requested twice, or cached by another thread meanwhile.
+			struct buffer *fresh = evict_buffer();
+			if (!fresh) break;
+			insert_buffer(fresh, miss_nums[i]);
+			memcpy(fresh->data, miss_bufs[i], BLOCK_SIZE);
+		}
+	}
+	pthread_mutex_unlock(&bcache_mutex);
+	free(miss_nums);
+	free(miss_bufs);
+	return retstat;
+}
+
+// Loads blocks that are about to be read into the cache, skipping those already there; at most a quarter of
+// the cache is filled at once. The new buffers start unreferenced, so the CLOCK hand reclaims them first
+// if nobody reads them. Without a cache, the kernel is asked to read the blocks ahead instead.
+// Status: COMPLETE
+int bcache_prefetch(const unsigned int *block_nums, unsigned int block_count) {
+	if (!buffers) {
+		for (unsigned int i = 0, run; i < block_count; i += run) {
+			for (run = 1; i + run < block_count && block_nums[i + run] == block_nums[i] + run; run++);
+			dev_readahead(block_nums[i], run);
+		}
+		return EXIT_SUCCESS;
+	}
+	if (block_count > buffer_count / 4) block_count = buffer_count / 4;
+	unsigned int *miss_nums = malloc(block_count * sizeof(unsigned int));
+	void **miss_bufs = malloc(block_count * sizeof(void *));
+	char *staging = malloc((size_t)block_count * BLOCK_SIZE);
+	if (!miss_nums || !miss_bufs || !staging) {
+		free(miss_nums);
+		free(miss_bufs);
+		free(staging);
+		return -1;
+	}
+	unsigned int miss_count = 0;
+	pthread_mutex_lock(&bcache_mutex);
+	for (unsigned int i = 0; i < block_count; i++) {
+		if (lookup_buffer(block_nums[i])) continue;
+		miss_nums[miss_count] = block_nums[i];
+		miss_bufs[miss_count] = staging + (size_t)miss_count * BLOCK_SIZE;
+		miss_count++;
+	}
+	pthread_mutex_unlock(&bcache_mutex);
+	int retstat = bio_readv_range(miss_nums, miss_count, miss_bufs);
+	pthread_mutex_lock(&bcache_mutex);
+	for (unsigned int i = 0; i < miss_count && retstat == EXIT_SUCCESS; i++) {
+		if (lookup_buffer(miss_nums[i])) continue; // Read or written by someone else meanwhile.
+		struct buffer *fresh = evict_buffer();
+		if (!fresh) break;
+		insert_buffer(fresh, miss_nums[i]);
+		memcpy(fresh->data, miss_bufs[i], BLOCK_SIZE);
+		fresh->referenced = 0;
+		fresh->prefetched = 1;
+		stats.prefetched++;
+	}
+	pthread_mutex_unlock(&bcache_mutex);
+	free(miss_nums);
+	free(miss_bufs);
+	free(staging);
+	return retstat;
+}
+
+// Cached (write-back) gather write: bufs[i] becomes the contents of block block_nums[i].
+// Large batches are written through with one pwritev() per run of consecutive blocks.
+// Status: COMPLETE
+int bio_writev(const unsigned int *block_nums, unsigned int block_count, void **bufs) {
+	if (!buffers) return bio_writev_range(block_nums, block_count, bufs);
+	int retstat = EXIT_SUCCESS;
+	pthread_mutex_lock(&bcache_mutex);
+	if (block_count > buffer_count / 4) {
+		retstat = bio_writev_range(block_nums, block_count, bufs);
+		for (unsigned int i = 0; i < block_count && retstat == EXIT_SUCCESS; i++) {
+			struct buffer *cached = lookup_buffer(block_nums[i]);
+			if (!cached) continue;
+			memcpy(cached->data, bufs[i], BLOCK_SIZE);
+			cached->dirty = 0;
+		}
+		pthread_mutex_unlock(&bcache_mutex);
+		return retstat;
+	}
+	for (unsigned int i = 0; i < block_count; i++) {
+		struct buffer *cached = lookup_buffer(block_nums[i]);
+		if (!cached) {
+			cached = evict_buffer();
+			if (!cached) {
+				retstat = bio_write_range(block_nums[i], 1, bufs[i]);
+				if (retstat != EXIT_SUCCESS) break;
+				continue;
+			}
+			insert_buffer(cached, block_nums[i]);
+		}
+		memcpy(cached->data, bufs[i], BLOCK_SIZE);
+		cached->dirty = 1;
+		cached->referenced = 1;
+	}
+	pthread_mutex_unlock(&bcache_mutex);
+	return retstat;
+}
+
+// Drops the cached copies of blocks [block_num, block_num + block_count) without writing them back. The caller
+// holds bcache_mutex.
+static void drop_range(unsigned int block_num, unsigned int block_count) {
+	if (block_count > buffer_count) {
+		for (size_t i = 0; i < buffer_count; i++) {
+			if (buffers[i].valid && buffers[i].block_num - block_num < block_count) remove_buffer(&buffers[i]);
+		}
+		return;
+	}
+	for (unsigned int i = 0; i < block_count; i++) {
+		struct buffer *cached = lookup_buffer(block_num + i);
+		if (cached) remove_buffer(cached);
+	}
+}
+
+// Zeroes blocks [block_num, block_num + block_count) on the disk (see dev_zero()), dropping their cached
+// copies so that no stale buffer is read or written back over the zeroes.
+// Status: COMPLETE
+int bio_zero(unsigned int block_num, unsigned int block_count) {
+	if (!buffers) return dev_zero(block_num, block_count);
+	pthread_mutex_lock(&bcache_mutex);
+	drop_range(block_num, block_count);
+	int retstat = dev_zero(block_num, block_count);
+	pthread_mutex_unlock(&bcache_mutex);
+	return retstat;
+}
+
+// Discards freed blocks [block_num, block_num + block_count): their cached copies are dropped, dirty or not,
+// and the space is handed back to the host (see dev_discard()).
+// Status: COMPLETE
+void bio_discard(unsigned int block_num, unsigned int block_count) {
+	if (buffers) {
+		pthread_mutex_lock(&bcache_mutex);
+		drop_range(block_num, block_count);
+		pthread_mutex_unlock(&bcache_mutex);
+	}
+	dev_discard(block_num, block_count);
+}
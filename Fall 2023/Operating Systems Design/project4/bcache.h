@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	bcache.h
+ *
+ */
+
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include <stddef.h>
+
+#define BCACHE_DEFAULT_SIZE (8 * 1024 * 1024) // Default memory budget of the buffer cache (in bytes)
+
+struct block_range {
+	unsigned int start;				/* first block */
+	unsigned int count;				/* number of blocks */
+};
+
+struct bcache_stats {
+	unsigned long long hits;		/* blocks served from the cache */
+	unsigned long long misses;		/* blocks that had to be read from the disk */
+	unsigned long long evictions;	/* buffers reclaimed by the CLOCK hand */
+	unsigned long long writebacks;	/* dirty blocks written to the disk */
+	unsigned long long prefetched;	/* blocks loaded by bcache_prefetch() */
+	unsigned long long prefetch_hits;	/* prefetched blocks that were then read */
+	unsigned long long prefetch_unused;	/* prefetched blocks evicted before anyone read them */
+};
+
+int bcache_init(size_t max_bytes);
+int bcache_flush();
+int bcache_flush_ranges(struct block_range *ranges, unsigned int range_count);
+void bcache_destroy();
+void bcache_invalidate(unsigned int block_num);
+int bcache_prefetch(const unsigned int *block_nums, unsigned int block_count);
+void bcache_get_stats(struct bcache_stats *stats);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ *	Tiny File System
+ *	File:	bitmap_bench.c
+ *
+ *	Microbenchmark for the free-bit search used by the inode and data allocators.
+ *	Usage: ./bitmap_bench [bit count] [percent allocated] [allocations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "rufs.h"
+
+unsigned long long TOTAL_INODE_BLOCKS = 0,
+	TOTAL_DATA_BLOCKS = 0;
+
+// The byte-then-bit loop that get_avail_blkno_no_wr() used before the word-level search.
+static long legacy_find(bitmap_t b, size_t bit_count) {
+	size_t byte_size = (bit_count + 7) / 8;
+	for (unsigned int i = 0; i < byte_size; i++) {
+		if (b[i] == 255) continue;
+		for (int j = 0; j < 8; j++) {
+			if (i * 8 + j < bit_count && get_bitmap(b, i * 8 + j) == FALSE) return i * 8 + j;
+		}
+	}
+	return -1;
+}
+
+// get_bit_at_index() as written in project1/bitops.c.
+static int get_bit_at_index(char *bitmap, int index) {
+	int arr_index = index / 8;
+	int set_index = index % 8;
+	char bit_mask = 1 << set_index;
+	return (bitmap[arr_index] & bit_mask) != 0;
+}
+
+static long bitops_find(bitmap_t b, size_t bit_count) {
+	for (size_t i = 0; i < bit_count; i++) {
+		if (!get_bit_at_index((char *)b, i)) return i;
+	}
+	return -1;
+}
+
+static long word_find(bitmap_t b, size_t bit_count) {
+	return find_clear_bit(b, 0, bit_count);
+}
+
+static size_t bench_cursor = 0;
+
+static long next_fit_find(bitmap_t b, size_t bit_count) {
+	return find_clear_bit_next_fit(b, bit_count, &bench_cursor);
+}
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Builds a bitmap with the requested share of bits set at random positions.
+static void fill_bitmap(bitmap_t b, size_t bit_count, unsigned int percent, unsigned int seed) {
+	srand(seed);
+	memset(b, 0xFF, (bit_count + 7) / 8);
+	for (size_t i = 0; i < bit_count; i++) {
+		if ((unsigned int)(rand() % 100) >= percent) unset_bitmap(b, i);
+	}
+}
+
+// Allocates (find + set) until the bitmap is full, then releases what was taken and repeats.
+static double run(const char *name, long (*find)(bitmap_t, size_t), bitmap_t b, size_t bit_count, unsigned int percent, long allocations) {
+	long *taken = malloc(bit_count * sizeof(long));
+	long taken_count = 0;
+	fill_bitmap(b, bit_count, percent, 1);
+	double start = now_ns();
+	for (long n = 0; n < allocations; n++) {
+		long bit = find(b, bit_count);
+		if (bit == -1) {
+			while (taken_count > 0) unset_bitmap(b, taken[--taken_count]);
+			bit = find(b, bit_count);
+		}
+		set_bitmap(b, bit);
+		taken[taken_count++] = bit;
+	}
+	double ns = (now_ns() - start) / allocations;
+	printf("%-24s %10.1f ns/allocation\n", name, ns);
+	free(taken);
+	return ns;
+}
+
+// Compares find_clear_bit() against a bit-by-bit scan on random ranges of random bitmaps.
+static int verify(bitmap_t b, size_t bit_count) {
+	for (unsigned int round = 0; round < 2000; round++) {
+		fill_bitmap(b, bit_count, 90 + round % 11, round);
+		size_t start = rand() % bit_count,
+			end = start + rand() % (bit_count - start + 1);
+		long expected = -1;
+		for (size_t i = start; i < end; i++) {
+			if (!get_bitmap(b, i)) {
+				expected = i;
+				break;
+			}
+		}
+		if (find_clear_bit(b, start, end) != expected) {
+			fprintf(stderr, "mismatch: bits %zu, range [%zu, %zu), expected %ld\n", bit_count, start, end, expected);
+			return -1;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+	size_t bit_count = argc > 1 ? strtoul(argv[1], NULL, 10) : (size_t)(DEFAULT_DISK_SIZE / BLOCK_SIZE);
+	unsigned int percent = argc > 2 ? atoi(argv[2]) : 99;
+	long allocations = argc > 3 ? atol(argv[3]) : 200000;
+	if (bit_count == 0 || percent > 100) {
+		fprintf(stderr, "usage: %s [bit count] [percent allocated] [allocations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	bitmap_t b = malloc((bit_count + 7) / 8 + 64);
+	if (!b) return EXIT_FAILURE;
+	bitmap_select_search(TRUE);
+	if (verify(b, bit_count) != EXIT_SUCCESS) return EXIT_FAILURE;
+	bitmap_select_search(FALSE);
+	if (verify(b, bit_count) != EXIT_SUCCESS) return EXIT_FAILURE;
+	printf("%zu bits, %u%% allocated, %ld allocations\n", bit_count, percent, allocations);
+	run("bitops.c get_bit_at_index", bitops_find, b, bit_count, percent, allocations);
+	run("legacy byte loop", legacy_find, b, bit_count, percent, allocations);
+	bitmap_select_search(TRUE);
+	run("word scan (scalar)", word_find, b, bit_count, percent, allocations);
+	bitmap_select_search(FALSE);
+	run(bitmap_skip_full == bitmap_skip_full_scalar ? "word scan (no SIMD)" : "word scan (SIMD)", word_find, b, bit_count, percent, allocations);
+	run("word scan + next-fit", next_fit_find, b, bit_count, percent, allocations);
+	free(b);
+	return EXIT_SUCCESS;
+}
@@ -7,6 +7,8 @@
  *
  */
 
+#define _GNU_SOURCE // fallocate()
+
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,25 +16,52 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <linux/falloc.h>
 
 #include "block.h"
-
-// Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+#include "uring.h"
 
 int diskfile = -1;
 
-// Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+#define IOV_BATCH 256 // Upper bound on iovec entries per preadv()/pwritev() (well below IOV_MAX)
+
+struct block_ref {
+  unsigned int block_num;
+  void *buf;
+};
+
+#define DIRTY_BITS (8 * sizeof(unsigned long))
+
+// Set by dev_use_mmap(): the disk file mapped shared, with one dirty bit per block for dev_sync(), and one
+// bit per word of those telling which words have any set, so that a sync of a large disk skips clean ranges
+static char *disk_map = NULL;
+static size_t map_blocks = 0;
+static unsigned long *map_dirty = NULL,
+  *map_dirty_words = NULL;
+static int unmapped_writes = 0; // A block outside the mapping was written with pwrite() since the last dev_sync()
+
+// Creates a file which is your new emulated disk, disk_size bytes of zeroes; the file is sparse, so the
+// blocks never written take no space. Returns 0, or -1 (removing the file again) if it cannot be that large.
+int dev_init(const char* diskfile_path, uint64_t disk_size) {
   if (diskfile >= 0) {
-  return;
+  return 0;
   }
   diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
   if (diskfile < 0) {
   perror("disk_open failed");
-  exit(EXIT_FAILURE);
+  return -1;
+  }
+  if (ftruncate(diskfile, disk_size) != 0) {
+  perror("disk_truncate failed");
+  close(diskfile);
+  diskfile = -1;
+  unlink(diskfile_path);
+  return -1;
   }
-  ftruncate(diskfile, DISK_SIZE);
+  return 0;
 }
 
 // Function to open the disk file
@@ -48,16 +77,176 @@ int dev_open(const char* diskfile_path) {
   return 0;
 }
 
-void dev_close() {
+void dev_close(void) {
+  uring_destroy();
+  if (disk_map) {
+    munmap(disk_map, map_blocks * BLOCK_SIZE);
+    free(map_dirty);
+    free(map_dirty_words);
+    disk_map = NULL;
+    map_dirty = map_dirty_words = NULL;
+    map_blocks = 0;
+  }
   if (diskfile >= 0) {
     close(diskfile);
+    diskfile = -1;
+  }
+}
+
+// Switches the vectored transfers below to io_uring with up to queue_depth requests in flight (0 switches
+// back to preadv()/pwritev()). Returns -1 if io_uring is unavailable; the disk keeps working without it.
+int dev_use_uring(unsigned int queue_depth) {
+  return uring_init(diskfile, queue_depth);
+}
+
+// Maps the whole disk file shared, after which block transfers are memcpy()s to and from the mapping and
+// bio_map() hands out pointers into it. Returns -1 if the file cannot be mapped; the disk keeps working
+// through pread()/pwrite().
+int dev_use_mmap() {
+  struct stat st;
+  if (disk_map) return 0;
+  if (fstat(diskfile, &st) < 0 || st.st_size < BLOCK_SIZE) return -1;
+  map_blocks = st.st_size / BLOCK_SIZE;
+  size_t dirty_words = (map_blocks + DIRTY_BITS - 1) / DIRTY_BITS;
+  map_dirty = calloc(dirty_words, sizeof(unsigned long));
+  map_dirty_words = calloc((dirty_words + DIRTY_BITS - 1) / DIRTY_BITS, sizeof(unsigned long));
+  disk_map = mmap(NULL, map_blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+  if (!map_dirty || !map_dirty_words || disk_map == MAP_FAILED) {
+    perror("disk_mmap failed");
+    if (disk_map != MAP_FAILED) munmap(disk_map, map_blocks * BLOCK_SIZE);
+    free(map_dirty);
+    free(map_dirty_words);
+    disk_map = NULL;
+    map_dirty = map_dirty_words = NULL;
+    map_blocks = 0;
+    return -1;
+  }
+  // Faults read only the page they need: pages read around it over a hole would be dirtied along with it and
+  // take space in the host file system. dev_readahead() still asks for what will be read.
+  madvise(disk_map, map_blocks * BLOCK_SIZE, MADV_RANDOM);
+  return 0;
+}
+
+// Returns a pointer to block_num inside the mapping, valid until dev_close(), or NULL if the disk is not
+// mapped there. It is for reading only: writes must go through bio_write*() so that dev_sync() sees them.
+void *bio_map(unsigned int block_num) {
+  return disk_map && block_num < map_blocks ? disk_map + (size_t)block_num * BLOCK_SIZE : NULL;
+}
+
+// Tells the kernel that blocks [block_num, block_num + block_count) will be read soon, so that it can start
+// reading them into its page cache (through the mapping, if there is one).
+void dev_readahead(unsigned int block_num, unsigned int block_count) {
+  if (disk_map) {
+    if (block_num >= map_blocks) return;
+    if (block_count > map_blocks - block_num) block_count = map_blocks - block_num;
+    size_t page = sysconf(_SC_PAGESIZE),
+      from = (size_t)block_num * BLOCK_SIZE / page * page;
+    madvise(disk_map + from, ((size_t)block_num + block_count) * BLOCK_SIZE - from, MADV_WILLNEED);
+    return;
+  }
+  posix_fadvise(diskfile, (off_t)block_num * BLOCK_SIZE, (off_t)block_count * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
+
+// Makes blocks [block_num, block_num + block_count) read as zeroes without writing them where the host file
+// system allows: the range is zeroed in place, or else punched out of the disk file. Only if neither is
+// supported are zeroes written. Callers drop cached copies of the blocks first (see bio_zero()).
+int dev_zero(unsigned int block_num, unsigned int block_count) {
+  off_t offset = (off_t)block_num * BLOCK_SIZE,
+    length = (off_t)block_count * BLOCK_SIZE;
+  if (fallocate(diskfile, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length) == 0
+    || fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) return 0;
+  char *zeroes = calloc(IOV_BATCH, BLOCK_SIZE);
+  if (!zeroes) return -1;
+  int retstat = 0;
+  for (unsigned int done = 0; done < block_count && retstat == 0;) {
+    unsigned int count = block_count - done < IOV_BATCH ? block_count - done : IOV_BATCH;
+    retstat = bio_write_range(block_num + done, count, zeroes);
+    done += count;
+  }
+  free(zeroes);
+  return retstat;
+}
+
+// Hands the space of freed blocks [block_num, block_num + block_count) back to the host by punching them out
+// of the disk file; they read as zeroes afterwards. A host file system without hole punching keeps them as
+// they are. Returns 0 or -1.
+int dev_discard(unsigned int block_num, unsigned int block_count) {
+  return fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)block_num * BLOCK_SIZE, (off_t)block_count * BLOCK_SIZE) == 0 ? 0 : -1;
+}
+
+// Copies blocks between buf and the mapping, marking written ones dirty; -1 if they are not all mapped.
+static int copy_mapped(unsigned int block_num, unsigned int block_count, void *buf, int is_write) {
+  if (!disk_map || (size_t)block_num + block_count > map_blocks) return -1;
+  char *addr = disk_map + (size_t)block_num * BLOCK_SIZE;
+  if (!is_write) {
+    memcpy(buf, addr, (size_t)block_count * BLOCK_SIZE);
+    return 0;
+  }
+  memcpy(addr, buf, (size_t)block_count * BLOCK_SIZE);
+  for (size_t b = block_num; b < (size_t)block_num + block_count; b++) {
+    __atomic_fetch_or(&map_dirty[b / DIRTY_BITS], 1UL << (b % DIRTY_BITS), __ATOMIC_RELEASE);
+    // Set after the block's bit: dev_sync() clears this one first, so it never misses the block.
+    __atomic_fetch_or(&map_dirty_words[b / DIRTY_BITS / DIRTY_BITS], 1UL << (b / DIRTY_BITS % DIRTY_BITS), __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+// msync()s blocks [start, end) of the mapping, widened to whole pages.
+static int sync_mapped_run(size_t start, size_t end) {
+  size_t page = sysconf(_SC_PAGESIZE),
+    from = start * BLOCK_SIZE / page * page;
+  if (msync(disk_map + from, end * BLOCK_SIZE - from, MS_SYNC) < 0) {
+    perror("disk_msync failed");
+    return -1;
+  }
+  return 0;
+}
+
+// Makes every completed write to the disk file durable; a mapped disk only msync()s the runs of blocks
+// written since the last call.
+int dev_sync() {
+  if (!disk_map) {
+    if (fdatasync(diskfile) < 0) {
+      perror("disk_sync failed");
+      return -1;
+    }
+    return 0;
   }
+  int retstat = 0;
+  size_t run_start = 0,
+    run_end = 0;
+  size_t dirty_words = (map_blocks + DIRTY_BITS - 1) / DIRTY_BITS;
+  for (size_t s = 0; s < (dirty_words + DIRTY_BITS - 1) / DIRTY_BITS; s++) {
+    if (__atomic_load_n(&map_dirty_words[s], __ATOMIC_RELAXED) == 0) continue;
+    unsigned long words = __atomic_exchange_n(&map_dirty_words[s], 0, __ATOMIC_ACQUIRE);
+    while (words) {
+      size_t w = s * DIRTY_BITS + __builtin_ctzl(words);
+      words &= words - 1;
+      unsigned long bits = __atomic_exchange_n(&map_dirty[w], 0, __ATOMIC_ACQUIRE);
+      while (bits) {
+        size_t b = w * DIRTY_BITS + __builtin_ctzl(bits);
+        bits &= bits - 1;
+        if (b != run_end) {
+          if (run_end > run_start && sync_mapped_run(run_start, run_end) < 0) retstat = -1;
+          run_start = b;
+        }
+        run_end = b + 1;
+      }
+    }
+  }
+  if (run_end > run_start && sync_mapped_run(run_start, run_end) < 0) retstat = -1;
+  if (__atomic_exchange_n(&unmapped_writes, 0, __ATOMIC_ACQ_REL) && fdatasync(diskfile) < 0) {
+    perror("disk_sync failed");
+    retstat = -1;
+  }
+  return retstat;
 }
 
 // Read a block from the disk
 int bio_read(const int block_num, void *buf) {
   int retstat = 0;
-  retstat = pread(diskfile, buf, BLOCK_SIZE, block_num * BLOCK_SIZE);
+  if (copy_mapped(block_num, 1, buf, 0) == 0) return BLOCK_SIZE;
+  retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
   if (retstat <= 0) {
   memset(buf, 0, BLOCK_SIZE);
   if (retstat < 0)
@@ -69,7 +258,9 @@ int bio_read(const int block_num, void *buf) {
 // Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
   int retstat = 0;
-  retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num * BLOCK_SIZE);
+  if (copy_mapped(block_num, 1, (void *)buf, 1) == 0) return BLOCK_SIZE;
+  if (disk_map) __atomic_store_n(&unmapped_writes, 1, __ATOMIC_RELAXED);
+  retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
   if (retstat < 0) {
     perror("block_write failed");
   }
@@ -80,28 +271,169 @@ int bio_write(const int block_num, const void *buf) {
  * helper functions
  */
 
-// Wrapper function for bio_read(); can read any number of consecutive blocks.
+// Can read any number of consecutive blocks with a single pread(), bypassing the buffer cache.
 // Status: COMPLETE
-int bio_read_multi(unsigned int block_num, unsigned int block_count, void *buf) {
+int bio_read_range(unsigned int block_num, unsigned int block_count, void *buf) {
+  if (copy_mapped(block_num, block_count, buf, 0) == 0) return EXIT_SUCCESS;
   char *buf_ptr = (char *)buf;
-  int retstat = 0;
-  for (unsigned int current_block_num = block_num; current_block_num < block_num + block_count; current_block_num++) {
-    retstat = bio_read(current_block_num, (void *)buf_ptr);
-    if (retstat < 0) return retstat;
-    buf_ptr += BLOCK_SIZE;
+  size_t total = (size_t)block_count * BLOCK_SIZE,
+    done = 0;
+  off_t offset = (off_t)block_num * BLOCK_SIZE;
+  while (done < total) {
+    ssize_t retstat = pread(diskfile, buf_ptr + done, total - done, offset + done);
+    if (retstat < 0) {
+      if (errno == EINTR) continue;
+      perror("block_read failed");
+      return -1;
+    }
+    if (retstat == 0) {
+      // Past the end of the disk file; behave like bio_read() and return zeroes.
+      memset(buf_ptr + done, 0, total - done);
+      break;
+    }
+    done += retstat;
   }
   return EXIT_SUCCESS;
 }
 
-// Wrapper function for bio_write(); can write any number of consecutive blocks.
+// Can write any number of consecutive blocks with a single pwrite(), bypassing the buffer cache.
 // Status: COMPLETE
-int bio_write_multi(unsigned int block_num, unsigned int block_count, void *buf) {
+int bio_write_range(unsigned int block_num, unsigned int block_count, void *buf) {
+  if (copy_mapped(block_num, block_count, buf, 1) == 0) return EXIT_SUCCESS;
+  if (disk_map) __atomic_store_n(&unmapped_writes, 1, __ATOMIC_RELAXED);
   char *buf_ptr = (char *)buf;
-  int retstat = 0;
-  for (unsigned int current_block_num = block_num; current_block_num < block_num + block_count; current_block_num++) {
-    retstat = bio_write(current_block_num, (void *)buf_ptr);
-    if (retstat < 0) return retstat;
-    buf_ptr += BLOCK_SIZE;
+  size_t total = (size_t)block_count * BLOCK_SIZE,
+    done = 0;
+  off_t offset = (off_t)block_num * BLOCK_SIZE;
+  while (done < total) {
+    ssize_t retstat = pwrite(diskfile, buf_ptr + done, total - done, offset + done);
+    if (retstat < 0) {
+      if (errno == EINTR) continue;
+      perror("block_write failed");
+      return -1;
+    }
+    done += retstat;
   }
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+static int compare_block_refs(const void *a, const void *b) {
+  unsigned int block_a = ((const struct block_ref *)a)->block_num,
+    block_b = ((const struct block_ref *)b)->block_num;
+  return block_a < block_b ? -1 : block_a > block_b;
+}
+
+// Transfers one run of consecutive blocks through an iovec; short transfers are resumed.
+static int transfer_run(struct block_ref *refs, unsigned int count, int is_write) {
+  struct iovec iov[IOV_BATCH];
+  size_t total = (size_t)count * BLOCK_SIZE,
+    done = 0;
+  off_t offset = (off_t)refs[0].block_num * BLOCK_SIZE;
+  while (done < total) {
+    // Rebuild the iovec from the first block that is not yet complete.
+    unsigned int first = done / BLOCK_SIZE,
+      iov_count = 0;
+    for (unsigned int i = first; i < count && iov_count < IOV_BATCH; i++, iov_count++) {
+      size_t skip = i == first ? done % BLOCK_SIZE : 0;
+      iov[iov_count].iov_base = (char *)refs[i].buf + skip;
+      iov[iov_count].iov_len = BLOCK_SIZE - skip;
+    }
+    ssize_t retstat = is_write ? pwritev(diskfile, iov, iov_count, offset + done) : preadv(diskfile, iov, iov_count, offset + done);
+    if (retstat < 0) {
+      if (errno == EINTR) continue;
+      perror(is_write ? "block_write failed" : "block_read failed");
+      return -1;
+    }
+    if (retstat == 0) {
+      if (is_write) return -1;
+      for (unsigned int i = first; i < count; i++) {
+        size_t skip = i == first ? done % BLOCK_SIZE : 0;
+        memset((char *)refs[i].buf + skip, 0, BLOCK_SIZE - skip);
+      }
+      break;
+    }
+    done += retstat;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Submits every run of consecutive blocks (split at IOV_BATCH blocks) to io_uring at once and waits for all
+// of them; a run that fails or comes back short is redone with transfer_run().
+static int transfer_runs_uring(struct block_ref *refs, unsigned int block_count, int is_write) {
+  struct uring_op *ops = malloc(block_count * sizeof(struct uring_op));
+  struct iovec *iov = malloc(block_count * sizeof(struct iovec));
+  if (!ops || !iov) {
+    free(ops);
+    free(iov);
+    return -1;
+  }
+  unsigned int op_count = 0;
+  for (unsigned int i = 0; i < block_count; i++) {
+    iov[i].iov_base = refs[i].buf;
+    iov[i].iov_len = BLOCK_SIZE;
+    if (i > 0 && refs[i].block_num == refs[i - 1].block_num + 1 && ops[op_count - 1].iov_count < IOV_BATCH) {
+      ops[op_count - 1].iov_count++;
+      continue;
+    }
+    ops[op_count++] = (struct uring_op){ is_write, (off_t)refs[i].block_num * BLOCK_SIZE, &iov[i], 1, 0 };
+  }
+  int submitted = uring_submit(ops, op_count) == EXIT_SUCCESS,
+    retstat = EXIT_SUCCESS;
+  for (unsigned int op = 0; op < op_count && retstat == EXIT_SUCCESS; op++) {
+    if (submitted && ops[op].result == (ssize_t)ops[op].iov_count * BLOCK_SIZE) continue;
+    retstat = transfer_run(refs + (ops[op].iov - iov), ops[op].iov_count, is_write);
+  }
+  free(ops);
+  free(iov);
+  return retstat;
+}
+
+// Sorts the blocks by number and issues one preadv()/pwritev() per run of consecutive block numbers, or all
+// the runs at once through io_uring if dev_use_uring() enabled it. A mapped disk copies them instead.
+static int transfer_blocks(const unsigned int *block_nums, unsigned int block_count, void **bufs, int is_write) {
+  if (block_count == 0) return EXIT_SUCCESS;
+  if (disk_map) {
+    // Mapped: no system calls, and hence nothing to sort or batch.
+    int retstat = EXIT_SUCCESS;
+    for (unsigned int i = 0; i < block_count && retstat == EXIT_SUCCESS; i++) {
+      if (copy_mapped(block_nums[i], 1, bufs[i], is_write) == 0) continue;
+      retstat = is_write ? bio_write_range(block_nums[i], 1, bufs[i]) : bio_read_range(block_nums[i], 1, bufs[i]);
+    }
+    return retstat;
+  }
+  struct block_ref *refs = malloc(block_count * sizeof(struct block_ref));
+  if (!refs) return -1;
+  for (unsigned int i = 0; i < block_count; i++) {
+    refs[i].block_num = block_nums[i];
+    refs[i].buf = bufs[i];
+  }
+  qsort(refs, block_count, sizeof(struct block_ref), compare_block_refs);
+  int retstat = EXIT_SUCCESS;
+  if (uring_enabled()) {
+    retstat = transfer_runs_uring(refs, block_count, is_write);
+    free(refs);
+    return retstat;
+  }
+  for (unsigned int i = 0; i < block_count && retstat == EXIT_SUCCESS;) {
+    unsigned int run = 1;
+    while (i + run < block_count && refs[i + run].block_num == refs[i].block_num + run) run++;
+    retstat = transfer_run(refs + i, run, is_write);
+    i += run;
+  }
+  free(refs);
+  return retstat;
+}
+
+// Scatter read of arbitrary (not necessarily consecutive) blocks, bypassing the buffer cache.
+// Block block_nums[i] is read into bufs[i]; physically consecutive blocks share a single preadv().
+// Status: COMPLETE
+int bio_readv_range(const unsigned int *block_nums, unsigned int block_count, void **bufs) {
+  return transfer_blocks(block_nums, block_count, bufs, 0);
+}
+
+// Gather write of arbitrary (not necessarily consecutive) blocks, bypassing the buffer cache.
+// bufs[i] is written to block block_nums[i]; physically consecutive blocks share a single pwritev().
+// Status: COMPLETE
+int bio_writev_range(const unsigned int *block_nums, unsigned int block_count, void **bufs) {
+  return transfer_blocks(block_nums, block_count, bufs, 1);
+}
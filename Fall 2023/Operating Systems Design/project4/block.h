@@ -8,14 +8,31 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 4096
 
-void dev_init(const char* diskfile_path);
+int dev_init(const char* diskfile_path, uint64_t disk_size);
 int dev_open(const char* diskfile_path);
-void dev_close();
+void dev_close(void);
+int dev_sync(); // User-defined
+int dev_use_uring(unsigned int queue_depth); // User-defined
+int dev_use_mmap(); // User-defined
+void *bio_map(unsigned int block_num); // User-defined
+void dev_readahead(unsigned int block_num, unsigned int block_count); // User-defined
+int dev_zero(unsigned int block_num, unsigned int block_count); // User-defined
+int dev_discard(unsigned int block_num, unsigned int block_count); // User-defined
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
-int bio_read_multi(unsigned int block_num, unsigned int block_count, void *buf); // User-defined
-int bio_write_multi(unsigned int block_num, unsigned int block_count, void *buf); // User-defined
+int bio_read_multi(unsigned int block_num, unsigned int block_count, void *buf); // User-defined (bcache.c)
+int bio_write_multi(unsigned int block_num, unsigned int block_count, void *buf); // User-defined (bcache.c)
+int bio_read_range(unsigned int block_num, unsigned int block_count, void *buf); // User-defined
+int bio_write_range(unsigned int block_num, unsigned int block_count, void *buf); // User-defined
+int bio_readv(const unsigned int *block_nums, unsigned int block_count, void **bufs); // User-defined (bcache.c)
+int bio_writev(const unsigned int *block_nums, unsigned int block_count, void **bufs); // User-defined (bcache.c)
+int bio_zero(unsigned int block_num, unsigned int block_count); // User-defined (bcache.c)
+void bio_discard(unsigned int block_num, unsigned int block_count); // User-defined (bcache.c)
+int bio_readv_range(const unsigned int *block_nums, unsigned int block_count, void **bufs); // User-defined
+int bio_writev_range(const unsigned int *block_nums, unsigned int block_count, void **bufs); // User-defined
 
 #endif
@@ -0,0 +1,191 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	dcache.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+/*
+ * The dentry cache remembers what get_node_by_path() learned about single path components: that the name
+ * lives in directory `parent` with inode number `ino`, or that it does not exist there (a negative entry).
+ * It is a 4-way set-associative table of 64-byte entries; each set is replaced with its own CLOCK hand.
+ * Entries are dropped one at a time when a name is added to or removed from a directory, and a whole
+ * directory's entries are dropped at once by bumping that directory's generation when its inode is freed.
+ * Generations are kept per slot of a table as large as the cache rather than per inode, so that the cache
+ * costs the same on any disk; directories sharing a slot only lose each other's entries a little early.
+ */
+
+#define DCACHE_WAYS 4
+
+#define ENTRY_EMPTY 0
+#define ENTRY_POSITIVE 1
+#define ENTRY_NEGATIVE 2
+
+struct dentry {
+	uint32_t generation;			/* generation of parent when the entry was made */
+	uint32_t parent;				/* inode number of the directory */
+	uint32_t ino;					/* inode number of the name (positive entries) */
+	uint8_t state;					/* ENTRY_EMPTY, ENTRY_POSITIVE or ENTRY_NEGATIVE */
+	uint8_t referenced;				/* CLOCK reference bit */
+	uint8_t len;					/* length of name */
+	char name[DCACHE_NAME_MAX + 1];	/* name, not null-terminated */
+};
+
+static pthread_mutex_t dcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dentry *dentries = NULL;
+static uint8_t *clock_hands = NULL;
+static uint32_t *generations = NULL; // By parent & (generation_count - 1)
+static size_t set_count = 0,
+	generation_count = 0;
+static struct dcache_stats stats;
+
+static uint32_t *generation(uint32_t parent) {
+	return &generations[parent & (generation_count - 1)];
+}
+
+static size_t hash_dentry(uint32_t parent, const char *name, size_t name_len) {
+	uint32_t hash = 2166136261u ^ parent;
+	for (size_t i = 0; i < name_len; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	return hash & (set_count - 1);
+}
+
+// Returns the live entry for (parent, name), or NULL. Caller holds dcache_mutex.
+static struct dentry *find_dentry(uint32_t parent, const char *name, size_t name_len) {
+	struct dentry *set = &dentries[hash_dentry(parent, name, name_len) * DCACHE_WAYS];
+	for (int i = 0; i < DCACHE_WAYS; i++) {
+		struct dentry *d = &set[i];
+		if (d->state != ENTRY_EMPTY && d->parent == parent && d->generation == *generation(parent) &&
+			d->len == name_len && memcmp(d->name, name, name_len) == 0) return d;
+	}
+	return NULL;
+}
+
+// Fills (or replaces) the entry for (parent, name). Caller holds dcache_mutex.
+static void store_dentry(uint32_t parent, const char *name, size_t name_len, uint8_t state, uint32_t ino) {
+	if (!dentries || name_len > DCACHE_NAME_MAX) return;
+	struct dentry *d = find_dentry(parent, name, name_len);
+	if (!d) {
+		size_t set_index = hash_dentry(parent, name, name_len);
+		struct dentry *set = &dentries[set_index * DCACHE_WAYS];
+		for (int i = 0; i < DCACHE_WAYS && !d; i++) {
+			if (set[i].state == ENTRY_EMPTY || set[i].generation != *generation(set[i].parent)) d = &set[i];
+		}
+		while (!d) {
+			struct dentry *candidate = &set[clock_hands[set_index]];
+			clock_hands[set_index] = (clock_hands[set_index] + 1) % DCACHE_WAYS;
+			if (candidate->referenced) candidate->referenced = 0;
+			else d = candidate;
+		}
+	}
+	d->generation = *generation(parent);
+	d->parent = parent;
+	d->ino = ino;
+	d->state = state;
+	d->referenced = 1;
+	d->len = name_len;
+	memcpy(d->name, name, name_len);
+}
+
+// Allocates a cache of (about) entries components.
+// Status: COMPLETE
+int dcache_init(size_t entries) {
+	if (dentries) return EXIT_SUCCESS;
+	for (set_count = 1; set_count * DCACHE_WAYS < entries; set_count <<= 1);
+	generation_count = set_count * DCACHE_WAYS;
+	dentries = calloc(set_count * DCACHE_WAYS, sizeof(struct dentry));
+	clock_hands = calloc(set_count, sizeof(uint8_t));
+	generations = calloc(generation_count, sizeof(uint32_t));
+	if (!dentries || !clock_hands || !generations) {
+		dcache_destroy();
+		return -1;
+	}
+	memset(&stats, 0, sizeof(struct dcache_stats));
+	return EXIT_SUCCESS;
+}
+
+// Releases the cache.
+// Status: COMPLETE
+void dcache_destroy() {
+	pthread_mutex_lock(&dcache_mutex);
+	free(dentries);
+	free(clock_hands);
+	free(generations);
+	dentries = NULL;
+	clock_hands = NULL;
+	generations = NULL;
+	set_count = generation_count = 0;
+	pthread_mutex_unlock(&dcache_mutex);
+}
+
+// Looks up name in directory parent: DCACHE_HIT (with *out_ino), DCACHE_NEGATIVE or DCACHE_MISS.
+// Status: COMPLETE
+int dcache_lookup(uint32_t parent, const char *name, size_t name_len, uint32_t *out_ino) {
+	if (!dentries || name_len > DCACHE_NAME_MAX) return DCACHE_MISS;
+	pthread_mutex_lock(&dcache_mutex);
+	struct dentry *d = find_dentry(parent, name, name_len);
+	int result = DCACHE_MISS;
+	if (!d) stats.misses++;
+	else if (d->state == ENTRY_NEGATIVE) {
+		d->referenced = 1;
+		stats.negative_hits++;
+		result = DCACHE_NEGATIVE;
+	} else {
+		d->referenced = 1;
+		*out_ino = d->ino;
+		stats.hits++;
+		result = DCACHE_HIT;
+	}
+	pthread_mutex_unlock(&dcache_mutex);
+	return result;
+}
+
+// Records that name in directory parent refers to ino.
+// Status: COMPLETE
+void dcache_insert(uint32_t parent, const char *name, size_t name_len, uint32_t ino) {
+	pthread_mutex_lock(&dcache_mutex);
+	store_dentry(parent, name, name_len, ENTRY_POSITIVE, ino);
+	pthread_mutex_unlock(&dcache_mutex);
+}
+
+// Records that name does not exist in directory parent.
+// Status: COMPLETE
+void dcache_insert_negative(uint32_t parent, const char *name, size_t name_len) {
+	pthread_mutex_lock(&dcache_mutex);
+	store_dentry(parent, name, name_len, ENTRY_NEGATIVE, 0);
+	pthread_mutex_unlock(&dcache_mutex);
+}
+
+// Forgets whatever is known about name in directory parent.
+// Status: COMPLETE
+void dcache_invalidate(uint32_t parent, const char *name, size_t name_len) {
+	if (!dentries || name_len > DCACHE_NAME_MAX) return;
+	pthread_mutex_lock(&dcache_mutex);
+	struct dentry *d = find_dentry(parent, name, name_len);
+	if (d) d->state = ENTRY_EMPTY;
+	pthread_mutex_unlock(&dcache_mutex);
+}
+
+// Forgets every entry whose parent is the given directory, in constant time.
+// Status: COMPLETE
+void dcache_invalidate_dir(uint32_t parent) {
+	if (!dentries) return;
+	pthread_mutex_lock(&dcache_mutex);
+	(*generation(parent))++;
+	pthread_mutex_unlock(&dcache_mutex);
+}
+
+// Copies the hit/miss counters.
+// Status: COMPLETE
+void dcache_get_stats(struct dcache_stats *out_stats) {
+	pthread_mutex_lock(&dcache_mutex);
+	*out_stats = stats;
+	pthread_mutex_unlock(&dcache_mutex);
+}
@@ -0,0 +1,36 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	dcache.h
+ *
+ */
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DCACHE_DEFAULT_ENTRIES 16384 // Default number of cached path components
+#define DCACHE_NAME_MAX 48 // Longer names are not cached
+
+#define DCACHE_MISS 0 // Nothing is known about the name
+#define DCACHE_HIT 1 // The name exists; *out_ino is set
+#define DCACHE_NEGATIVE 2 // The name is known not to exist
+
+struct dcache_stats {
+	unsigned long long hits;		/* lookups answered with an inode number */
+	unsigned long long negative_hits;	/* lookups answered with "does not exist" */
+	unsigned long long misses;		/* lookups that had to search the directory */
+};
+
+int dcache_init(size_t entries);
+void dcache_destroy();
+int dcache_lookup(uint32_t parent, const char *name, size_t name_len, uint32_t *out_ino);
+void dcache_insert(uint32_t parent, const char *name, size_t name_len, uint32_t ino);
+void dcache_insert_negative(uint32_t parent, const char *name, size_t name_len);
+void dcache_invalidate(uint32_t parent, const char *name, size_t name_len);
+void dcache_invalidate_dir(uint32_t parent);
+void dcache_get_stats(struct dcache_stats *stats);
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	delalloc.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "delalloc.h"
+
+/*
+ * Delayed blocks hold file data written into holes before the file has disk blocks for it. rufs.c keeps such
+ * data here and only claims disk blocks when the file is flushed, synced or the budget is exceeded, so that
+ * the whole pending range of a file is placed at once (see flush_delayed()); a file removed before that never
+ * reaches the allocator. Blocks are found by (inode, logical block) through a chained hash table and are
+ * also linked per inode, so that a file's blocks can be listed or dropped without a scan of the table. The
+ * inodes with delayed blocks have records of their own in a second hash table, so that nothing here is sized
+ * by the number of inodes on the disk.
+ * The contents of a file's blocks belong to whoever holds the file's lock; the table itself is guarded by
+ * delalloc_mutex.
+ */
+
+struct dblock {
+	struct dblock *hash_next;		/* next block in the same hash bucket */
+	struct dblock *prev,			/* neighbours in the inode's list, in no particular order */
+		*next;
+	uint32_t logical;				/* logical block number in the file */
+	uint32_t ino;					/* owning inode */
+	char data[BLOCK_SIZE];			/* contents */
+};
+
+struct dinode {
+	struct dinode *hash_next;		/* next inode in the same hash bucket */
+	struct dblock *blocks;			/* the inode's delayed blocks */
+	unsigned int count;				/* length of blocks */
+	uint32_t ino;
+};
+
+static pthread_mutex_t delalloc_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards everything below.
+static struct dblock **buckets = NULL;
+static struct dinode **inode_buckets = NULL; // Same number of buckets; an inode is only here while it has blocks
+static size_t bucket_count = 0,
+	inode_total = 0,
+	budget_blocks = 0,
+	total_blocks = 0;
+static struct delalloc_stats stats;
+
+static size_t hash_block(uint32_t ino, uint32_t logical) {
+	return (ino * 2654435761u ^ logical * 2246822519u) & (bucket_count - 1);
+}
+
+// Returns the record of an inode, or NULL if it has no delayed blocks. Caller holds delalloc_mutex.
+static struct dinode *find_inode(uint32_t ino) {
+	struct dinode *inode = inode_buckets[(ino * 2654435761u) & (bucket_count - 1)];
+	while (inode && inode->ino != ino) inode = inode->hash_next;
+	return inode;
+}
+
+// Returns the delayed block (ino, logical), or NULL. Caller holds delalloc_mutex.
+static struct dblock *find_block(uint32_t ino, uint32_t logical) {
+	for (struct dblock *b = buckets[hash_block(ino, logical)]; b; b = b->hash_next) {
+		if (b->ino == ino && b->logical == logical) return b;
+	}
+	return NULL;
+}
+
+// Unlinks a block from its bucket and its inode's list and frees it, along with the inode's record once that
+// has no blocks left. Caller holds delalloc_mutex.
+static void remove_block(struct dinode *inode, struct dblock *block) {
+	struct dblock **link = &buckets[hash_block(block->ino, block->logical)];
+	while (*link != block) link = &(*link)->hash_next;
+	*link = block->hash_next;
+	if (block->prev) block->prev->next = block->next;
+	else inode->blocks = block->next;
+	if (block->next) block->next->prev = block->prev;
+	total_blocks--;
+	free(block);
+	if (--inode->count > 0) return;
+	struct dinode **inode_link = &inode_buckets[(inode->ino * 2654435761u) & (bucket_count - 1)];
+	while (*inode_link != inode) inode_link = &(*inode_link)->hash_next;
+	*inode_link = inode->hash_next;
+	inode_total--;
+	free(inode);
+}
+
+static int compare_logical(const void *a, const void *b) {
+	uint32_t x = ((const struct delalloc_block *)a)->logical,
+		y = ((const struct delalloc_block *)b)->logical;
+	return x < y ? -1 : x > y;
+}
+
+// Sets up the table; budget is the number of bytes of delayed data past which writers are asked to flush
+// (see delalloc_over_budget()). A budget of 0 disables delayed blocks.
+// Status: COMPLETE
+int delalloc_init(size_t budget) {
+	if (buckets) return EXIT_SUCCESS;
+	budget_blocks = budget / BLOCK_SIZE;
+	if (budget_blocks == 0) return EXIT_SUCCESS;
+	for (bucket_count = 1024; bucket_count < budget_blocks; bucket_count <<= 1);
+	buckets = calloc(bucket_count, sizeof(struct dblock *));
+	inode_buckets = calloc(bucket_count, sizeof(struct dinode *));
+	if (!buckets || !inode_buckets) {
+		delalloc_destroy();
+		return -1;
+	}
+	total_blocks = inode_total = 0;
+	memset(&stats, 0, sizeof(struct delalloc_stats));
+	return EXIT_SUCCESS;
+}
+
+// Releases the table and whatever blocks are still in it.
+// Status: COMPLETE
+void delalloc_destroy() {
+	pthread_mutex_lock(&delalloc_mutex);
+	for (size_t i = 0; buckets && i < bucket_count; i++) {
+		for (struct dblock *b = buckets[i], *next; b; b = next) {
+			next = b->hash_next;
+			free(b);
+		}
+	}
+	for (size_t i = 0; inode_buckets && i < bucket_count; i++) {
+		for (struct dinode *inode = inode_buckets[i], *next; inode; inode = next) {
+			next = inode->hash_next;
+			free(inode);
+		}
+	}
+	free(buckets);
+	free(inode_buckets);
+	buckets = NULL;
+	inode_buckets = NULL;
+	bucket_count = inode_total = budget_blocks = total_blocks = 0;
+	pthread_mutex_unlock(&delalloc_mutex);
+}
+
+// Tells whether writes into holes should be delayed at all.
+// Status: COMPLETE
+int delalloc_enabled() {
+	return buckets != NULL;
+}
+
+// Returns the contents of delayed block (ino, logical), or NULL if there is none. The caller holds the file's
+// lock, at least shared, for as long as it uses them.
+// Status: COMPLETE
+char *delalloc_lookup(uint32_t ino, uint32_t logical) {
+	if (!buckets) return NULL;
+	pthread_mutex_lock(&delalloc_mutex);
+	struct dblock *block = find_inode(ino) ? find_block(ino, logical) : NULL;
+	pthread_mutex_unlock(&delalloc_mutex);
+	return block ? block->data : NULL;
+}
+
+// Adds a zeroed delayed block (ino, logical), which must not exist yet, and returns its contents; NULL when
+// out of memory. The caller holds the file's lock exclusively.
+// Status: COMPLETE
+char *delalloc_insert(uint32_t ino, uint32_t logical) {
+	if (!buckets) return NULL;
+	struct dblock *block = calloc(1, sizeof(struct dblock));
+	if (!block) return NULL;
+	block->ino = ino;
+	block->logical = logical;
+	pthread_mutex_lock(&delalloc_mutex);
+	struct dinode *inode = find_inode(ino);
+	if (!inode && (inode = calloc(1, sizeof(struct dinode)))) {
+		size_t inode_bucket = (ino * 2654435761u) & (bucket_count - 1);
+		inode->ino = ino;
+		inode->hash_next = inode_buckets[inode_bucket];
+		inode_buckets[inode_bucket] = inode;
+		inode_total++;
+	}
+	if (!inode) {
+		pthread_mutex_unlock(&delalloc_mutex);
+		free(block);
+		return NULL;
+	}
+	size_t bucket = hash_block(ino, logical);
+	block->hash_next = buckets[bucket];
+	buckets[bucket] = block;
+	block->next = inode->blocks;
+	if (block->next) block->next->prev = block;
+	inode->blocks = block;
+	inode->count++;
+	total_blocks++;
+	stats.blocks++;
+	pthread_mutex_unlock(&delalloc_mutex);
+	return block->data;
+}
+
+// Returns the number of delayed blocks of an inode.
+// Status: COMPLETE
+unsigned int delalloc_count(uint32_t ino) {
+	if (!buckets) return 0;
+	pthread_mutex_lock(&delalloc_mutex);
+	struct dinode *inode = find_inode(ino);
+	unsigned int count = inode ? inode->count : 0;
+	pthread_mutex_unlock(&delalloc_mutex);
+	return count;
+}
+
+// Lists the inodes that have delayed blocks into a new array (*out_inos, freed by the caller) and returns
+// their number; 0 if there are none or the array cannot be allocated.
+// Status: COMPLETE
+unsigned int delalloc_inodes(uint32_t **out_inos) {
+	*out_inos = NULL;
+	if (!buckets) return 0;
+	pthread_mutex_lock(&delalloc_mutex);
+	unsigned int count = inode_total;
+	uint32_t *inos = count > 0 ? malloc(count * sizeof(uint32_t)) : NULL;
+	if (!inos) count = 0;
+	unsigned int i = 0;
+	for (size_t j = 0; j < bucket_count && i < count; j++) {
+		for (struct dinode *inode = inode_buckets[j]; inode && i < count; inode = inode->hash_next) inos[i++] = inode->ino;
+	}
+	pthread_mutex_unlock(&delalloc_mutex);
+	*out_inos = inos;
+	return count;
+}
+
+// Tells whether the delayed blocks of all files together exceed the budget; the caller then flushes its file.
+// Status: COMPLETE
+int delalloc_over_budget() {
+	if (!buckets) return 0;
+	pthread_mutex_lock(&delalloc_mutex);
+	int over = total_blocks > budget_blocks;
+	if (over) stats.pressure++;
+	pthread_mutex_unlock(&delalloc_mutex);
+	return over;
+}
+
+// Lists the delayed blocks of an inode in logical order into a new array (*out_blocks, freed by the caller)
+// and returns their number; 0 if there are none or the array cannot be allocated. The blocks stay in the
+// table until delalloc_drop(). The caller holds the file's lock exclusively.
+// Status: COMPLETE
+unsigned int delalloc_list(uint32_t ino, struct delalloc_block **out_blocks) {
+	*out_blocks = NULL;
+	if (!buckets) return 0;
+	pthread_mutex_lock(&delalloc_mutex);
+	struct dinode *inode = find_inode(ino);
+	unsigned int count = inode ? inode->count : 0;
+	struct delalloc_block *blocks = count > 0 ? malloc(count * sizeof(struct delalloc_block)) : NULL;
+	if (!blocks) count = 0;
+	unsigned int i = 0;
+	for (struct dblock *b = inode ? inode->blocks : NULL; b && i < count; b = b->next, i++) {
+		blocks[i].logical = b->logical;
+		blocks[i].data = b->data;
+	}
+	pthread_mutex_unlock(&delalloc_mutex);
+	if (count > 1) qsort(blocks, count, sizeof(struct delalloc_block), compare_logical);
+	*out_blocks = blocks;
+	return count;
+}
+
+// Removes the delayed blocks of an inode among logical blocks [first, last] and returns how many there were.
+// written tells whether they went to the disk (or were discarded). The caller holds the file's lock exclusively.
+// Status: COMPLETE
+unsigned int delalloc_drop(uint32_t ino, uint32_t first, uint32_t last, int written) {
+	if (!buckets) return 0;
+	unsigned int dropped = 0;
+	pthread_mutex_lock(&delalloc_mutex);
+	struct dinode *inode = find_inode(ino);
+	unsigned int count = inode ? inode->count : 0;
+	// The last remove_block() frees the record, so the list is not walked past that.
+	for (struct dblock *b = inode ? inode->blocks : NULL, *next; b && dropped < count; b = next) {
+		next = b->next;
+		if (b->logical < first || b->logical > last) continue;
+		dropped++;
+		remove_block(inode, b);
+	}
+	if (written) stats.written += dropped;
+	else stats.dropped += dropped;
+	pthread_mutex_unlock(&delalloc_mutex);
+	return dropped;
+}
+
+// Copies the counters.
+// Status: COMPLETE
+void delalloc_get_stats(struct delalloc_stats *out_stats) {
+	pthread_mutex_lock(&delalloc_mutex);
+	*out_stats = stats;
+	pthread_mutex_unlock(&delalloc_mutex);
+}
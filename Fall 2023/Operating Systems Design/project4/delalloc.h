@@ -0,0 +1,41 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	delalloc.h
+ *
+ */
+
+#ifndef _DELALLOC_H_
+#define _DELALLOC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELALLOC_DEFAULT_KB 16384 // Default budget for file data waiting for disk blocks
+
+// One delayed block, as listed by delalloc_list()
+struct delalloc_block {
+	uint32_t logical;				/* logical block number in the file */
+	char *data;						/* BLOCK_SIZE bytes of contents */
+};
+
+struct delalloc_stats {
+	unsigned long long blocks;		/* blocks written without a disk block */
+	unsigned long long written;		/* of those, given a disk block and written out */
+	unsigned long long dropped;		/* of those, discarded (truncated or removed) before they got one */
+	unsigned long long pressure;	/* writes that found the budget exceeded */
+};
+
+int delalloc_init(size_t budget);
+void delalloc_destroy();
+int delalloc_enabled();
+char *delalloc_lookup(uint32_t ino, uint32_t logical);
+char *delalloc_insert(uint32_t ino, uint32_t logical);
+unsigned int delalloc_count(uint32_t ino);
+unsigned int delalloc_inodes(uint32_t **out_inos);
+int delalloc_over_budget();
+unsigned int delalloc_list(uint32_t ino, struct delalloc_block **out_blocks);
+unsigned int delalloc_drop(uint32_t ino, uint32_t first, uint32_t last, int written);
+void delalloc_get_stats(struct delalloc_stats *stats);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	dirindex.c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirindex.h"
+
+/*
+ * An in-memory index over one directory: a chained hash table from entry name to the inode number and the
+ * (logical block, slot) holding the dirent, plus a stack of unused slots so that dir_add() can place a new
+ * entry without scanning. rufs.c builds an index the first time a directory is searched and keeps it in
+ * step with every change it makes to that directory; the index itself never touches the disk.
+ */
+
+#define DIRINDEX_INITIAL_BUCKETS 16
+
+struct dir_index_entry {
+	struct dir_index_entry *next;	/* next entry in the same hash bucket */
+	uint32_t hash;					/* full hash of the name */
+	uint32_t block_index;			/* logical directory block holding the dirent */
+	uint32_t ino;					/* inode number stored in the dirent */
+	uint16_t slot;					/* dirent index within that block */
+	char name[];					/* null-terminated entry name */
+};
+
+struct dir_slot {
+	uint32_t block_index;
+	uint16_t slot;
+};
+
+struct dir_index {
+	struct dir_index_entry **buckets;
+	size_t bucket_count,
+		entry_count;
+	struct dir_slot *free_slots;	/* stack of unused dirent slots */
+	size_t free_count,
+		free_capacity;
+};
+
+// FNV-1a over the name.
+static uint32_t hash_name(const char *name) {
+	uint32_t hash = 2166136261u;
+	for (; *name; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return hash;
+}
+
+static struct dir_index_entry **find_link(struct dir_index *index, const char *name, uint32_t hash) {
+	struct dir_index_entry **link = &index->buckets[hash & (index->bucket_count - 1)];
+	while (*link && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) link = &(*link)->next;
+	return link;
+}
+
+// Doubles the bucket array once the average chain grows past one entry.
+static int grow(struct dir_index *index) {
+	size_t bucket_count = index->bucket_count * 2;
+	struct dir_index_entry **buckets = calloc(bucket_count, sizeof(struct dir_index_entry *));
+	if (!buckets) return -1;
+	for (size_t i = 0; i < index->bucket_count; i++) {
+		struct dir_index_entry *entry = index->buckets[i];
+		while (entry) {
+			struct dir_index_entry *next = entry->next;
+			entry->next = buckets[entry->hash & (bucket_count - 1)];
+			buckets[entry->hash & (bucket_count - 1)] = entry;
+			entry = next;
+		}
+	}
+	free(index->buckets);
+	index->buckets = buckets;
+	index->bucket_count = bucket_count;
+	return EXIT_SUCCESS;
+}
+
+// Creates an empty index.
+// Status: COMPLETE
+struct dir_index *dirindex_create() {
+	struct dir_index *index = calloc(1, sizeof(struct dir_index));
+	if (!index) return NULL;
+	index->bucket_count = DIRINDEX_INITIAL_BUCKETS;
+	if (!(index->buckets = calloc(index->bucket_count, sizeof(struct dir_index_entry *)))) {
+		free(index);
+		return NULL;
+	}
+	return index;
+}
+
+// Frees an index and all of its entries.
+// Status: COMPLETE
+void dirindex_destroy(struct dir_index *index) {
+	if (!index) return;
+	for (size_t i = 0; i < index->bucket_count; i++) {
+		struct dir_index_entry *entry = index->buckets[i];
+		while (entry) {
+			struct dir_index_entry *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+	free(index->buckets);
+	free(index->free_slots);
+	free(index);
+}
+
+// Records that name lives in (block_index, slot) and refers to ino; fails if the name is already present.
+// Status: COMPLETE
+int dirindex_insert(struct dir_index *index, const char *name, uint32_t ino, uint32_t block_index, uint16_t slot) {
+	uint32_t hash = hash_name(name);
+	if (*find_link(index, name, hash)) return -1;
+	if (index->entry_count >= index->bucket_count && grow(index) != EXIT_SUCCESS) return -1;
+	size_t name_size = strlen(name) + 1;
+	struct dir_index_entry *entry = malloc(sizeof(struct dir_index_entry) + name_size);
+	if (!entry) return -1;
+	entry->hash = hash;
+	entry->block_index = block_index;
+	entry->slot = slot;
+	entry->ino = ino;
+	memcpy(entry->name, name, name_size);
+	struct dir_index_entry **bucket = &index->buckets[hash & (index->bucket_count - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	index->entry_count++;
+	return EXIT_SUCCESS;
+}
+
+// Looks up name; any of the output pointers may be NULL.
+// Status: COMPLETE
+int dirindex_lookup(struct dir_index *index, const char *name, uint32_t *out_ino, uint32_t *out_block_index, uint16_t *out_slot) {
+	struct dir_index_entry *entry = *find_link(index, name, hash_name(name));
+	if (!entry) return -1;
+	if (out_ino) *out_ino = entry->ino;
+	if (out_block_index) *out_block_index = entry->block_index;
+	if (out_slot) *out_slot = entry->slot;
+	return EXIT_SUCCESS;
+}
+
+// Forgets name. The caller returns its slot with dirindex_add_free() once the dirent is cleared on disk.
+// Status: COMPLETE
+int dirindex_remove(struct dir_index *index, const char *name) {
+	struct dir_index_entry **link = find_link(index, name, hash_name(name));
+	if (!*link) return -1;
+	struct dir_index_entry *entry = *link;
+	*link = entry->next;
+	free(entry);
+	index->entry_count--;
+	return EXIT_SUCCESS;
+}
+
+// Makes (block_index, slot) available to dirindex_take_free().
+// Status: COMPLETE
+int dirindex_add_free(struct dir_index *index, uint32_t block_index, uint16_t slot) {
+	if (index->free_count == index->free_capacity) {
+		size_t capacity = index->free_capacity ? index->free_capacity * 2 : DIRINDEX_INITIAL_BUCKETS;
+		struct dir_slot *free_slots = realloc(index->free_slots, capacity * sizeof(struct dir_slot));
+		if (!free_slots) return -1;
+		index->free_slots = free_slots;
+		index->free_capacity = capacity;
+	}
+	index->free_slots[index->free_count].block_index = block_index;
+	index->free_slots[index->free_count].slot = slot;
+	index->free_count++;
+	return EXIT_SUCCESS;
+}
+
+// Pops an unused slot; fails when every slot of the directory's blocks is taken.
+// Status: COMPLETE
+int dirindex_take_free(struct dir_index *index, uint32_t *out_block_index, uint16_t *out_slot) {
+	if (index->free_count == 0) return -1;
+	index->free_count--;
+	*out_block_index = index->free_slots[index->free_count].block_index;
+	*out_slot = index->free_slots[index->free_count].slot;
+	return EXIT_SUCCESS;
+}
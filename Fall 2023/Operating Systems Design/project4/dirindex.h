@@ -0,0 +1,23 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	dirindex.h
+ *
+ */
+
+#ifndef _DIRINDEX_H_
+#define _DIRINDEX_H_
+
+#include <stdint.h>
+
+struct dir_index;
+
+struct dir_index *dirindex_create();
+void dirindex_destroy(struct dir_index *index);
+int dirindex_insert(struct dir_index *index, const char *name, uint32_t ino, uint32_t block_index, uint16_t slot);
+int dirindex_lookup(struct dir_index *index, const char *name, uint32_t *out_ino, uint32_t *out_block_index, uint16_t *out_slot);
+int dirindex_remove(struct dir_index *index, const char *name);
+int dirindex_add_free(struct dir_index *index, uint32_t block_index, uint16_t slot);
+int dirindex_take_free(struct dir_index *index, uint32_t *out_block_index, uint16_t *out_slot);
+
+#endif
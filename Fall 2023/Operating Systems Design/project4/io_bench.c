@@ -0,0 +1,326 @@
+/*
+ *	Tiny File System
+ *	File:	io_bench.c
+ *
+ *	Parallel throughput and latency benchmark, run against a mounted RUFS (or any directory) like
+ *	stress_tests. Every thread works on its own files with pread()/pwrite() of a fixed I/O size.
+ *	Usage: ./io_bench [-d dir] [-t threads] [-f files per thread] [-s file size] [-b I/O size]
+ *	                  [-n random ops per thread] [-w workloads] [-r seed] [-y] [-H] [-k]
+ *	Sizes accept K, M and G suffixes. workloads is a comma-separated list of seq-write, seq-read,
+ *	rand-write and rand-read (default: all four, in that order). -y adds an fsync() of every file to the
+ *	end of each write phase, -H prints the latency histogram, and -k keeps the files afterwards.
+ *	Each phase prints one JSON object per line. Reads are served from the kernel page cache unless the
+ *	file system is mounted with -o direct_io.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Same default mount point as stress_tests.c */
+#define TESTDIR "/tmp/netID/mountdir"
+
+#define MAX_THREADS 256
+#define PATHLEN 1024
+
+/*
+ * Latencies are kept in a log-linear histogram: values below 2^SUB_BITS ns have one bucket each, and
+ * every higher power of two is split into 2^SUB_BITS equal buckets, so each bucket is within about 3% of
+ * the values it holds.
+ */
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKET_COUNT ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+enum workload { SEQ_WRITE, SEQ_READ, RAND_WRITE, RAND_READ, WORKLOAD_COUNT };
+
+static const char *workload_names[WORKLOAD_COUNT] = { "seq-write", "seq-read", "rand-write", "rand-read" };
+
+struct config {
+	const char *dir;
+	int threads,
+		files,
+		fsync_writes,
+		histogram,
+		keep;
+	size_t file_size,
+		io_size;
+	long random_ops;
+	unsigned int seed;
+};
+
+struct histogram {
+	uint64_t counts[BUCKET_COUNT];
+	uint64_t total,
+		min,
+		max;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	enum workload workload;
+	struct config *config;
+	pthread_barrier_t *barrier;
+	struct histogram histogram;
+	uint64_t ops,
+		bytes,
+		start_ns,
+		end_ns;
+	int error;
+};
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t value) {
+	if (value < SUB_COUNT) return value;
+	int msb = 63 - __builtin_clzll(value);
+	return (msb - SUB_BITS + 1) * SUB_COUNT + (int)((value >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+// Largest value that falls into bucket.
+static uint64_t bucket_limit(int bucket) {
+	if (bucket < SUB_COUNT) return bucket;
+	int shift = bucket / SUB_COUNT - 1;
+	uint64_t base = (uint64_t)(SUB_COUNT + bucket % SUB_COUNT) << shift;
+	return base + ((uint64_t)1 << shift) - 1;
+}
+
+static void histogram_add(struct histogram *h, uint64_t value) {
+	h->counts[bucket_of(value)]++;
+	if (h->total == 0 || value < h->min) h->min = value;
+	if (value > h->max) h->max = value;
+	h->total++;
+}
+
+static void histogram_merge(struct histogram *into, struct histogram *from) {
+	if (from->total == 0) return;
+	for (int i = 0; i < BUCKET_COUNT; i++) into->counts[i] += from->counts[i];
+	if (into->total == 0 || from->min < into->min) into->min = from->min;
+	if (from->max > into->max) into->max = from->max;
+	into->total += from->total;
+}
+
+// Upper bound of the value below which a fraction q of the samples lie.
+static uint64_t histogram_percentile(struct histogram *h, double q) {
+	if (h->total == 0) return 0;
+	uint64_t rank = (uint64_t)(q * h->total + 0.5),
+		seen = 0;
+	if (rank == 0) rank = 1;
+	for (int i = 0; i < BUCKET_COUNT; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) return bucket_limit(i) < h->max ? bucket_limit(i) : h->max;
+	}
+	return h->max;
+}
+
+static size_t parse_size(const char *text) {
+	char *end;
+	double value = strtod(text, &end);
+	switch (*end) {
+		case 'k': case 'K': value *= 1024; break;
+		case 'm': case 'M': value *= 1024 * 1024; break;
+		case 'g': case 'G': value *= 1024.0 * 1024 * 1024; break;
+	}
+	return (size_t)value;
+}
+
+static void file_path(char *path, struct config *config, int thread, int file) {
+	snprintf(path, PATHLEN, "%s/io_bench.%d.%d", config->dir, thread, file);
+}
+
+// xorshift64*, one state per thread.
+static uint64_t next_random(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ull;
+}
+
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+	struct config *config = w->config;
+	int *fds = malloc(config->files * sizeof(int));
+	char *buffer = NULL;
+	char path[PATHLEN];
+	int writing = w->workload == SEQ_WRITE || w->workload == RAND_WRITE;
+	if (!fds || posix_memalign((void **)&buffer, 4096, config->io_size) != 0) {
+		w->error = ENOMEM;
+		buffer = NULL;
+	}
+	for (int f = 0; fds && f < config->files; f++) fds[f] = -1;
+	for (int f = 0; f < config->files && w->error == 0; f++) {
+		file_path(path, config, w->id, f);
+		if ((fds[f] = open(path, writing ? O_RDWR | O_CREAT : O_RDONLY, 0666)) < 0) w->error = errno;
+	}
+	if (buffer) memset(buffer, 0x61 + w->id % 26, config->io_size);
+	uint64_t state = config->seed * 0x9E3779B97F4A7C15ull + w->id + 1;
+	size_t blocks_per_file = config->file_size / config->io_size;
+	pthread_barrier_wait(w->barrier);
+	w->start_ns = now_ns();
+	long ops = w->workload == SEQ_WRITE || w->workload == SEQ_READ ? (long)(blocks_per_file * config->files) : config->random_ops;
+	for (long n = 0; n < ops && w->error == 0; n++) {
+		int f;
+		off_t offset;
+		if (w->workload == SEQ_WRITE || w->workload == SEQ_READ) {
+			f = n / blocks_per_file;
+			offset = (off_t)(n % blocks_per_file) * config->io_size;
+		} else {
+			f = next_random(&state) % config->files;
+			offset = (off_t)(next_random(&state) % blocks_per_file) * config->io_size;
+		}
+		uint64_t start = now_ns();
+		ssize_t done = writing ? pwrite(fds[f], buffer, config->io_size, offset) : pread(fds[f], buffer, config->io_size, offset);
+		histogram_add(&w->histogram, now_ns() - start);
+		if (done != (ssize_t)config->io_size) {
+			w->error = done < 0 ? errno : EIO;
+			break;
+		}
+		w->ops++;
+		w->bytes += done;
+	}
+	for (int f = 0; f < config->files && writing && config->fsync_writes && w->error == 0; f++) {
+		if (fsync(fds[f]) != 0) w->error = errno;
+	}
+	w->end_ns = now_ns();
+	for (int f = 0; fds && f < config->files; f++) {
+		if (fds[f] >= 0) close(fds[f]);
+	}
+	free(fds);
+	free(buffer);
+	return NULL;
+}
+
+// Runs one workload on every thread and prints its result line (marked as such if it only prepares the
+// files for later phases). Returns 0 or an errno value.
+static int run_phase(struct config *config, enum workload workload, int setup) {
+	struct worker *workers = calloc(config->threads, sizeof(struct worker));
+	struct histogram *total = calloc(1, sizeof(struct histogram));
+	pthread_barrier_t barrier;
+	if (!workers || !total) {
+		free(workers);
+		free(total);
+		return ENOMEM;
+	}
+	pthread_barrier_init(&barrier, NULL, config->threads + 1);
+	for (int i = 0; i < config->threads; i++) {
+		workers[i] = (struct worker){ .id = i, .workload = workload, .config = config, .barrier = &barrier };
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+	// Files are opened before the barrier; the phase lasts from the first thread's start to the last
+	// thread's end (including any fsync).
+	pthread_barrier_wait(&barrier);
+	uint64_t ops = 0,
+		bytes = 0,
+		start = UINT64_MAX,
+		end = 0;
+	int error = 0;
+	for (int i = 0; i < config->threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].start_ns < start) start = workers[i].start_ns;
+		if (workers[i].end_ns > end) end = workers[i].end_ns;
+		histogram_merge(total, &workers[i].histogram);
+		ops += workers[i].ops;
+		bytes += workers[i].bytes;
+		if (workers[i].error && !error) error = workers[i].error;
+	}
+	pthread_barrier_destroy(&barrier);
+	double seconds = end > start ? (end - start) / 1e9 : 1e-9;
+	printf("{%s\"workload\":\"%s\",\"threads\":%d,\"files_per_thread\":%d,\"file_size\":%zu,\"io_size\":%zu,"
+		"\"ops\":%llu,\"bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.2f,\"iops\":%.1f,"
+		"\"latency_ns\":{\"min\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+		setup ? "\"setup\":true," : "", workload_names[workload], config->threads, config->files, config->file_size, config->io_size,
+		(unsigned long long)ops, (unsigned long long)bytes, seconds, bytes / seconds / (1024 * 1024), ops / seconds,
+		(unsigned long long)total->min, (unsigned long long)histogram_percentile(total, 0.50),
+		(unsigned long long)histogram_percentile(total, 0.99), (unsigned long long)histogram_percentile(total, 0.999),
+		(unsigned long long)total->max);
+	if (config->histogram) {
+		// [upper bound in ns, count] for every non-empty bucket
+		printf(",\"histogram\":[");
+		for (int i = 0, first = 1; i < BUCKET_COUNT; i++) {
+			if (total->counts[i] == 0) continue;
+			printf("%s[%llu,%llu]", first ? "" : ",", (unsigned long long)bucket_limit(i), (unsigned long long)total->counts[i]);
+			first = 0;
+		}
+		printf("]");
+	}
+	if (error) printf(",\"error\":\"%s\"", strerror(error));
+	printf("}\n");
+	fflush(stdout);
+	free(workers);
+	free(total);
+	return error;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-d dir] [-t threads] [-f files per thread] [-s file size] [-b I/O size]\n"
+		"       [-n random ops per thread] [-w seq-write,seq-read,rand-write,rand-read] [-r seed] [-y] [-H] [-k]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	struct config config = { TESTDIR, 4, 1, 0, 0, 0, 8 * 1024 * 1024, 128 * 1024, -1, 1 };
+	int selected[WORKLOAD_COUNT] = { 1, 1, 1, 1 },
+		opt;
+	while ((opt = getopt(argc, argv, "d:t:f:s:b:n:w:r:yHk")) != -1) {
+		switch (opt) {
+			case 'd': config.dir = optarg; break;
+			case 't': config.threads = atoi(optarg); break;
+			case 'f': config.files = atoi(optarg); break;
+			case 's': config.file_size = parse_size(optarg); break;
+			case 'b': config.io_size = parse_size(optarg); break;
+			case 'n': config.random_ops = atol(optarg); break;
+			case 'r': config.seed = strtoul(optarg, NULL, 10); break;
+			case 'y': config.fsync_writes = 1; break;
+			case 'H': config.histogram = 1; break;
+			case 'k': config.keep = 1; break;
+			case 'w':
+				memset(selected, 0, sizeof(selected));
+				for (char *name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+					int w = 0;
+					while (w < WORKLOAD_COUNT && strcmp(name, workload_names[w]) != 0) w++;
+					if (w == WORKLOAD_COUNT) {
+						usage(argv[0]);
+						return EXIT_FAILURE;
+					}
+					selected[w] = 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (config.threads < 1 || config.threads > MAX_THREADS || config.files < 1 || config.io_size == 0 || config.file_size < config.io_size) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	// By default a random phase issues as many requests as a sequential pass over the thread's files.
+	if (config.random_ops < 0) config.random_ops = (long)(config.file_size / config.io_size) * config.files;
+	int error = 0;
+	// Read phases need whole files, which only seq-write lays out; without it, write them before any phase runs.
+	if (!selected[SEQ_WRITE] && (selected[SEQ_READ] || selected[RAND_READ])) {
+		error = run_phase(&config, SEQ_WRITE, 1);
+	}
+	for (int w = 0; w < WORKLOAD_COUNT && !error; w++) {
+		if (selected[w]) error = run_phase(&config, w, 0);
+	}
+	for (int t = 0; t < config.threads && !config.keep; t++) {
+		for (int f = 0; f < config.files; f++) {
+			char path[PATHLEN];
+			file_path(path, &config, t, f);
+			unlink(path);
+		}
+	}
+	return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,628 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	journal.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "block.h"
+#include "bcache.h"
+#include "journal.h"
+
+/*
+ * Write-ahead journal for metadata. rufs.c hands every metadata change to the running transaction instead of
+ * writing it home: directory and extent tree blocks as images (journal_write()), and changes to the resident
+ * inode table and bitmaps as block numbers (journal_dirty()) whose contents are copied when the transaction
+ * commits. Operations bracket their changes with journal_start()/journal_stop(), so a commit can wait until
+ * none is half done; every operation that finished in the meantime goes out in the same commit.
+ *
+ * A commit is one sequential write to the log region (a descriptor block, the images and a commit block with
+ * a checksum over both) followed by one fdatasync(). Committed images are kept in memory and only written to
+ * their home locations by a checkpoint, once the log is full or at unmount; the log then starts over. Until
+ * then journal_read() serves them, as the home copy is stale. Blocks freed while an image of them is in the
+ * log get a revoke record so that a replay does not overwrite their new contents.
+ *
+ * File data is not journaled (like ext4's data=writeback): after a crash a file may show stale data in blocks
+ * it was extending into, but the metadata is always that of the last commit. journal_init() replays the log.
+ */
+
+#define JOURNAL_HASH_SIZE 256
+
+#define T_RUNNING 0 // Operations may join
+#define T_LOCKED 1 // Waiting for its operations to finish and its resident blocks to be copied
+
+struct jbuf {
+	unsigned int block_num;			/* home block */
+	unsigned char revoked;			/* freed while the transaction was being committed */
+	char *data;						/* block image; NULL for a resident block that is not yet copied */
+	struct jbuf *hash_next;			/* next buffer in the same hash bucket */
+	struct jbuf *next;				/* next buffer of the same map */
+};
+
+struct block_map {
+	struct jbuf *buckets[JOURNAL_HASH_SIZE];
+	struct jbuf *list;
+	unsigned int count;
+};
+
+struct transaction {
+	uint64_t id;					/* in-memory number; committed_id reaches it once it is durable */
+	int state;						/* T_RUNNING or T_LOCKED */
+	unsigned int updates;			/* operations between journal_start() and journal_stop() */
+	struct block_map blocks;
+	unsigned int *revokes;
+	unsigned int revoke_count,
+		revoke_capacity;
+};
+
+struct region {
+	unsigned int first_blk,
+		block_count;
+	char *memory;					/* resident copy of the blocks */
+	pthread_mutex_t *lock;			/* held while the resident copy is read */
+};
+
+#define MAX_REGIONS 4
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static struct transaction *running = NULL,
+	*committing = NULL;				/* being written; its images still serve reads */
+static struct block_map checkpoint_map;	/* committed images not yet written home */
+static uint64_t committed_id = 0;
+static unsigned int log_start = 0,
+	log_blocks = 0,
+	log_head = 1,					/* next free block of the log, relative to log_start */
+	commit_interval = 0;
+static uint64_t log_sequence = 1;	/* sequence of the next transaction written to the log */
+static int checkpointing = 0,
+	shutting_down = 0,
+	thread_started = 0;
+static pthread_t commit_thread;
+static struct region regions[MAX_REGIONS];
+static unsigned int region_count = 0;
+static struct journal_stats stats;
+
+static size_t hash_block(unsigned int block_num) {
+	return (block_num * 2654435761u) & (JOURNAL_HASH_SIZE - 1);
+}
+
+static struct jbuf *map_find(struct block_map *map, unsigned int block_num) {
+	for (struct jbuf *buf = map->buckets[hash_block(block_num)]; buf; buf = buf->hash_next) {
+		if (buf->block_num == block_num) return buf;
+	}
+	return NULL;
+}
+
+static void map_insert(struct block_map *map, struct jbuf *buf) {
+	size_t bucket = hash_block(buf->block_num);
+	buf->hash_next = map->buckets[bucket];
+	map->buckets[bucket] = buf;
+	buf->next = map->list;
+	map->list = buf;
+	map->count++;
+}
+
+static void map_remove(struct block_map *map, struct jbuf *buf) {
+	struct jbuf **link = &map->buckets[hash_block(buf->block_num)];
+	while (*link != buf) link = &(*link)->hash_next;
+	*link = buf->hash_next;
+	for (link = &map->list; *link != buf; link = &(*link)->next);
+	*link = buf->next;
+	map->count--;
+	free(buf->data);
+	free(buf);
+}
+
+static void map_clear(struct block_map *map) {
+	for (struct jbuf *buf = map->list, *next; buf; buf = next) {
+		next = buf->next;
+		free(buf->data);
+		free(buf);
+	}
+	memset(map, 0, sizeof(struct block_map));
+}
+
+static struct transaction *new_transaction(uint64_t id) {
+	struct transaction *tx = calloc(1, sizeof(struct transaction));
+	if (tx) tx->id = id;
+	return tx;
+}
+
+static void free_transaction(struct transaction *tx) {
+	if (!tx) return;
+	map_clear(&tx->blocks);
+	free(tx->revokes);
+	free(tx);
+}
+
+static uint32_t checksum(uint32_t hash, const void *data, size_t size) {
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 16777619u;
+	return hash;
+}
+
+// Revokes and images beyond what one descriptor block can list are not representable in the log.
+static unsigned int descriptor_capacity() {
+	return (BLOCK_SIZE - sizeof(struct journal_descriptor)) / sizeof(uint32_t);
+}
+
+static int write_superblock(uint64_t first_sequence) {
+	struct journal_superblock *jsb = calloc(1, BLOCK_SIZE);
+	if (!jsb) return -1;
+	jsb->header.magic = JOURNAL_MAGIC;
+	jsb->header.type = JOURNAL_SUPERBLOCK;
+	jsb->header.sequence = first_sequence;
+	jsb->block_count = log_blocks;
+	int retstat = bio_write_range(log_start, 1, jsb) == EXIT_SUCCESS ? dev_sync() : -1;
+	free(jsb);
+	return retstat;
+}
+
+// Writes every committed image home and empties the log. Only the committing thread calls this.
+static int checkpoint() {
+	pthread_mutex_lock(&journal_mutex);
+	checkpointing = 1;
+	unsigned int count = checkpoint_map.count;
+	unsigned int *block_nums = malloc((count + 1) * sizeof(unsigned int));
+	void **bufs = malloc((count + 1) * sizeof(void *));
+	int retstat = block_nums && bufs ? EXIT_SUCCESS : -1;
+	unsigned int i = 0;
+	for (struct jbuf *buf = checkpoint_map.list; buf && retstat == EXIT_SUCCESS; buf = buf->next, i++) {
+		block_nums[i] = buf->block_num;
+		bufs[i] = buf->data;
+	}
+	pthread_mutex_unlock(&journal_mutex);
+	// journal_forget() waits while checkpointing is set, so the images cannot go away underneath.
+	if (retstat == EXIT_SUCCESS) retstat = bio_writev_range(block_nums, count, bufs);
+	for (i = 0; retstat == EXIT_SUCCESS && i < count; i++) bcache_invalidate(block_nums[i]);
+	if (retstat == EXIT_SUCCESS) retstat = dev_sync();
+	// Only once the home locations are durable may the log forget its transactions.
+	if (retstat == EXIT_SUCCESS) retstat = write_superblock(log_sequence);
+	free(block_nums);
+	free(bufs);
+	pthread_mutex_lock(&journal_mutex);
+	if (retstat == EXIT_SUCCESS) {
+		map_clear(&checkpoint_map);
+		log_head = 1;
+		stats.checkpoints++;
+	} else fprintf(stderr, "rufs: journal checkpoint failed\n");
+	checkpointing = 0;
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_mutex);
+	return retstat;
+}
+
+// Fallback for a transaction that cannot be logged: writes it home directly, which is not crash-atomic.
+static int write_home(struct transaction *tx) {
+	unsigned int *block_nums = malloc((tx->blocks.count + 1) * sizeof(unsigned int));
+	void **bufs = malloc((tx->blocks.count + 1) * sizeof(void *));
+	int retstat = block_nums && bufs ? EXIT_SUCCESS : -1;
+	unsigned int count = 0;
+	pthread_mutex_lock(&journal_mutex);
+	checkpointing = 1;
+	for (struct jbuf *buf = tx->blocks.list; buf && retstat == EXIT_SUCCESS; buf = buf->next) {
+		if (!buf->data || buf->revoked) continue;
+		block_nums[count] = buf->block_num;
+		bufs[count++] = buf->data;
+	}
+	pthread_mutex_unlock(&journal_mutex);
+	if (retstat == EXIT_SUCCESS) retstat = bio_writev_range(block_nums, count, bufs);
+	for (unsigned int i = 0; retstat == EXIT_SUCCESS && i < count; i++) bcache_invalidate(block_nums[i]);
+	if (retstat == EXIT_SUCCESS) retstat = dev_sync();
+	free(block_nums);
+	free(bufs);
+	pthread_mutex_lock(&journal_mutex);
+	checkpointing = 0;
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_mutex);
+	return retstat;
+}
+
+// Appends a transaction to the log with one sequential write and makes it durable.
+static int write_log(struct transaction *tx) {
+	unsigned int count = tx->blocks.count + 2;
+	unsigned int *block_nums = malloc(count * sizeof(unsigned int));
+	void **bufs = malloc(count * sizeof(void *));
+	struct journal_descriptor *descriptor = calloc(1, BLOCK_SIZE);
+	struct journal_commit *commit = calloc(1, BLOCK_SIZE);
+	int retstat = block_nums && bufs && descriptor && commit ? EXIT_SUCCESS : -1;
+	if (retstat == EXIT_SUCCESS) {
+		descriptor->header.magic = commit->header.magic = JOURNAL_MAGIC;
+		descriptor->header.type = JOURNAL_DESCRIPTOR;
+		commit->header.type = JOURNAL_COMMIT;
+		descriptor->header.sequence = commit->header.sequence = log_sequence;
+		unsigned int i = 0;
+		for (struct jbuf *buf = tx->blocks.list; buf; buf = buf->next, i++) {
+			descriptor->blocks[i] = buf->block_num;
+			block_nums[i + 1] = log_start + log_head + i + 1;
+			bufs[i + 1] = buf->data;
+		}
+		descriptor->block_count = i;
+		descriptor->revoke_count = tx->revoke_count;
+		memcpy(descriptor->blocks + i, tx->revokes, tx->revoke_count * sizeof(uint32_t));
+		uint32_t hash = checksum(2166136261u, descriptor, BLOCK_SIZE);
+		for (i = 1; i < count - 1; i++) hash = checksum(hash, bufs[i], BLOCK_SIZE);
+		commit->checksum = hash;
+		block_nums[0] = log_start + log_head;
+		bufs[0] = descriptor;
+		block_nums[count - 1] = log_start + log_head + count - 1;
+		bufs[count - 1] = commit;
+		// The commit block carries a checksum over everything before it, so all of it can go out in one
+		// write: a torn transaction fails the check and is ignored by the replay.
+		retstat = bio_writev_range(block_nums, count, bufs);
+		if (retstat == EXIT_SUCCESS) retstat = dev_sync();
+	}
+	if (retstat == EXIT_SUCCESS) {
+		pthread_mutex_lock(&journal_mutex);
+		log_head += count;
+		log_sequence++;
+		stats.commits++;
+		stats.blocks_logged += count - 2;
+		pthread_mutex_unlock(&journal_mutex);
+	}
+	free(block_nums);
+	free(bufs);
+	free(descriptor);
+	free(commit);
+	return retstat;
+}
+
+// Copies the resident blocks named by journal_dirty() into the transaction.
+static int capture_regions(struct transaction *tx) {
+	for (struct jbuf *buf = tx->blocks.list; buf; buf = buf->next) {
+		if (buf->data) continue;
+		struct region *region = NULL;
+		for (unsigned int i = 0; i < region_count && !region; i++) {
+			if (buf->block_num - regions[i].first_blk < regions[i].block_count) region = &regions[i];
+		}
+		if (!region || !(buf->data = malloc(BLOCK_SIZE))) return -1;
+		pthread_mutex_lock(region->lock);
+		memcpy(buf->data, region->memory + (size_t)(buf->block_num - region->first_blk) * BLOCK_SIZE, BLOCK_SIZE);
+		pthread_mutex_unlock(region->lock);
+	}
+	return EXIT_SUCCESS;
+}
+
+// Commits the running transaction. Called and returns with journal_mutex held; no commit may be in progress.
+static void commit_locked() {
+	struct transaction *tx = running,
+		*next = new_transaction(tx->id + 1);
+	if (!next) {
+		pthread_mutex_unlock(&journal_mutex);
+		perror("journal commit failed");
+		pthread_mutex_lock(&journal_mutex);
+		return;
+	}
+	// New operations wait until the ones in this transaction are done and its resident blocks are copied.
+	tx->state = T_LOCKED;
+	committing = tx;
+	while (tx->updates > 0) pthread_cond_wait(&journal_cond, &journal_mutex);
+	pthread_mutex_unlock(&journal_mutex);
+	int retstat = capture_regions(tx);
+	pthread_mutex_lock(&journal_mutex);
+	running = next;
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_mutex);
+	int in_place = 0;
+	if (retstat == EXIT_SUCCESS && (tx->blocks.count > 0 || tx->revoke_count > 0)) {
+		unsigned int needed = tx->blocks.count + 2;
+		if (needed > log_blocks - 1 || tx->blocks.count + tx->revoke_count > descriptor_capacity()) {
+			fprintf(stderr, "rufs: transaction of %u blocks does not fit the journal; writing it in place\n", tx->blocks.count);
+			retstat = checkpoint();
+			if (retstat == EXIT_SUCCESS && (retstat = write_home(tx)) == EXIT_SUCCESS) in_place = 1;
+		} else {
+			if (log_head + needed > log_blocks) retstat = checkpoint();
+			if (retstat == EXIT_SUCCESS) retstat = write_log(tx);
+		}
+	}
+	if (retstat != EXIT_SUCCESS) fprintf(stderr, "rufs: journal commit failed\n");
+	pthread_mutex_lock(&journal_mutex);
+	// The committed images replace older ones until the next checkpoint writes them home. Images that
+	// failed to commit stay as well: they are the current contents, and the next checkpoint retries them.
+	while (tx->blocks.list) {
+		struct jbuf *buf = tx->blocks.list,
+			*old = map_find(&checkpoint_map, buf->block_num);
+		tx->blocks.list = buf->next;
+		if (buf->revoked || !buf->data || in_place) {
+			free(buf->data);
+			free(buf);
+			continue;
+		}
+		if (old) map_remove(&checkpoint_map, old);
+		map_insert(&checkpoint_map, buf);
+	}
+	memset(&tx->blocks, 0, sizeof(struct block_map));
+	committing = NULL;
+	committed_id = tx->id;
+	free_transaction(tx);
+	pthread_cond_broadcast(&journal_cond);
+}
+
+// Waits until transaction id is durable, committing it (and whatever joined it) if nobody else is.
+// Called and returns with journal_mutex held; the caller must not be inside journal_start()/journal_stop().
+static void wait_for_commit(uint64_t id) {
+	while (committed_id < id) {
+		if (!committing && running->id == id) commit_locked();
+		else pthread_cond_wait(&journal_cond, &journal_mutex);
+	}
+}
+
+// Background commits every commit_interval milliseconds, so that operations need not wait for the disk.
+static void *commit_thread_main(void *arg) {
+	pthread_mutex_lock(&journal_mutex);
+	while (!shutting_down) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += commit_interval / 1000;
+		deadline.tv_nsec += (long)(commit_interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&journal_cond, &journal_mutex, &deadline);
+		if (!shutting_down && (running->blocks.count > 0 || running->revoke_count > 0)) wait_for_commit(running->id);
+	}
+	pthread_mutex_unlock(&journal_mutex);
+	return NULL;
+}
+
+// Creates an empty log of block_count blocks at start_blk; called by mkfs.
+// Status: COMPLETE
+int journal_format(unsigned int start_blk, unsigned int block_count) {
+	log_start = start_blk;
+	log_blocks = block_count;
+	return write_superblock(1);
+}
+
+// Replays every complete transaction in the log at start_blk, empties it, and starts journaling. With a
+// commit_ms of 0 every operation waits in journal_stop() until it is committed; otherwise a background
+// thread commits that often.
+// Status: COMPLETE
+int journal_init(unsigned int start_blk, unsigned int block_count, unsigned int commit_ms) {
+	if (running || block_count < 4) return -1;
+	log_start = start_blk;
+	log_blocks = block_count;
+	char *log = malloc((size_t)block_count * BLOCK_SIZE);
+	if (!log || bio_read_range(start_blk, block_count, log) != EXIT_SUCCESS) {
+		free(log);
+		return -1;
+	}
+	struct journal_superblock *jsb = (struct journal_superblock *)log;
+	if (jsb->header.magic != JOURNAL_MAGIC || jsb->header.type != JOURNAL_SUPERBLOCK || jsb->block_count != block_count) {
+		fprintf(stderr, "rufs: the journal superblock is damaged\n");
+		free(log);
+		return -1;
+	}
+	memset(&stats, 0, sizeof(struct journal_stats));
+	// Pass 1: find the complete transactions, which follow each other with consecutive sequence numbers.
+	uint64_t sequence = jsb->header.sequence;
+	unsigned int position = 1;
+	for (;;) {
+		struct journal_descriptor *descriptor = (struct journal_descriptor *)(log + (size_t)position * BLOCK_SIZE);
+		if (position + 2 > block_count || descriptor->header.magic != JOURNAL_MAGIC || descriptor->header.type != JOURNAL_DESCRIPTOR
+			|| descriptor->header.sequence != sequence || descriptor->block_count + descriptor->revoke_count > descriptor_capacity()
+			|| position + descriptor->block_count + 2 > block_count) break;
+		struct journal_commit *commit = (struct journal_commit *)(log + (size_t)(position + descriptor->block_count + 1) * BLOCK_SIZE);
+		if (commit->header.magic != JOURNAL_MAGIC || commit->header.type != JOURNAL_COMMIT || commit->header.sequence != sequence
+			|| commit->checksum != checksum(2166136261u, descriptor, (size_t)(descriptor->block_count + 1) * BLOCK_SIZE)) break;
+		position += descriptor->block_count + 2;
+		sequence++;
+	}
+	// Pass 2: write the images home in log order, skipping those revoked by a later transaction.
+	int retstat = EXIT_SUCCESS;
+	for (unsigned int at = 1; at < position && retstat == EXIT_SUCCESS;) {
+		struct journal_descriptor *descriptor = (struct journal_descriptor *)(log + (size_t)at * BLOCK_SIZE);
+		for (uint32_t i = 0; i < descriptor->block_count && retstat == EXIT_SUCCESS; i++) {
+			uint32_t block_num = descriptor->blocks[i];
+			int revoked = 0;
+			for (unsigned int later = at + descriptor->block_count + 2; later < position && !revoked;) {
+				struct journal_descriptor *next = (struct journal_descriptor *)(log + (size_t)later * BLOCK_SIZE);
+				for (uint32_t j = 0; j < next->revoke_count && !revoked; j++) revoked = next->blocks[next->block_count + j] == block_num;
+				later += next->block_count + 2;
+			}
+			if (revoked) continue;
+			retstat = bio_write_range(block_num, 1, log + (size_t)(at + 1 + i) * BLOCK_SIZE);
+			bcache_invalidate(block_num);
+		}
+		stats.replayed++;
+		at += descriptor->block_count + 2;
+	}
+	free(log);
+	if (stats.replayed > 0 && retstat == EXIT_SUCCESS) {
+		fprintf(stderr, "rufs: replayed %llu journal transactions\n", stats.replayed);
+		retstat = dev_sync();
+	}
+	// Start the next transactions after the replayed ones, so stale blocks in the log can never match.
+	log_sequence = sequence;
+	log_head = 1;
+	if (retstat == EXIT_SUCCESS && stats.replayed > 0) retstat = write_superblock(log_sequence);
+	if (retstat != EXIT_SUCCESS) return -1;
+	if (!(running = new_transaction(1))) return -1;
+	committed_id = 0;
+	commit_interval = commit_ms;
+	shutting_down = 0;
+	region_count = 0;
+	thread_started = commit_ms > 0 && pthread_create(&commit_thread, NULL, commit_thread_main, NULL) == 0;
+	return EXIT_SUCCESS;
+}
+
+// Registers blocks [first_blk, first_blk + block_count) as resident in memory (which is read under lock).
+// journal_dirty() may then name them; their contents are copied when the transaction commits.
+// Status: COMPLETE
+int journal_add_region(unsigned int first_blk, unsigned int block_count, void *memory, pthread_mutex_t *lock) {
+	if (region_count == MAX_REGIONS) return -1;
+	regions[region_count++] = (struct region){ first_blk, block_count, memory, lock };
+	return EXIT_SUCCESS;
+}
+
+// Joins the running transaction; every metadata change must happen between this and journal_stop().
+// Must be called before any inode lock is taken, as it can wait for a commit to copy its blocks.
+// Status: COMPLETE
+void journal_start() {
+	pthread_mutex_lock(&journal_mutex);
+	while (running->state == T_LOCKED) pthread_cond_wait(&journal_cond, &journal_mutex);
+	running->updates++;
+	stats.handles++;
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+// Leaves the running transaction. Waits for it to commit when committing synchronously, or when it has
+// grown to a quarter of the log.
+// Status: COMPLETE
+void journal_stop() {
+	pthread_mutex_lock(&journal_mutex);
+	struct transaction *tx = running;
+	if (--tx->updates == 0 && tx->state == T_LOCKED) pthread_cond_broadcast(&journal_cond);
+	if (commit_interval == 0 || tx->blocks.count + tx->revoke_count >= log_blocks / 4) wait_for_commit(tx->id);
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+// Adds a resident block (see journal_add_region()) to the running transaction.
+// Status: COMPLETE
+int journal_dirty(unsigned int block_num) {
+	pthread_mutex_lock(&journal_mutex);
+	int retstat = EXIT_SUCCESS;
+	if (!map_find(&running->blocks, block_num)) {
+		struct jbuf *buf = calloc(1, sizeof(struct jbuf));
+		if (buf) {
+			buf->block_num = block_num;
+			map_insert(&running->blocks, buf);
+		} else retstat = -1;
+	}
+	pthread_mutex_unlock(&journal_mutex);
+	return retstat;
+}
+
+// Makes buf the new contents of metadata block block_num as part of the running transaction.
+// Status: COMPLETE
+int journal_write(unsigned int block_num, const void *buf) {
+	pthread_mutex_lock(&journal_mutex);
+	struct jbuf *image = map_find(&running->blocks, block_num);
+	if (!image && (image = calloc(1, sizeof(struct jbuf)))) {
+		image->block_num = block_num;
+		if ((image->data = malloc(BLOCK_SIZE))) map_insert(&running->blocks, image);
+		else {
+			free(image);
+			image = NULL;
+		}
+	}
+	if (image) memcpy(image->data, buf, BLOCK_SIZE);
+	pthread_mutex_unlock(&journal_mutex);
+	if (!image) return -1;
+	// Any cached copy is stale now; the block is read from the journal until it has been written home.
+	bcache_invalidate(block_num);
+	return EXIT_SUCCESS;
+}
+
+// Reads metadata block block_num: its newest journaled image, or the home copy if there is none.
+// Status: COMPLETE
+int journal_read(unsigned int block_num, void *buf) {
+	pthread_mutex_lock(&journal_mutex);
+	struct jbuf *image = running ? map_find(&running->blocks, block_num) : NULL;
+	if ((!image || !image->data) && committing) image = map_find(&committing->blocks, block_num);
+	if (!image || !image->data || image->revoked) image = map_find(&checkpoint_map, block_num);
+	if (image) memcpy(buf, image->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&journal_mutex);
+	return image ? EXIT_SUCCESS : bio_read_multi(block_num, 1, buf);
+}
+
+// Called when block_num is freed: drops its pending image, and makes sure images of it already in the log
+// are neither written home nor replayed, as the block may be reused for anything.
+// Status: COMPLETE
+void journal_forget(unsigned int block_num) {
+	pthread_mutex_lock(&journal_mutex);
+	while (checkpointing) pthread_cond_wait(&journal_cond, &journal_mutex);
+	struct jbuf *image;
+	int logged = 0;
+	if (running && (image = map_find(&running->blocks, block_num)) && running != committing) map_remove(&running->blocks, image);
+	if (committing && (image = map_find(&committing->blocks, block_num))) {
+		image->revoked = 1;
+		logged = 1;
+	}
+	if ((image = map_find(&checkpoint_map, block_num))) {
+		map_remove(&checkpoint_map, image);
+		logged = 1;
+	}
+	if (logged && running->revoke_count == running->revoke_capacity) {
+		unsigned int capacity = running->revoke_capacity ? running->revoke_capacity * 2 : 64,
+			*revokes = realloc(running->revokes, capacity * sizeof(unsigned int));
+		if (revokes) {
+			running->revokes = revokes;
+			running->revoke_capacity = capacity;
+		}
+	}
+	if (logged && running->revoke_count < running->revoke_capacity) running->revokes[running->revoke_count++] = block_num;
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+// Commits the running transaction and waits until it is durable. Must not be called between
+// journal_start() and journal_stop().
+// Status: COMPLETE
+int journal_commit() {
+	pthread_mutex_lock(&journal_mutex);
+	uint64_t id = running->id;
+	if (running->blocks.count == 0 && running->revoke_count == 0) id--; // Nothing new; wait for any commit in progress.
+	wait_for_commit(id);
+	pthread_mutex_unlock(&journal_mutex);
+	return EXIT_SUCCESS;
+}
+
+// Returns the transaction that changes made now belong to; between journal_start() and journal_stop() this
+// is the transaction of the caller's handle.
+// Status: COMPLETE
+uint64_t journal_transaction_id() {
+	pthread_mutex_lock(&journal_mutex);
+	uint64_t id = running ? running->id : 0;
+	pthread_mutex_unlock(&journal_mutex);
+	return id;
+}
+
+// Waits until transaction id (from journal_transaction_id()) is durable, committing it if necessary. Like
+// journal_commit(), it must not be called between journal_start() and journal_stop().
+// Status: COMPLETE
+int journal_commit_id(uint64_t id) {
+	pthread_mutex_lock(&journal_mutex);
+	if (running) wait_for_commit(id);
+	pthread_mutex_unlock(&journal_mutex);
+	return EXIT_SUCCESS;
+}
+
+// Commits what is left, writes everything home, and stops journaling. The log is empty afterwards.
+// Status: COMPLETE
+int journal_shutdown() {
+	pthread_mutex_lock(&journal_mutex);
+	if (!running) {
+		pthread_mutex_unlock(&journal_mutex);
+		return EXIT_SUCCESS;
+	}
+	shutting_down = 1;
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_mutex);
+	if (thread_started) pthread_join(commit_thread, NULL);
+	thread_started = 0;
+	journal_commit();
+	int retstat = checkpoint();
+	pthread_mutex_lock(&journal_mutex);
+	free_transaction(running);
+	running = NULL;
+	map_clear(&checkpoint_map);
+	region_count = 0;
+	pthread_mutex_unlock(&journal_mutex);
+	return retstat;
+}
+
+// Status: COMPLETE
+void journal_get_stats(struct journal_stats *out_stats) {
+	pthread_mutex_lock(&journal_mutex);
+	memcpy(out_stats, &stats, sizeof(struct journal_stats));
+	pthread_mutex_unlock(&journal_mutex);
+}
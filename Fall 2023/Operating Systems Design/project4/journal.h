@@ -0,0 +1,69 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	journal.h
+ *
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define JOURNAL_DEFAULT_BLOCKS 512 // Size of the log region created by mkfs on small disks (in blocks)
+#define JOURNAL_MAX_BLOCKS 8192 // Size of the log region created by mkfs on disks of 32 GiB and more
+#define JOURNAL_DEFAULT_COMMIT_MS 5000 // Default interval between background commits; 0 commits every operation
+
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_SUPERBLOCK 1 // Block 0 of the log region
+#define JOURNAL_DESCRIPTOR 2 // Starts a transaction: the home block numbers of the images that follow
+#define JOURNAL_COMMIT 3 // Ends a transaction; the transaction counts only if its checksum matches
+
+struct journal_header {
+	uint32_t	magic;				/* JOURNAL_MAGIC */
+	uint32_t	type;				/* JOURNAL_SUPERBLOCK, JOURNAL_DESCRIPTOR or JOURNAL_COMMIT */
+	uint64_t	sequence;			/* transaction sequence (in the superblock: the first one in the log) */
+};
+
+struct journal_superblock {
+	struct journal_header header;
+	uint32_t	block_count;		/* size of the log region, including this block */
+};
+
+struct journal_descriptor {
+	struct journal_header header;
+	uint32_t	block_count;		/* images following this block */
+	uint32_t	revoke_count;		/* freed blocks whose earlier images must not be replayed */
+	uint32_t	blocks[];			/* block_count home block numbers, then revoke_count revoked ones */
+};
+
+struct journal_commit {
+	struct journal_header header;
+	uint32_t	checksum;			/* over the descriptor block and the images */
+};
+
+struct journal_stats {
+	unsigned long long handles;		/* operations that joined a transaction */
+	unsigned long long commits;		/* transactions written to the log */
+	unsigned long long blocks_logged;	/* block images written to the log */
+	unsigned long long checkpoints;	/* times the log was written home and emptied */
+	unsigned long long replayed;	/* transactions replayed when mounting */
+};
+
+int journal_format(unsigned int start_blk, unsigned int block_count);
+int journal_init(unsigned int start_blk, unsigned int block_count, unsigned int commit_ms);
+int journal_add_region(unsigned int first_blk, unsigned int block_count, void *memory, pthread_mutex_t *lock);
+void journal_start();
+void journal_stop();
+int journal_dirty(unsigned int block_num);
+int journal_write(unsigned int block_num, const void *buf);
+int journal_read(unsigned int block_num, void *buf);
+void journal_forget(unsigned int block_num);
+int journal_commit();
+uint64_t journal_transaction_id();
+int journal_commit_id(uint64_t id);
+int journal_shutdown();
+void journal_get_stats(struct journal_stats *stats);
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ *	Tiny File System
+ *	File:	md_bench.c
+ *
+ *	Metadata benchmark in the style of mdtest, run against a mounted RUFS (or any directory) like
+ *	stress_tests. Every thread builds a directory tree of the given depth and branching factor, fills each
+ *	directory with empty files, and then stats, lists and removes everything again.
+ *	Usage: ./md_bench [-d dir] [-t threads] [-z depth] [-b branching] [-I files per directory] [-S] [-k]
+ *	-S makes the threads share one tree (thread 0 builds and removes it; the others only work on their own
+ *	files in it). -k keeps the tree instead of running the remove phases.
+ *	Each phase (tree-create, file-create, file-stat, dir-list, file-remove, tree-remove) prints one JSON
+ *	object per line with its operation count and rate; for dir-list an operation is one returned entry.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Same default mount point as stress_tests.c */
+#define TESTDIR "/tmp/netID/mountdir"
+
+#define MAX_THREADS 256
+#define MAX_DIRS (1L << 20) // Directories in one tree
+#define PATHLEN 1024
+
+enum phase { TREE_CREATE, FILE_CREATE, FILE_STAT, DIR_LIST, FILE_REMOVE, TREE_REMOVE, PHASE_COUNT };
+
+static const char *phase_names[PHASE_COUNT] = { "tree-create", "file-create", "file-stat", "dir-list", "file-remove", "tree-remove" };
+
+struct config {
+	const char *dir;
+	int threads,
+		depth,
+		branching,
+		files,
+		shared,
+		keep;
+	long dir_count;		/* directories in one tree */
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	enum phase phase;
+	struct config *config;
+	pthread_barrier_t *barrier;
+	uint64_t ops,
+		start_ns,
+		end_ns;
+	int error;
+};
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Path of directory number index of a tree. Directories are numbered breadth-first from the tree's root
+// (0), so the parent of directory i is (i - 1) / branching.
+static void dir_path(char *path, struct config *config, int tree, long index) {
+	long chain[64];
+	int length = 0;
+	for (long i = index; i > 0; i = (i - 1) / config->branching) chain[length++] = i;
+	int used = snprintf(path, PATHLEN, "%s/md_bench.%d", config->dir, tree);
+	while (length > 0 && used < PATHLEN) used += snprintf(path + used, PATHLEN - used, "/d%ld", chain[--length]);
+}
+
+static void file_path(char *path, struct config *config, int tree, long index, int thread, int file) {
+	dir_path(path, config, tree, index);
+	size_t used = strlen(path);
+	snprintf(path + used, PATHLEN - used, "/f.%d.%d", thread, file);
+}
+
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+	struct config *config = w->config;
+	int tree = config->shared ? 0 : w->id;
+	char path[PATHLEN];
+	pthread_barrier_wait(w->barrier);
+	w->start_ns = now_ns();
+	switch (w->phase) {
+		case TREE_CREATE:
+			for (long d = 0; d < config->dir_count && w->error == 0 && (!config->shared || w->id == 0); d++) {
+				dir_path(path, config, tree, d);
+				if (mkdir(path, 0755) != 0) w->error = errno;
+				else w->ops++;
+			}
+			break;
+		case TREE_REMOVE:
+			// Children before parents: walk the breadth-first numbering backwards.
+			for (long d = config->dir_count - 1; d >= 0 && w->error == 0 && (!config->shared || w->id == 0); d--) {
+				dir_path(path, config, tree, d);
+				if (rmdir(path) != 0) w->error = errno;
+				else w->ops++;
+			}
+			break;
+		case DIR_LIST:
+			for (long d = 0; d < config->dir_count && w->error == 0; d++) {
+				dir_path(path, config, tree, d);
+				DIR *dir = opendir(path);
+				if (!dir) {
+					w->error = errno;
+					break;
+				}
+				while (readdir(dir)) w->ops++;
+				closedir(dir);
+			}
+			break;
+		default:
+			for (long d = 0; d < config->dir_count && w->error == 0; d++) {
+				for (int f = 0; f < config->files && w->error == 0; f++) {
+					file_path(path, config, tree, d, w->id, f);
+					struct stat st;
+					int fd;
+					if (w->phase == FILE_CREATE) {
+						if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0) w->error = errno;
+						else close(fd);
+					} else if (w->phase == FILE_STAT) {
+						if (stat(path, &st) != 0) w->error = errno;
+					} else if (unlink(path) != 0) w->error = errno;
+					if (w->error == 0) w->ops++;
+				}
+			}
+			break;
+	}
+	w->end_ns = now_ns();
+	return NULL;
+}
+
+// Runs one phase on every thread and prints its result line. Returns 0 or an errno value.
+static int run_phase(struct config *config, enum phase phase) {
+	struct worker *workers = calloc(config->threads, sizeof(struct worker));
+	pthread_barrier_t barrier;
+	if (!workers) return ENOMEM;
+	pthread_barrier_init(&barrier, NULL, config->threads);
+	for (int i = 0; i < config->threads; i++) {
+		workers[i] = (struct worker){ .id = i, .phase = phase, .config = config, .barrier = &barrier };
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+	uint64_t ops = 0,
+		start = UINT64_MAX,
+		end = 0;
+	int error = 0;
+	for (int i = 0; i < config->threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].start_ns < start) start = workers[i].start_ns;
+		if (workers[i].end_ns > end) end = workers[i].end_ns;
+		ops += workers[i].ops;
+		if (workers[i].error && !error) error = workers[i].error;
+	}
+	pthread_barrier_destroy(&barrier);
+	double seconds = end > start ? (end - start) / 1e9 : 1e-9;
+	printf("{\"phase\":\"%s\",\"threads\":%d,\"depth\":%d,\"branching\":%d,\"files_per_dir\":%d,\"shared\":%s,"
+		"\"ops\":%llu,\"seconds\":%.6f,\"ops_per_s\":%.1f",
+		phase_names[phase], config->threads, config->depth, config->branching, config->files, config->shared ? "true" : "false",
+		(unsigned long long)ops, seconds, ops / seconds);
+	if (error) printf(",\"error\":\"%s\"", strerror(error));
+	printf("}\n");
+	fflush(stdout);
+	free(workers);
+	return error;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-d dir] [-t threads] [-z depth] [-b branching] [-I files per directory] [-S] [-k]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	struct config config = { TESTDIR, 4, 2, 3, 10, 0, 0, 0 };
+	int opt;
+	while ((opt = getopt(argc, argv, "d:t:z:b:I:Sk")) != -1) {
+		switch (opt) {
+			case 'd': config.dir = optarg; break;
+			case 't': config.threads = atoi(optarg); break;
+			case 'z': config.depth = atoi(optarg); break;
+			case 'b': config.branching = atoi(optarg); break;
+			case 'I': config.files = atoi(optarg); break;
+			case 'S': config.shared = 1; break;
+			case 'k': config.keep = 1; break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (config.threads < 1 || config.threads > MAX_THREADS || config.depth < 0 || config.depth > 32 || config.branching < 1 || config.files < 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	// 1 + b + b^2 + ... + b^depth directories per tree; the next level is checked against MAX_DIRS before it is
+	// multiplied out, so that the count cannot overflow.
+	for (long level = 1, d = 0; ; d++, level *= config.branching) {
+		config.dir_count += level;
+		if (d == config.depth) break;
+		if (level > (MAX_DIRS - config.dir_count) / config.branching) {
+			fprintf(stderr, "%s: a tree of depth %d and branching %d has more than %ld directories\n", argv[0], config.depth, config.branching, MAX_DIRS);
+			return EXIT_FAILURE;
+		}
+	}
+	int error = 0;
+	for (int phase = 0; phase < PHASE_COUNT && !error; phase++) {
+		if (config.keep && (phase == FILE_REMOVE || phase == TREE_REMOVE)) break;
+		error = run_phase(&config, phase);
+	}
+	return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	readahead.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readahead.h"
+
+/*
+ * Sequential readahead. After every read through an open file, readahead_update() checks whether the read
+ * continued where the previous one ended. A sequential stream gets a window of blocks to fetch ahead of the
+ * reader; once the reader has consumed half of what was requested ahead of it, the next window is queued
+ * (so reading and fetching overlap) and the window doubles, up to max_window. A read elsewhere in the file
+ * closes the window again. Windows are handed to a worker thread, which calls back into the file system to
+ * map the blocks (reading the extent tree nodes that describe them) and load them into the cache.
+ */
+
+struct readahead_request {
+	uint32_t ino;
+	uint32_t first,
+		count;
+};
+
+static pthread_mutex_t readahead_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards the queue and stats.
+static pthread_cond_t readahead_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static struct readahead_request queue[READAHEAD_QUEUE];
+static unsigned int queue_head = 0,
+	queue_count = 0,
+	max_window = 0; // 0 while readahead is off
+static int stopping = 0;
+static readahead_fill_t fill_blocks;
+static struct readahead_stats stats;
+
+static void *run_worker(void *arg) {
+	pthread_mutex_lock(&readahead_mutex);
+	for (;;) {
+		while (!stopping && queue_count == 0) pthread_cond_wait(&readahead_cond, &readahead_mutex);
+		if (stopping) break;
+		struct readahead_request request = queue[queue_head];
+		queue_head = (queue_head + 1) % READAHEAD_QUEUE;
+		queue_count--;
+		pthread_mutex_unlock(&readahead_mutex);
+		fill_blocks(request.ino, request.first, request.count);
+		pthread_mutex_lock(&readahead_mutex);
+	}
+	pthread_mutex_unlock(&readahead_mutex);
+	return NULL;
+}
+
+// Starts the worker; windows grow up to max_blocks blocks. max_blocks == 0 leaves readahead off.
+// Status: COMPLETE
+int readahead_init(unsigned int max_blocks, readahead_fill_t fill) {
+	if (max_window > 0 || max_blocks == 0) return EXIT_SUCCESS;
+	fill_blocks = fill;
+	stopping = 0;
+	queue_head = queue_count = 0;
+	memset(&stats, 0, sizeof(stats));
+	if (pthread_create(&worker, NULL, run_worker, NULL) != 0) return -1;
+	max_window = max_blocks < READAHEAD_MIN_BLOCKS ? READAHEAD_MIN_BLOCKS : max_blocks;
+	return EXIT_SUCCESS;
+}
+
+// Records a read of logical blocks [first, last] of inode ino in state and, for a sequential stream, queues
+// the next window if it is due. file_blocks bounds the window. The caller serializes calls for one state.
+// Status: COMPLETE
+void readahead_update(struct readahead_state *state, uint32_t ino, uint32_t first, uint32_t last, uint32_t file_blocks) {
+	if (max_window == 0) return;
+	// A read that starts in the block the previous one ended in still counts, for reads smaller than a block.
+	int sequential = first == state->next || first + 1 == state->next;
+	state->next = last + 1;
+	if (!sequential) {
+		if (state->window > 0) {
+			pthread_mutex_lock(&readahead_mutex);
+			stats.resets++;
+			pthread_mutex_unlock(&readahead_mutex);
+		}
+		state->window = state->end = 0;
+		return;
+	}
+	if (state->window == 0) {
+		state->window = 2 * (last - first + 1);
+		if (state->window < READAHEAD_MIN_BLOCKS) state->window = READAHEAD_MIN_BLOCKS;
+		if (state->window > max_window) state->window = max_window;
+		state->end = last + 1;
+	}
+	if (state->end < last + 1) state->end = last + 1;
+	if (state->end - (last + 1) >= state->window / 2 || state->end >= file_blocks) return;
+	uint32_t count = file_blocks - state->end < state->window ? file_blocks - state->end : state->window;
+	pthread_mutex_lock(&readahead_mutex);
+	if (queue_count == READAHEAD_QUEUE) stats.dropped++;
+	else {
+		queue[(queue_head + queue_count++) % READAHEAD_QUEUE] = (struct readahead_request){ ino, state->end, count };
+		stats.windows++;
+		stats.blocks += count;
+		pthread_cond_signal(&readahead_cond);
+	}
+	pthread_mutex_unlock(&readahead_mutex);
+	state->end += count;
+	state->window = 2 * state->window < max_window ? 2 * state->window : max_window;
+}
+
+// Stops the worker after the window it is working on; queued windows are dropped.
+// Status: COMPLETE
+void readahead_shutdown() {
+	if (max_window == 0) return;
+	pthread_mutex_lock(&readahead_mutex);
+	stopping = 1;
+	pthread_cond_signal(&readahead_cond);
+	pthread_mutex_unlock(&readahead_mutex);
+	pthread_join(worker, NULL);
+	max_window = 0;
+}
+
+// Status: COMPLETE
+void readahead_get_stats(struct readahead_stats *out_stats) {
+	pthread_mutex_lock(&readahead_mutex);
+	*out_stats = stats;
+	pthread_mutex_unlock(&readahead_mutex);
+}
@@ -0,0 +1,39 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	readahead.h
+ *
+ */
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <stdint.h>
+
+#define READAHEAD_DEFAULT_KB 512 // Default upper bound of a file's readahead window
+#define READAHEAD_MIN_BLOCKS 4 // Smallest window started when sequential reading is detected
+#define READAHEAD_QUEUE 64 // Windows waiting for the worker; further ones are dropped
+
+// Per-open-file state, kept in the file's handle and guarded by the caller.
+struct readahead_state {
+	uint32_t	next;				/* logical block a sequential reader asks for next */
+	uint32_t	window;				/* current window in blocks; 0 while reads look random */
+	uint32_t	end;				/* first logical block not yet requested ahead */
+};
+
+struct readahead_stats {
+	unsigned long long windows;		/* windows handed to the worker */
+	unsigned long long blocks;		/* logical blocks those windows covered */
+	unsigned long long dropped;		/* windows dropped because the queue was full */
+	unsigned long long resets;		/* sequential streams broken by a non-sequential read */
+};
+
+// Called by the worker to bring logical blocks [first, first + count) of inode ino into the cache.
+typedef void (*readahead_fill_t)(uint32_t ino, uint32_t first, uint32_t count);
+
+int readahead_init(unsigned int max_blocks, readahead_fill_t fill);
+void readahead_update(struct readahead_state *state, uint32_t ino, uint32_t first, uint32_t last, uint32_t file_blocks);
+void readahead_shutdown();
+void readahead_get_stats(struct readahead_stats *stats);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	reclaim.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reclaim.h"
+
+/*
+ * Background reclaimer. Removing a file or directory only detaches it and puts its inode on the orphan list
+ * (see rufs.c); this worker frees what orphans own. After every reclaim_kick() it calls the step function
+ * until that reports the list empty, one batch (and one journal transaction) at a time, so that no single
+ * operation holds the journal or the allocator for long. reclaim_wait() lets an operation that ran out of
+ * space wait for the worker to catch up before it gives up.
+ */
+
+static pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards everything below.
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER,
+	idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static int running = 0,
+	stopping = 0,
+	kicked = 0,		// a kick arrived since the worker last went idle
+	busy = 0;		// the worker is between kicks
+static reclaim_step_t reclaim_step;
+static struct reclaim_stats stats;
+
+static void *run_worker(void *arg) {
+	pthread_mutex_lock(&reclaim_mutex);
+	for (;;) {
+		while (!stopping && !kicked) pthread_cond_wait(&work_cond, &reclaim_mutex);
+		if (stopping) break;
+		kicked = 0;
+		busy = 1;
+		int retstat = 1;
+		while (retstat > 0 && !stopping) {
+			unsigned int blocks = 0,
+				inodes = 0;
+			pthread_mutex_unlock(&reclaim_mutex);
+			retstat = reclaim_step(&blocks, &inodes);
+			pthread_mutex_lock(&reclaim_mutex);
+			if (blocks > 0 || inodes > 0) stats.steps++;
+			stats.blocks += blocks;
+			stats.inodes += inodes;
+		}
+		busy = 0;
+		pthread_cond_broadcast(&idle_cond);
+	}
+	busy = 0;
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&reclaim_mutex);
+	return NULL;
+}
+
+// Starts the worker and kicks it once, for the orphans a previous mount left behind.
+// Status: COMPLETE
+int reclaim_init(reclaim_step_t step) {
+	if (running) return EXIT_SUCCESS;
+	reclaim_step = step;
+	stopping = busy = 0;
+	kicked = 1;
+	memset(&stats, 0, sizeof(stats));
+	if (pthread_create(&worker, NULL, run_worker, NULL) != 0) return -1;
+	running = 1;
+	return EXIT_SUCCESS;
+}
+
+// Tells the worker that there is something to reclaim.
+// Status: COMPLETE
+void reclaim_kick() {
+	pthread_mutex_lock(&reclaim_mutex);
+	kicked = 1;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&reclaim_mutex);
+}
+
+// Waits until the worker has nothing left to do. Returns 1 if it had (so that the caller's space may have
+// grown), 0 if it was idle already. Must be called without inode locks or a journal handle.
+// Status: COMPLETE
+int reclaim_wait() {
+	pthread_mutex_lock(&reclaim_mutex);
+	int waited = running && (kicked || busy);
+	if (waited) stats.waits++;
+	while (running && !stopping && (kicked || busy)) pthread_cond_wait(&idle_cond, &reclaim_mutex);
+	pthread_mutex_unlock(&reclaim_mutex);
+	return waited;
+}
+
+// Stops the worker after the batch it is working on; the remaining orphans are reclaimed after the next mount.
+// Status: COMPLETE
+void reclaim_shutdown() {
+	if (!running) return;
+	pthread_mutex_lock(&reclaim_mutex);
+	stopping = 1;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&reclaim_mutex);
+	pthread_join(worker, NULL);
+	running = 0;
+}
+
+// Status: COMPLETE
+void reclaim_get_stats(struct reclaim_stats *out_stats) {
+	pthread_mutex_lock(&reclaim_mutex);
+	*out_stats = stats;
+	pthread_mutex_unlock(&reclaim_mutex);
+}
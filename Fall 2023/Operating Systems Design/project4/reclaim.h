@@ -0,0 +1,31 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	reclaim.h
+ *
+ */
+
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+#define RECLAIM_BATCH_BLOCKS 8192 // Largest number of a file's blocks freed by one step (one journal transaction)
+
+struct reclaim_stats {
+	unsigned long long steps;		/* batches freed by the reclaimer */
+	unsigned long long blocks;		/* data blocks and tree nodes they returned */
+	unsigned long long inodes;		/* orphaned inodes released */
+	unsigned long long waits;		/* operations that waited for the reclaimer to free space */
+};
+
+// Called by the reclaimer to free one batch. Adds what it freed to *blocks and *inodes; returns 1 if more
+// work remains, 0 once there is nothing left to do, or -1 on an error (the worker then waits for the next
+// reclaim_kick()).
+typedef int (*reclaim_step_t)(unsigned int *blocks, unsigned int *inodes);
+
+int reclaim_init(reclaim_step_t step);
+void reclaim_kick();
+int reclaim_wait();
+void reclaim_shutdown();
+void reclaim_get_stats(struct reclaim_stats *stats);
+
+#endif
@@ -0,0 +1,360 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	recovery_tests.c
+ *
+ */
+
+/*
+ * Crash-recovery tests. rufs.c is compiled into this program with its main() renamed, so the tests call the
+ * file system directly and need no mount point. A crash is a child process that changes the disk and leaves
+ * with _exit(), without unmounting; the parent then mounts the same disk file and checks what recovery made
+ * of it. Failed writes are injected by routing rufs.c's bio_writev() calls through failing_bio_writev(). The
+ * disk files are created in the current directory and removed when the tests pass.
+ */
+
+#define main rufs_main
+#define bio_writev failing_bio_writev
+#include "rufs.c"
+#undef bio_writev
+#undef main
+
+#include <sys/wait.h>
+
+#define JOURNAL_DISK "RECOVERY_JOURNAL"
+#define FS_DISK "RECOVERY_DISK"
+
+#define TEST_LOG_START 1 // Log region of the journal test
+#define TEST_LOG_BLOCKS 64
+#define TEST_HOME 100 // First home block written by the journal test
+#define TEST_DISK_BLOCKS 256
+
+static boolean fail_writes = FALSE;
+
+int bio_writev(const unsigned int *block_nums, unsigned int block_count, void **bufs);
+
+// Stands in for bio_writev() in rufs.c; fails every write while fail_writes is set.
+int failing_bio_writev(const unsigned int *block_nums, unsigned int block_count, void **bufs) {
+	if (fail_writes == TRUE) return -1;
+	return bio_writev(block_nums, block_count, bufs);
+}
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+// Runs crash() in a child process, which must end with _exit(), and fails unless it succeeded.
+static void run_crash(void (*crash)(void)) {
+	fflush(stdout);
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		crash();
+		_exit(1);
+	}
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void fill_block(char *buf, int value) {
+	memset(buf, value, BLOCK_SIZE);
+}
+
+// TRUE if every byte of block block_num on the disk is value.
+static boolean block_is(unsigned int block_num, int value) {
+	char buf[BLOCK_SIZE];
+	if (bio_read_range(block_num, 1, buf) != EXIT_SUCCESS) return FALSE;
+	for (int i = 0; i < BLOCK_SIZE; i++) {
+		if (buf[i] != (char)value) return FALSE;
+	}
+	return TRUE;
+}
+
+static void journal_write_value(unsigned int block_num, int value) {
+	char buf[BLOCK_SIZE];
+	fill_block(buf, value);
+	CHECK(journal_write(block_num, buf) == EXIT_SUCCESS);
+}
+
+/*
+ * Journal replay: four transactions are committed and the process dies before any checkpoint. The first
+ * writes A to TEST_HOME and B to TEST_HOME + 1, the second A' to TEST_HOME and frees TEST_HOME + 1, which is
+ * then reused for unjournaled data D, the third writes C to TEST_HOME + 2 and the fourth E to TEST_HOME + 3,
+ * but its image in the log is torn afterwards.
+ */
+static void crash_journal_log() {
+	CHECK(journal_init(TEST_LOG_START, TEST_LOG_BLOCKS, 0) == EXIT_SUCCESS);
+	journal_start();
+	journal_write_value(TEST_HOME, 'A');
+	journal_write_value(TEST_HOME + 1, 'B');
+	journal_stop();
+	journal_start();
+	journal_write_value(TEST_HOME, 'a');
+	journal_forget(TEST_HOME + 1);
+	journal_stop();
+	char buf[BLOCK_SIZE];
+	fill_block(buf, 'D');
+	CHECK(bio_write_range(TEST_HOME + 1, 1, buf) == EXIT_SUCCESS);
+	journal_start();
+	journal_write_value(TEST_HOME + 2, 'C');
+	journal_stop();
+	journal_start();
+	journal_write_value(TEST_HOME + 3, 'E');
+	journal_stop();
+	struct journal_stats stats;
+	journal_get_stats(&stats);
+	CHECK(stats.commits == 4 && stats.checkpoints == 0);
+	// The transactions take 4, 3, 3 and 3 blocks after the log superblock; the fourth one's image is at 12.
+	struct journal_descriptor *descriptor = (struct journal_descriptor *)buf;
+	CHECK(bio_read_range(TEST_LOG_START + 11, 1, buf) == EXIT_SUCCESS);
+	CHECK(descriptor->header.type == JOURNAL_DESCRIPTOR && descriptor->block_count == 1 && descriptor->blocks[0] == TEST_HOME + 3);
+	fill_block(buf, 'e');
+	CHECK(bio_write_range(TEST_LOG_START + 12, 1, buf) == EXIT_SUCCESS);
+	_exit(0);
+}
+
+// A transaction too large for the log is written home directly; the one after it is logged as usual.
+static void crash_journal_in_place() {
+	CHECK(journal_init(TEST_LOG_START, TEST_LOG_BLOCKS, 0) == EXIT_SUCCESS);
+	journal_start();
+	for (unsigned int i = 0; i < TEST_LOG_BLOCKS + 6; i++) journal_write_value(TEST_HOME + 10 + i, 'I');
+	journal_stop();
+	journal_start();
+	journal_write_value(TEST_HOME + 10, 'L');
+	journal_stop();
+	struct journal_stats stats;
+	journal_get_stats(&stats);
+	CHECK(stats.commits == 1);
+	_exit(0);
+}
+
+static void test_journal_replay() {
+	unlink(JOURNAL_DISK);
+	CHECK(dev_init(JOURNAL_DISK, (uint64_t)TEST_DISK_BLOCKS * BLOCK_SIZE) == EXIT_SUCCESS);
+	CHECK(journal_format(TEST_LOG_START, TEST_LOG_BLOCKS) == EXIT_SUCCESS);
+	run_crash(crash_journal_log);
+	// Nothing was written home before the crash.
+	CHECK(block_is(TEST_HOME, 0) && block_is(TEST_HOME + 2, 0));
+	CHECK(journal_init(TEST_LOG_START, TEST_LOG_BLOCKS, 0) == EXIT_SUCCESS);
+	struct journal_stats stats;
+	journal_get_stats(&stats);
+	CHECK(stats.replayed == 3);
+	CHECK(block_is(TEST_HOME, 'a'));
+	CHECK(block_is(TEST_HOME + 1, 'D'));
+	CHECK(block_is(TEST_HOME + 2, 'C'));
+	CHECK(block_is(TEST_HOME + 3, 0));
+	CHECK(journal_shutdown() == EXIT_SUCCESS);
+	// The replay emptied the log: the same transactions are not replayed twice.
+	CHECK(journal_init(TEST_LOG_START, TEST_LOG_BLOCKS, 0) == EXIT_SUCCESS);
+	journal_get_stats(&stats);
+	CHECK(stats.replayed == 0);
+	CHECK(journal_shutdown() == EXIT_SUCCESS);
+	printf("TEST 1: Journal replay of committed, revoked and torn transactions Success \n");
+
+	run_crash(crash_journal_in_place);
+	CHECK(journal_init(TEST_LOG_START, TEST_LOG_BLOCKS, 0) == EXIT_SUCCESS);
+	journal_get_stats(&stats);
+	CHECK(stats.replayed == 1);
+	CHECK(block_is(TEST_HOME + 10, 'L'));
+	for (unsigned int i = 1; i < TEST_LOG_BLOCKS + 6; i++) CHECK(block_is(TEST_HOME + 10 + i, 'I'));
+	CHECK(journal_shutdown() == EXIT_SUCCESS);
+	dev_close();
+	unlink(JOURNAL_DISK);
+	printf("TEST 2: Journal replay after an in-place transaction Success \n");
+}
+
+static void mount_disk(unsigned int journal_commit) {
+	strcpy(diskfile_path, FS_DISK);
+	options.journal_commit = journal_commit;
+	CHECK(rufs_mount() == EXIT_SUCCESS);
+}
+
+static int create_file(const char *path, const char *buf, size_t size, boolean durable) {
+	struct fuse_file_info fi = {0};
+	int retstat = rufs_create(path, 0644, &fi);
+	if (retstat != 0) return retstat;
+	if (rufs_write(path, buf, size, 0, &fi) != (int)size) retstat = -EIO;
+	else if (durable == TRUE) retstat = rufs_fsync(path, 0, &fi);
+	rufs_release(path, &fi);
+	return retstat;
+}
+
+static char file_data[10000];
+
+/*
+ * File system replay: the tree is committed by rufs_sync(), then changed again without a commit, and the
+ * process dies with the log not yet checkpointed. Background commits are far enough apart not to run, and the
+ * reclaimer, which commits removals before it frees anything, is stopped first.
+ */
+static void crash_file_system() {
+	unlink(FS_DISK);
+	mount_disk(60000);
+	CHECK(rufs_mkdir("/a", 0755) == 0 && rufs_mkdir("/a/b", 0755) == 0 && rufs_mkdir("/gone", 0755) == 0);
+	CHECK(create_file("/a/f", file_data, sizeof(file_data), TRUE) == 0);
+	CHECK(create_file("/unlinked", file_data, 100, FALSE) == 0);
+	CHECK(rufs_unlink("/unlinked") == 0 && rufs_rmdir("/gone") == 0);
+	CHECK(rufs_sync() == EXIT_SUCCESS);
+	reclaim_shutdown();
+	CHECK(rufs_mkdir("/late", 0755) == 0 && rufs_rmdir("/a/b") == 0);
+	struct journal_stats stats;
+	journal_get_stats(&stats);
+	CHECK(stats.commits > 0 && stats.checkpoints == 0);
+	_exit(0);
+}
+
+static void test_file_system_replay() {
+	for (size_t i = 0; i < sizeof(file_data); i++) file_data[i] = (char)(i * 7 + 3);
+	run_crash(crash_file_system);
+	mount_disk(0);
+	struct journal_stats stats;
+	journal_get_stats(&stats);
+	CHECK(stats.replayed > 0);
+	struct stat st;
+	CHECK(rufs_getattr("/a", &st) == 0 && S_ISDIR(st.st_mode));
+	CHECK(rufs_getattr("/a/b", &st) == 0 && S_ISDIR(st.st_mode));
+	CHECK(rufs_getattr("/a/f", &st) == 0 && S_ISREG(st.st_mode) && st.st_size == sizeof(file_data));
+	CHECK(rufs_getattr("/gone", &st) == -ENOENT && rufs_getattr("/unlinked", &st) == -ENOENT);
+	CHECK(rufs_getattr("/late", &st) == -ENOENT);
+	struct fuse_file_info fi = {0};
+	static char got[sizeof(file_data)];
+	CHECK(rufs_open("/a/f", &fi) == 0);
+	CHECK(rufs_read("/a/f", got, sizeof(got), 0, &fi) == sizeof(got) && memcmp(got, file_data, sizeof(got)) == 0);
+	rufs_release("/a/f", &fi);
+	// The recovered tree can be changed and survives a clean unmount.
+	CHECK(rufs_mkdir("/late", 0755) == 0 && rufs_rmdir("/a/b") == 0);
+	rufs_unmount();
+	mount_disk(0);
+	CHECK(rufs_getattr("/late", &st) == 0 && rufs_getattr("/a/b", &st) == -ENOENT && rufs_getattr("/a/f", &st) == 0);
+	rufs_unmount();
+	unlink(FS_DISK);
+	printf("TEST 3: File system metadata after replay matches the last commit Success \n");
+}
+
+static size_t used_bits(bitmap_t bitmap, size_t count) {
+	size_t used = 0;
+	for (size_t i = 0; i < count; i++) used += get_bitmap(bitmap, i);
+	return used;
+}
+
+#define BIG_FILE_BLOCKS (RECLAIM_BATCH_BLOCKS + 1000) // Takes the reclaimer two batches
+
+static char chunk[1024 * 1024];
+
+/*
+ * Orphan list resume: a tree is removed with the reclaimer stopped, and reclaim_orphan() is stepped by hand
+ * until the large file in it has lost its first batch. Each step is committed (journal_commit=0), so the
+ * process dies with the orphan list and the orphan being reclaimed both half done.
+ */
+static void crash_orphans() {
+	mount_disk(0);
+	CHECK(rufs_mkdir("/t", 0755) == 0);
+	struct fuse_file_info fi = {0};
+	CHECK(rufs_create("/t/big", 0644, &fi) == 0);
+	memset(chunk, 'b', sizeof(chunk));
+	off_t end = (off_t)BIG_FILE_BLOCKS * BLOCK_SIZE;
+	for (off_t offset = 0; offset < end; offset += sizeof(chunk)) {
+		size_t size = end - offset < (off_t)sizeof(chunk) ? end - offset : sizeof(chunk);
+		CHECK(rufs_write("/t/big", chunk, size, offset, &fi) == (int)size);
+	}
+	rufs_release("/t/big", &fi);
+	for (int i = 0; i < 20; i++) {
+		char path[64];
+		sprintf(path, "/t/d%d", i);
+		CHECK(rufs_mkdir(path, 0755) == 0);
+		for (int j = 0; j < 4; j++) {
+			sprintf(path, "/t/d%d/f%d", i, j);
+			CHECK(create_file(path, file_data, 1000 * (j + 1), FALSE) == 0);
+		}
+	}
+	struct inode big;
+	CHECK(get_node_by_path("/t/big", ROOT_INO, &big) == EXIT_SUCCESS);
+	CHECK(rufs_sync() == EXIT_SUCCESS);
+	reclaim_shutdown();
+	CHECK(rufs_rmdir("/t") == 0);
+	for (;;) {
+		unsigned int blocks = 0,
+			inodes = 0;
+		CHECK(reclaim_orphan(&blocks, &inodes) == 1);
+		struct inode orphan;
+		if (superblock->orphan_current == big.ino && readi(big.ino, &orphan) == EXIT_SUCCESS && orphan.size < big.size) break;
+	}
+	CHECK(superblock->orphan_head != 0);
+	_exit(0);
+}
+
+static void test_orphan_resume() {
+	unlink(FS_DISK);
+	mount_disk(0);
+	size_t base_blocks = used_bits(data_bitmap, superblock->max_dnum),
+		base_inodes = used_bits(inode_bitmap, superblock->max_inum);
+	rufs_unmount();
+	run_crash(crash_orphans);
+	// The mount picks the list up where the crash left it.
+	mount_disk(0);
+	struct stat st;
+	CHECK(rufs_getattr("/t", &st) == -ENOENT);
+	reclaim_wait();
+	CHECK(superblock->orphan_head == 0 && superblock->orphan_current == 0);
+	CHECK(used_bits(data_bitmap, superblock->max_dnum) == base_blocks);
+	CHECK(used_bits(inode_bitmap, superblock->max_inum) == base_inodes);
+	CHECK(rufs_mkdir("/t", 0755) == 0 && create_file("/t/big", file_data, sizeof(file_data), FALSE) == 0);
+	rufs_unmount();
+	unlink(FS_DISK);
+	printf("TEST 4: Remount resumes a partially reclaimed orphan list Success \n");
+}
+
+#define FLUSHED_BLOCKS 49 // Blocks of the file test_flush_failure() writes
+
+/*
+ * Delayed allocation write failure: flushing a file whose data cannot be written must fail without mapping
+ * any block or leaking its reservation, keep the data delayed and readable, and succeed once the disk does.
+ */
+static void test_flush_failure() {
+	unlink(FS_DISK);
+	options.delalloc_kb = DELALLOC_DEFAULT_KB;
+	mount_disk(0);
+	static char data[FLUSHED_BLOCKS * BLOCK_SIZE - 1000],
+		got[sizeof(data)];
+	for (size_t i = 0; i < sizeof(data); i++) data[i] = (char)(i * 13 + 5);
+	struct fuse_file_info fi = {0};
+	CHECK(rufs_create("/f", 0644, &fi) == 0);
+	size_t base_blocks = used_bits(data_bitmap, superblock->max_dnum),
+		free_before = free_data_blocks,
+		reserved_before = reserved_data_blocks;
+	CHECK(rufs_write(NULL, data, sizeof(data), 0, &fi) == sizeof(data));
+	fail_writes = TRUE;
+	CHECK(rufs_flush(NULL, &fi) != 0);
+	fail_writes = FALSE;
+	struct inode inode;
+	CHECK(get_node_by_path("/f", ROOT_INO, &inode) == EXIT_SUCCESS);
+	CHECK(inode.extent_root.count == 0 && delalloc_count(inode.ino) == FLUSHED_BLOCKS);
+	CHECK(used_bits(data_bitmap, superblock->max_dnum) == base_blocks);
+	CHECK(free_data_blocks == free_before && reserved_data_blocks == reserved_before + FLUSHED_BLOCKS);
+	CHECK(rufs_read(NULL, got, sizeof(got), 0, &fi) == sizeof(got) && memcmp(got, data, sizeof(data)) == 0);
+	CHECK(rufs_flush(NULL, &fi) == 0);
+	CHECK(get_node_by_path("/f", ROOT_INO, &inode) == EXIT_SUCCESS);
+	CHECK(inode.extent_root.count == 1 && delalloc_count(inode.ino) == 0);
+	CHECK(used_bits(data_bitmap, superblock->max_dnum) == base_blocks + FLUSHED_BLOCKS);
+	CHECK(reserved_data_blocks == reserved_before);
+	rufs_release(NULL, &fi);
+	rufs_unmount();
+	mount_disk(0);
+	CHECK(rufs_open("/f", &fi) == 0);
+	CHECK(rufs_read(NULL, got, sizeof(got), 0, &fi) == sizeof(got) && memcmp(got, data, sizeof(data)) == 0);
+	rufs_release(NULL, &fi);
+	rufs_unmount();
+	unlink(FS_DISK);
+	printf("TEST 5: Failed delayed allocation flush keeps the data and its reservation Success \n");
+}
+
+int main(int argc, char *argv[]) {
+	test_journal_replay();
+	test_file_system_replay();
+	test_orphan_resume();
+	test_flush_failure();
+	printf("tests pass \n");
+	return 0;
+}
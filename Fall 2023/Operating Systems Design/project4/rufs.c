@@ -18,8 +18,20 @@
 #include <sys/time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <ctype.h>
 
 #include "block.h"
+#include "bcache.h"
+#include "dcache.h"
+#include "dirindex.h"
+#include "journal.h"
+#include "uring.h"
+#include "readahead.h"
+#include "reclaim.h"
+#include "delalloc.h"
 #include "rufs.h"
 
 char diskfile_path[PATH_MAX];
@@ -28,9 +40,244 @@ char diskfile_path[PATH_MAX];
 unsigned long long TOTAL_INODE_BLOCKS = 0,
 	TOTAL_DATA_BLOCKS = 0;
 
+// Mount options (e.g., "-o cache_size=64,dcache_entries=65536,journal_commit=0,uring_depth=32,mmap,readahead_kb=1024,delalloc_kb=65536,stats").
+// disk_size, inodes and bytes_per_inode only matter when DISKFILE does not exist yet and is formatted.
+struct rufs_options {
+	unsigned int cache_size;	/* buffer cache budget in MiB */
+	unsigned int dcache_entries;	/* path components kept in the dentry cache */
+	unsigned int journal_commit;	/* milliseconds between journal commits; 0 commits every operation */
+	unsigned int uring_depth;	/* requests in flight through io_uring; 0 uses preadv()/pwritev() */
+	int mmap;					/* access DISKFILE through a shared mapping instead of the buffer cache */
+	unsigned int readahead_kb;	/* largest readahead window of a sequentially read file; 0 disables readahead */
+	unsigned int delalloc_kb;	/* file data held without disk blocks before writers must flush; 0 allocates at write() */
+	int stats;					/* print cache statistics when unmounting */
+	char *disk_size;			/* size of a new disk in bytes, or with a K, M, G or T suffix */
+	unsigned int inodes;		/* inodes of a new disk; 0 derives them from bytes_per_inode */
+	unsigned int bytes_per_inode;	/* disk bytes per inode of a new disk */
+};
+
+static struct rufs_options options = { BCACHE_DEFAULT_SIZE / (1024 * 1024), DCACHE_DEFAULT_ENTRIES, JOURNAL_DEFAULT_COMMIT_MS, 0, FALSE, READAHEAD_DEFAULT_KB, DELALLOC_DEFAULT_KB, FALSE, NULL, 0, DEFAULT_BYTES_PER_INODE };
+
+static struct fuse_opt rufs_opts[] = {
+	{ "cache_size=%u", offsetof(struct rufs_options, cache_size), 0 },
+	{ "dcache_entries=%u", offsetof(struct rufs_options, dcache_entries), 0 },
+	{ "journal_commit=%u", offsetof(struct rufs_options, journal_commit), 0 },
+	{ "uring_depth=%u", offsetof(struct rufs_options, uring_depth), 0 },
+	{ "mmap", offsetof(struct rufs_options, mmap), TRUE },
+	{ "readahead_kb=%u", offsetof(struct rufs_options, readahead_kb), 0 },
+	{ "delalloc_kb=%u", offsetof(struct rufs_options, delalloc_kb), 0 },
+	{ "stats", offsetof(struct rufs_options, stats), TRUE },
+	{ "disk_size=%s", offsetof(struct rufs_options, disk_size), 0 },
+	{ "inodes=%u", offsetof(struct rufs_options, inodes), 0 },
+	{ "bytes_per_inode=%u", offsetof(struct rufs_options, bytes_per_inode), 0 },
+	FUSE_OPT_END
+};
+
+/*
+ * Locking. Every inode has a reader/writer lock in inode_locks: it is held shared to read a file or search
+ * a directory and exclusively to change either. The remaining locks are short ones around shared in-memory
+ * tables.
+ *
+ * Lock order:
+ *   0. the journal handle: an operation that changes metadata calls journal_start() before its first inode
+ *      lock and journal_stop() after its last unlock, as both may wait for a commit
+ *   1. inode locks, ancestor before descendant: a path is walked by locking each directory shared, then
+ *      the next component, and only then unlocking the directory; namespace changes hold the parent
+ *      exclusively, then the child. Two inodes that are not on one path (e.g. the two parents of a
+ *      cross-directory operation) are locked in increasing inode number. ".." is only followed after
+ *      releasing the directory it was found in.
+ *   2. alloc_mutex (bitmaps and allocation cursors) and orphan_mutex (the orphan list in the superblock)
+ *   3. dir_index_mutex, which is held while a directory index is built from the directory's blocks
+ *   4. inode_table_mutex and the private mutexes of the buffer and dentry caches and of the delayed blocks
+ *   5. the journal's private mutex
+ *
+ * The readahead worker takes a file's lock shared while it maps and loads a window, holding nothing else.
+ * The reclaimer is an operation like any other: a journal handle, then the orphan's lock, then its children's.
+ *
+ * mutex only serializes mounting and unmounting.
+ */
+
 // Declare your in-memory data structures here
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct superblock *superblock;
+static pthread_rwlock_t *inode_locks; // One per inode number.
+static pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards both bitmaps and the block counters.
+static pthread_mutex_t inode_table_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards copies into and out of inode_table.
+static pthread_mutex_t dir_index_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards the slots of dir_indexes.
+static pthread_mutex_t orphan_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards the superblock's orphan list and orphan_id.
+static struct superblock *superblock; // Resident superblock block once mounted; journaled for the orphan list.
+static uint64_t orphan_id; // Last journal transaction that put an inode on the orphan list.
+static unsigned char *inode_table; // Copy of the on-disk inode region, each block read in on first use.
+static bitmap_t inode_blocks_loaded; // Blocks of inode_table read in so far; guarded by inode_table_mutex.
+static bitmap_t inode_blocks_lazy; // Blocks of inode_table changed by writei_lazy() alone; guarded by inode_table_mutex.
+
+// Both bitmaps and the inode table reach the disk through the journal: changed blocks are handed to it with
+// journal_dirty() and copied out when the transaction commits.
+static bitmap_t inode_bitmap; // Resident inode bitmap, loaded once in rufs_init().
+static bitmap_t data_bitmap; // Resident data block bitmap, loaded once in rufs_init().
+// Free blocks in data_bitmap, and how many of them delayed blocks have set aside (see reserve_blocks()).
+static size_t free_data_blocks,
+	reserved_data_blocks;
+
+static struct dir_index **dir_indexes; // Name indexes of the directories searched so far, by inode number.
+static uint32_t *extent_generation; // Per inode; bumped whenever mapped blocks are released, which invalidates handle map hints.
+
+/*
+ * Tables with an entry per inode (the inode locks and table, extent generations, commit ids, references and
+ * directory indexes) are reserved for every inode of the disk, but only the pages holding entries of inodes actually
+ * used are ever backed by memory, so that a disk with millions of inodes costs what its files need.
+ */
+
+// Reserves a zero-filled table of size bytes whose pages are only backed once touched; NULL on failure.
+// Status: COMPLETE
+void *alloc_table(size_t size) {
+	void *table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return table == MAP_FAILED ? NULL : table;
+}
+
+// Releases a table from alloc_table(); table may be NULL.
+// Status: COMPLETE
+void free_table(void *table, size_t size) {
+	if (table) munmap(table, size);
+}
+
+// Per inode, the last journal transaction that changed it (fsync() waits for it) and the last one that changed
+// more than its timestamps (fdatasync() waits for that one). Guarded by inode_table_mutex.
+static uint64_t *inode_commit_id;
+static uint64_t *inode_datasync_id;
+
+// Per inode, what refers to it besides directory entries: the lookups the kernel holds on it through the
+// low-level front end (rufs_ll.c) and the open handles. A removed inode is not reclaimed while either is
+// left; dropping the last one kicks the reclaimer. Guarded by orphan_mutex.
+struct inode_refs {
+	uint64_t	lookups;			/* FUSE lookup count */
+	uint32_t	handles;			/* open rufs_handles */
+	uint32_t	orphaned;			/* TRUE from orphan_add() until the reclaimer takes the inode */
+};
+static struct inode_refs *inode_refs;
+
+// Counts lookups and handles taken on an inode.
+// Status: COMPLETE
+void get_inode_refs(uint32_t ino, uint64_t lookups, uint32_t handles) {
+	pthread_mutex_lock(&orphan_mutex);
+	inode_refs[ino].lookups += lookups;
+	inode_refs[ino].handles += handles;
+	pthread_mutex_unlock(&orphan_mutex);
+}
+
+// Drops lookups and handles taken with get_inode_refs(); once none are left, a removed inode goes to the
+// reclaimer. The kernel may forget lookups of the root that were never counted, so the counts stop at 0.
+// Status: COMPLETE
+void put_inode_refs(uint32_t ino, uint64_t lookups, uint32_t handles) {
+	if (ino >= superblock->max_inum) return;
+	pthread_mutex_lock(&orphan_mutex);
+	inode_refs[ino].lookups -= lookups < inode_refs[ino].lookups ? lookups : inode_refs[ino].lookups;
+	inode_refs[ino].handles -= handles < inode_refs[ino].handles ? handles : inode_refs[ino].handles;
+	boolean reclaim = inode_refs[ino].orphaned == TRUE && inode_refs[ino].lookups == 0 && inode_refs[ino].handles == 0 ? TRUE : FALSE;
+	pthread_mutex_unlock(&orphan_mutex);
+	if (reclaim == TRUE) reclaim_kick();
+}
+
+// Tells whether anything besides directory entries still refers to an inode. Caller holds orphan_mutex.
+// Status: COMPLETE
+static boolean inode_referenced(uint32_t ino) {
+	return inode_refs[ino].lookups > 0 || inode_refs[ino].handles > 0 ? TRUE : FALSE;
+}
+
+// Tells whether an inode was removed while still referred to, so that it waits for the reclaimer.
+// Status: COMPLETE
+boolean inode_orphaned(uint32_t ino) {
+	pthread_mutex_lock(&orphan_mutex);
+	boolean orphaned = inode_refs[ino].orphaned == TRUE ? TRUE : FALSE;
+	pthread_mutex_unlock(&orphan_mutex);
+	return orphaned;
+}
+
+// Locks an inode shared (exclusive == FALSE) or exclusively. See the lock order above.
+// Status: COMPLETE
+void lock_inode(uint32_t ino, boolean exclusive) {
+	if (exclusive == TRUE) pthread_rwlock_wrlock(&inode_locks[ino]);
+	else pthread_rwlock_rdlock(&inode_locks[ino]);
+}
+
+// Status: COMPLETE
+void unlock_inode(uint32_t ino) {
+	pthread_rwlock_unlock(&inode_locks[ino]);
+}
+
+// Creates the inode locks for a file system with max_inum inodes. Where an all-zero lock is an initialized
+// one, as with glibc, the zero-filled table needs no initialization and untouched locks cost no memory.
+// Status: COMPLETE
+int init_inode_locks(size_t max_inum) {
+	static const pthread_rwlock_t initializer = PTHREAD_RWLOCK_INITIALIZER;
+	static const pthread_rwlock_t zero;
+	if (!(inode_locks = alloc_table(max_inum * sizeof(pthread_rwlock_t)))) return -1;
+	for (size_t i = 0; memcmp(&initializer, &zero, sizeof(pthread_rwlock_t)) != 0 && i < max_inum; i++) pthread_rwlock_init(&inode_locks[i], NULL);
+	return EXIT_SUCCESS;
+}
+
+// Releases the inode locks, none of which may be held; they need no destruction beyond the table's.
+// Status: COMPLETE
+void destroy_inode_locks(size_t max_inum) {
+	free_table(inode_locks, max_inum * sizeof(pthread_rwlock_t));
+	inode_locks = NULL;
+}
+
+// Returns the number of disk blocks occupied by a bitmap of bit_count bits.
+// Status: COMPLETE
+size_t bitmap_block_size(size_t bit_count) {
+	return ((bit_count + 7) / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Releases the resident bitmaps without writing them back.
+// Status: COMPLETE
+void free_bitmaps() {
+	free(inode_bitmap);
+	free(data_bitmap);
+	inode_bitmap = data_bitmap = NULL;
+}
+
+// Rereads the superblock once the journal is replayed and keeps its block resident, handing it to the journal:
+// the orphan list head changes along with the inodes on the list.
+// Status: COMPLETE
+int load_superblock() {
+	struct superblock *resident = malloc(BLOCK_SIZE);
+	if (!resident || bio_read_multi(0, 1, resident) != EXIT_SUCCESS) {
+		free(resident);
+		return -1;
+	}
+	free(superblock);
+	superblock = resident;
+	// Orphans found here were durable before the mount; transaction ids of an earlier mount mean nothing now.
+	orphan_id = 0;
+	return journal_add_region(0, 1, superblock, &orphan_mutex);
+}
+
+// Reads both bitmaps into memory; they stay resident until rufs_destroy().
+// Status: COMPLETE
+int load_bitmaps() {
+	size_t inode_bitmap_block_size = bitmap_block_size(superblock->max_inum),
+		data_bitmap_block_size = bitmap_block_size(superblock->max_dnum);
+	inode_bitmap = malloc(inode_bitmap_block_size * BLOCK_SIZE);
+	data_bitmap = malloc(data_bitmap_block_size * BLOCK_SIZE);
+	if (!inode_bitmap || !data_bitmap
+		|| bio_read_multi(superblock->i_bitmap_blk, inode_bitmap_block_size, inode_bitmap) != EXIT_SUCCESS
+		|| bio_read_multi(superblock->d_bitmap_blk, data_bitmap_block_size, data_bitmap) != EXIT_SUCCESS) {
+		free_bitmaps();
+		return -1;
+	}
+	size_t used = 0,
+		data_bitmap_byte_size = (superblock->max_dnum + 7) / 8;
+	for (size_t i = 0; i < superblock->max_dnum; i += 64) {
+		uint64_t word = bitmap_load_word(data_bitmap, i / 8, data_bitmap_byte_size);
+		// Past the last bit, bitmap_load_word() reads ones; only the bits below max_dnum count.
+		if (superblock->max_dnum - i < 64) word &= (1ULL << (superblock->max_dnum - i)) - 1;
+		used += __builtin_popcountll(word);
+	}
+	free_data_blocks = superblock->max_dnum - used;
+	reserved_data_blocks = 0;
+	return journal_add_region(superblock->i_bitmap_blk, inode_bitmap_block_size, inode_bitmap, &alloc_mutex) == EXIT_SUCCESS
+		&& journal_add_region(superblock->d_bitmap_blk, data_bitmap_block_size, data_bitmap, &alloc_mutex) == EXIT_SUCCESS ? EXIT_SUCCESS : -1;
+}
 
 // Get available inode number from bitmap
 // Status: COMPLETE
@@ -38,25 +285,12 @@ int get_avail_ino() {
 	// Step 1: Read inode bitmap from disk
 	// Step 2: Traverse inode bitmap to find an available slot
 	// Step 3: Update inode bitmap and write to disk
-	bitmap_t inode_bitmap = get_inode_bitmap(superblock);
-	if (!inode_bitmap) return -1;
-	size_t inode_bitmap_byte_size = (superblock->max_inum + 7) / 8;
-	for (unsigned int i = 0; i < inode_bitmap_byte_size; i++) {
-		if (inode_bitmap[i] == 255) continue;
-		for (int j = 0; j < 8; j++) {
-			if (get_bitmap(inode_bitmap, i * 8 + j) == FALSE) {
-				set_bitmap(inode_bitmap, i * 8 + j);
-				if (update_inode_bitmap(inode_bitmap, TRUE, superblock) != EXIT_SUCCESS) {
-					free(inode_bitmap);
-					return -1;
-				}
-				TOTAL_INODE_BLOCKS++;
-				return i * 8 + j;
-			}
-		}
-	}
-	free(inode_bitmap);
-	return -1;
+	// The bitmap is resident, so step 3 only hands the affected block to the journal.
+	pthread_mutex_lock(&alloc_mutex);
+	int ino = get_avail_ino_no_wr(inode_bitmap, superblock);
+	if (ino != -1) journal_dirty(superblock->i_bitmap_blk + ino / 8 / BLOCK_SIZE);
+	pthread_mutex_unlock(&alloc_mutex);
+	return ino;
 }
 
 // Get available data block number from bitmap
@@ -65,117 +299,538 @@ int get_avail_blkno() {
 	// Step 1: Read data block bitmap from disk
 	// Step 2: Traverse data block bitmap to find an available slot
 	// Step 3: Update data block bitmap and write to disk 
-    bitmap_t data_bitmap = get_data_bitmap(superblock);
-    if (!data_bitmap) return -1;
-    size_t data_bitmap_byte_size = (superblock->max_dnum + 7) / 8;
-    for (unsigned int i = 0; i < data_bitmap_byte_size; i++) {
-		if (data_bitmap[i] == 255) continue;
-		for (int j = 0; j < 8; j++) {
-			if (get_bitmap(data_bitmap, i * 8 + j) == 0) {
-				set_bitmap(data_bitmap, i * 8 + j);
-				if (update_data_bitmap(data_bitmap, TRUE, superblock) != EXIT_SUCCESS) {
-					free(data_bitmap);
-					return -1;
-				}
-				TOTAL_DATA_BLOCKS++;
-				return i * 8 + j;
-			}
-		}
-    }
-    free(data_bitmap);
-    return -1;
+	// The bitmap is resident, so step 3 only hands the affected block to the journal.
+	// Blocks set aside for delayed blocks are not handed out.
+	pthread_mutex_lock(&alloc_mutex);
+	int blkno = free_data_blocks > reserved_data_blocks ? get_avail_blkno_no_wr(data_bitmap, superblock) : -1;
+	if (blkno != -1) {
+		free_data_blocks--;
+		journal_dirty(superblock->d_bitmap_blk + blkno / 8 / BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&alloc_mutex);
+	return blkno;
+}
+
+// Claims up to want contiguous data blocks near goal (0 for no preference); *out_count receives how many.
+// With reserved, they come out of what reserve_blocks() set aside; otherwise that is left alone.
+// Status: COMPLETE
+int get_avail_blkno_run(uint32_t goal, unsigned int want, boolean reserved, unsigned int *out_count) {
+	size_t count = 0;
+	pthread_mutex_lock(&alloc_mutex);
+	size_t avail = reserved == TRUE ? free_data_blocks : free_data_blocks - reserved_data_blocks;
+	int blkno = avail > 0 ? get_avail_blkno_run_no_wr(data_bitmap, superblock, goal, want < avail ? want : avail, &count) : -1;
+	free_data_blocks -= count;
+	if (reserved == TRUE) reserved_data_blocks -= count < reserved_data_blocks ? count : reserved_data_blocks;
+	for (size_t i = blkno / 8 / BLOCK_SIZE; blkno != -1 && i <= (blkno + count - 1) / 8 / BLOCK_SIZE; i++) journal_dirty(superblock->d_bitmap_blk + i);
+	pthread_mutex_unlock(&alloc_mutex);
+	*out_count = count;
+	return blkno;
+}
+
+// Returns an inode number to the resident inode bitmap.
+// Status: COMPLETE
+void release_ino(int ino) {
+	pthread_mutex_lock(&alloc_mutex);
+	unset_bitmap(inode_bitmap, ino);
+	journal_dirty(superblock->i_bitmap_blk + ino / 8 / BLOCK_SIZE);
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+// Returns a data block number to the resident data bitmap.
+// Status: COMPLETE
+void release_blkno(int blkno) {
+	pthread_mutex_lock(&alloc_mutex);
+	unset_bitmap(data_bitmap, blkno);
+	free_data_blocks++;
+	journal_dirty(superblock->d_bitmap_blk + blkno / 8 / BLOCK_SIZE);
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+// Returns the data blocks in ranges to the resident data bitmap in one pass under alloc_mutex; each bitmap
+// block touched is handed to the journal once per range rather than once per block.
+// Status: COMPLETE
+void release_block_ranges(const struct block_range *ranges, unsigned int range_count) {
+	pthread_mutex_lock(&alloc_mutex);
+	for (unsigned int i = 0; i < range_count; i++) {
+		if (ranges[i].count == 0) continue;
+		unset_bitmap_range(data_bitmap, ranges[i].start, ranges[i].count);
+		free_data_blocks += ranges[i].count;
+		for (size_t j = ranges[i].start / 8 / BLOCK_SIZE; j <= (ranges[i].start + ranges[i].count - 1) / 8 / BLOCK_SIZE; j++) journal_dirty(superblock->d_bitmap_blk + j);
+	}
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+// Sets count free data blocks aside for delayed blocks, which get disk blocks only when their file is flushed
+// (see flush_delayed()); ALLOC_RESERVE_SLACK blocks stay available for the extent tree nodes that takes.
+// Returns EXIT_SUCCESS, or -1 if the disk cannot take that many more blocks.
+// Status: COMPLETE
+int reserve_blocks(unsigned int count) {
+	pthread_mutex_lock(&alloc_mutex);
+	int retstat = free_data_blocks >= reserved_data_blocks + count + ALLOC_RESERVE_SLACK ? EXIT_SUCCESS : -1;
+	if (retstat == EXIT_SUCCESS) reserved_data_blocks += count;
+	pthread_mutex_unlock(&alloc_mutex);
+	return retstat;
+}
+
+// Gives back blocks set aside by reserve_blocks() that will not be needed after all.
+// Status: COMPLETE
+void unreserve_blocks(unsigned int count) {
+	pthread_mutex_lock(&alloc_mutex);
+	reserved_data_blocks -= count < reserved_data_blocks ? count : reserved_data_blocks;
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+// Frees the blocks in ranges: the journal forgets them first if they may hold metadata (forget), their
+// contents are discarded (see bio_discard()), and only then are they returned to the data bitmap, so that
+// nobody can be handed a block that is still being discarded.
+// Status: COMPLETE
+void free_block_ranges(const struct block_range *ranges, unsigned int range_count, boolean forget) {
+	for (unsigned int i = 0; i < range_count; i++) {
+		for (uint32_t j = 0; forget == TRUE && j < ranges[i].count; j++) journal_forget(ranges[i].start + j);
+		bio_discard(ranges[i].start, ranges[i].count);
+	}
+	release_block_ranges(ranges, range_count);
 }
 
 /* 
  * inode operations
  */
 
+// Returns the number of blocks in the inode region.
 // Status: COMPLETE
-int readi(uint16_t ino, struct inode *inode) {
-	// Step 1: Get the inode's on-disk block number
-  	// Step 2: Get offset of the inode in the inode on-disk block
-  	// Step 3: Read the block from disk and then copy into inode structure
-	if (ino >= superblock->max_inum) return -1;
-	size_t inodes_byte_size = superblock->max_inum * sizeof(struct inode),
-		inodes_block_size = (inodes_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	void *base = malloc(inodes_block_size * BLOCK_SIZE);
-	if (!base) return -1;
-	if (bio_read_multi(superblock->i_start_blk, inodes_block_size, base) != EXIT_SUCCESS) {
-		free(base);
+size_t inode_table_block_size() {
+	return (superblock->max_inum * sizeof(struct inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Releases the in-memory inode region.
+// Status: COMPLETE
+void free_inode_table() {
+	if (superblock) free_table(inode_table, inode_table_block_size() * BLOCK_SIZE);
+	free(inode_blocks_loaded);
+	free(inode_blocks_lazy);
+	inode_table = NULL;
+	inode_blocks_loaded = inode_blocks_lazy = NULL;
+}
+
+// Sets up the in-memory inode region. Its blocks are read in by load_inode_block() as inodes in them are
+// first used, so mounting costs the same however many inodes the disk has.
+// Status: COMPLETE
+int load_inode_table() {
+	size_t inodes_block_size = inode_table_block_size();
+	inode_table = alloc_table(inodes_block_size * BLOCK_SIZE);
+	inode_blocks_loaded = calloc((inodes_block_size + 7) / 8, 1);
+	inode_blocks_lazy = calloc((inodes_block_size + 7) / 8, 1);
+	if (!inode_table || !inode_blocks_loaded || !inode_blocks_lazy
+		|| journal_add_region(superblock->i_start_blk, inodes_block_size, inode_table, &inode_table_mutex) != EXIT_SUCCESS) {
+		free_inode_table();
 		return -1;
 	}
-	memcpy((void *)inode, base + ino * sizeof(struct inode), sizeof(struct inode));
-	free(base);
 	return EXIT_SUCCESS;
 }
 
+// Reads in the inode block holding inode ino unless it is resident already. Only blocks read in are ever
+// changed, so the journal never copies one that was not. Caller holds inode_table_mutex.
+// Status: COMPLETE
+int load_inode_block(uint32_t ino) {
+	size_t block = (size_t)ino * sizeof(struct inode) / BLOCK_SIZE;
+	if (get_bitmap(inode_blocks_loaded, block)) return EXIT_SUCCESS;
+	if (bio_read_multi(superblock->i_start_blk + block, 1, inode_table + block * BLOCK_SIZE) != EXIT_SUCCESS) return -1;
+	set_bitmap(inode_blocks_loaded, block);
+	return EXIT_SUCCESS;
+}
+
+// Hands the inode blocks changed by writei_lazy() alone to the journal, so that those changes are committed too.
 // Status: COMPLETE
-int writei(uint16_t ino, struct inode *inode) {
+void journal_inode_table() {
+	size_t inodes_block_size = inode_table_block_size();
+	pthread_mutex_lock(&inode_table_mutex);
+	for (size_t i = find_set_bit(inode_blocks_lazy, 0, inodes_block_size); i < inodes_block_size; i = find_set_bit(inode_blocks_lazy, i + 1, inodes_block_size)) {
+		journal_dirty(superblock->i_start_blk + i);
+		unset_bitmap(inode_blocks_lazy, i);
+	}
+	pthread_mutex_unlock(&inode_table_mutex);
+}
+
+// Status: COMPLETE
+int readi(uint32_t ino, struct inode *inode) {
+	// Step 1: Get the inode's on-disk block number
+  	// Step 2: Get offset of the inode in the inode on-disk block
+  	// Step 3: Read the block from disk and then copy into inode structure
+	// Once its block is resident (see load_inode_block()), this is a plain copy.
+	if (ino >= superblock->max_inum || !inode_table) return -1;
+	pthread_mutex_lock(&inode_table_mutex);
+	int retstat = load_inode_block(ino);
+	if (retstat == EXIT_SUCCESS) memcpy((void *)inode, inode_table + (size_t)ino * sizeof(struct inode), sizeof(struct inode));
+	pthread_mutex_unlock(&inode_table_mutex);
+	return retstat;
+}
+
+// Status: COMPLETE
+int writei(uint32_t ino, struct inode *inode) {
 	// Step 1: Get the block number where this inode resides on disk
 	// Step 2: Get the offset in the block where this inode resides on disk
 	// Step 3: Write inode to disk 
-	if (ino >= superblock->max_inum) return -1;
-	size_t inodes_byte_size = superblock->max_inum * sizeof(struct inode),
-		inodes_block_size = (inodes_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	void *base = malloc(inodes_block_size * BLOCK_SIZE);
-	if (!base) return -1;
-	if (bio_read_multi(superblock->i_start_blk, inodes_block_size, base) != EXIT_SUCCESS) {
-		free(base);
+	// Only the block holding this inode is handed to the journal, which copies it out at commit.
+	if (ino >= superblock->max_inum || !inode_table) return -1;
+	size_t inode_offset = (size_t)ino * sizeof(struct inode);
+	uint64_t id = journal_transaction_id();
+	pthread_mutex_lock(&inode_table_mutex);
+	if (load_inode_block(ino) != EXIT_SUCCESS) {
+		pthread_mutex_unlock(&inode_table_mutex);
 		return -1;
 	}
-	memcpy(base + ino * sizeof(struct inode), (void *)inode, sizeof(struct inode));
-	if (bio_write_multi(superblock->i_start_blk, inodes_block_size, base) != EXIT_SUCCESS) {
-		free(base);
+	inode_commit_id[ino] = id;
+	// next_orphan belongs to the orphan list, not to the caller's copy (see set_next_orphan()).
+	inode->next_orphan = ((struct inode *)(inode_table + inode_offset))->next_orphan;
+	// vstat, the last member, only carries timestamps.
+	if (memcmp(inode_table + inode_offset, (void *)inode, offsetof(struct inode, vstat)) != 0) inode_datasync_id[ino] = id;
+	memcpy(inode_table + inode_offset, (void *)inode, sizeof(struct inode));
+	journal_dirty(superblock->i_start_blk + inode_offset / BLOCK_SIZE);
+	pthread_mutex_unlock(&inode_table_mutex);
+	return EXIT_SUCCESS;
+}
+
+// writei() for changes that need no commit of their own, such as access times: they reach the disk with the
+// next journaled change to the same inode block, or at unmount. Needs no journal handle.
+// Status: COMPLETE
+int writei_lazy(uint32_t ino, struct inode *inode) {
+	if (ino >= superblock->max_inum || !inode_table) return -1;
+	pthread_mutex_lock(&inode_table_mutex);
+	int retstat = load_inode_block(ino);
+	if (retstat == EXIT_SUCCESS) {
+		inode->next_orphan = ((struct inode *)(inode_table + (size_t)ino * sizeof(struct inode)))->next_orphan;
+		memcpy(inode_table + (size_t)ino * sizeof(struct inode), (void *)inode, sizeof(struct inode));
+		set_bitmap(inode_blocks_lazy, (size_t)ino * sizeof(struct inode) / BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&inode_table_mutex);
+	return retstat;
+}
+
+// Links inode ino to next on the orphan list. next_orphan is changed here alone, under orphan_mutex, so that
+// the list can be relinked around an orphan without its lock; writei() keeps whatever it finds. Caller holds
+// orphan_mutex and a journal handle.
+// Status: COMPLETE
+void set_next_orphan(uint32_t ino, uint32_t next) {
+	size_t inode_offset = (size_t)ino * sizeof(struct inode);
+	pthread_mutex_lock(&inode_table_mutex);
+	if (load_inode_block(ino) == EXIT_SUCCESS) {
+		((struct inode *)(inode_table + inode_offset))->next_orphan = next;
+		journal_dirty(superblock->i_start_blk + inode_offset / BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&inode_table_mutex);
+}
+
+/* 
+ * extent operations
+ */
+
+#define MAX_EXTENT_DEPTH 8 // Far beyond what INLINE_EXTENTS * EXTENTS_PER_BLOCK^depth ever requires
+
+// Returns the index of the last entry starting at or before logical, or -1 if every entry starts after it.
+// Status: COMPLETE
+int extent_search(struct extent *entries, int count, uint32_t logical) {
+	int low = 0,
+		high = count - 1,
+		found = -1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (entries[mid].logical <= logical) {
+			found = mid;
+			low = mid + 1;
+		} else high = mid - 1;
+	}
+	return found;
+}
+
+// Reads an extent tree node; the buffer has room for one extra entry so that a node can overflow before it is split.
+// Status: COMPLETE
+struct extent_block *read_extent_block(uint32_t block_num) {
+	struct extent_block *node = malloc(BLOCK_SIZE + sizeof(struct extent));
+	if (!node) return NULL;
+	if (journal_read(block_num, node) != EXIT_SUCCESS || node->header.magic != EXTENT_MAGIC) {
+		free(node);
+		return NULL;
+	}
+	return node;
+}
+
+// Maps logical block `logical` of a file. *out_physical receives the disk block (0 inside a hole) and *out_run
+// the number of blocks, starting at `logical`, that are mapped contiguously (or that the hole spans).
+// Status: COMPLETE
+int extent_lookup(struct inode *inode, uint32_t logical, uint32_t *out_physical, uint32_t *out_run) {
+	struct extent_block *node = NULL;
+	struct extent *entries = inode->extents;
+	int count = inode->extent_root.count,
+		depth = inode->extent_root.depth;
+	uint32_t bound = UINT32_MAX; // First logical block of the closest subtree to the right
+	while (depth > 0) {
+		int i = max(0, extent_search(entries, count, logical));
+		if (i + 1 < count) bound = entries[i + 1].logical;
+		uint32_t child = entries[i].physical;
+		free(node);
+		if (!(node = read_extent_block(child))) return -1;
+		entries = node->entries;
+		count = node->header.count;
+		depth = node->header.depth;
+	}
+	int i = extent_search(entries, count, logical);
+	if (i >= 0 && logical - entries[i].logical < entries[i].length) {
+		*out_physical = entries[i].physical + (logical - entries[i].logical);
+		*out_run = entries[i].length - (logical - entries[i].logical);
+	} else {
+		*out_physical = 0;
+		*out_run = (i + 1 < count ? entries[i + 1].logical : bound) - logical;
+	}
+	free(node);
+	return EXIT_SUCCESS;
+}
+
+// Returns the disk block holding logical block `logical`, or 0 if it is a hole.
+// Status: COMPLETE
+uint32_t get_block_num(struct inode *inode, uint32_t logical) {
+	uint32_t physical, run;
+	if (extent_lookup(inode, logical, &physical, &run) != EXIT_SUCCESS) return 0;
+	return physical;
+}
+
+// True if ext can be absorbed by entries[i] (ext directly follows it) or entries[i + 1] (ext directly precedes it).
+static boolean extent_mergeable(struct extent *entries, int count, int i, struct extent *ext) {
+	if (i >= 0 && entries[i].logical + entries[i].length == ext->logical && entries[i].physical + entries[i].length == ext->physical) return TRUE;
+	if (i + 1 < count && ext->logical + ext->length == entries[i + 1].logical && ext->physical + ext->length == entries[i + 1].physical) return TRUE;
+	return FALSE;
+}
+
+// Number of new tree nodes an insertion of ext needs: one per full node on the path, counted upwards from the
+// leaf, and none at all if the leaf can absorb ext into a neighbouring extent.
+static int extent_insert_cost(struct inode *inode, struct extent *ext) {
+	boolean full[MAX_EXTENT_DEPTH + 1];
+	int levels = 0;
+	struct extent_block *node = NULL;
+	struct extent *entries = inode->extents;
+	int count = inode->extent_root.count,
+		depth = inode->extent_root.depth;
+	full[levels++] = count >= INLINE_EXTENTS;
+	while (depth > 0) {
+		uint32_t child = entries[max(0, extent_search(entries, count, ext->logical))].physical;
+		free(node);
+		if (!(node = read_extent_block(child))) return -1;
+		entries = node->entries;
+		count = node->header.count;
+		depth = node->header.depth;
+		full[levels++] = count >= EXTENTS_PER_BLOCK;
+	}
+	boolean mergeable = extent_mergeable(entries, count, extent_search(entries, count, ext->logical), ext);
+	free(node);
+	if (mergeable == TRUE) return 0;
+	int cost = 0;
+	while (levels > 0 && full[--levels] == TRUE) cost++;
+	return cost;
+}
+
+// Inserts ext into the subtree rooted at (header, entries). The node may end up with one entry more than
+// it can hold; the caller splits it. New nodes are taken from pool.
+static int extent_insert_node(struct extent_header *header, struct extent *entries, struct extent *ext, uint32_t *pool, int *pool_used) {
+	int i = extent_search(entries, header->count, ext->logical);
+	if (header->depth == 0) {
+		if (i >= 0 && entries[i].logical + entries[i].length == ext->logical && entries[i].physical + entries[i].length == ext->physical) {
+			entries[i].length += ext->length;
+			if (i + 1 < header->count && entries[i].logical + entries[i].length == entries[i + 1].logical && entries[i].physical + entries[i].length == entries[i + 1].physical) {
+				entries[i].length += entries[i + 1].length;
+				memmove(entries + i + 1, entries + i + 2, (header->count - i - 2) * sizeof(struct extent));
+				header->count--;
+			}
+			return EXIT_SUCCESS;
+		}
+		if (i + 1 < header->count && ext->logical + ext->length == entries[i + 1].logical && ext->physical + ext->length == entries[i + 1].physical) {
+			entries[i + 1].logical = ext->logical;
+			entries[i + 1].physical = ext->physical;
+			entries[i + 1].length += ext->length;
+			return EXIT_SUCCESS;
+		}
+		memmove(entries + i + 2, entries + i + 1, (header->count - i - 1) * sizeof(struct extent));
+		entries[i + 1] = *ext;
+		header->count++;
+		return EXIT_SUCCESS;
+	}
+	i = max(0, i);
+	uint32_t child_num = entries[i].physical;
+	struct extent_block *child = read_extent_block(child_num);
+	if (!child) return -1;
+	if (extent_insert_node(&child->header, child->entries, ext, pool, pool_used) != EXIT_SUCCESS) {
+		free(child);
 		return -1;
 	}
+	if (child->header.count > EXTENTS_PER_BLOCK) {
+		// Split the child: its upper half moves to a fresh node indexed right after it.
+		struct extent_block *sibling = calloc(1, BLOCK_SIZE);
+		if (!sibling) {
+			free(child);
+			return -1;
+		}
+		int keep = child->header.count / 2;
+		uint32_t sibling_num = pool[(*pool_used)++];
+		sibling->header.magic = EXTENT_MAGIC;
+		sibling->header.depth = child->header.depth;
+		sibling->header.count = child->header.count - keep;
+		memcpy(sibling->entries, child->entries + keep, sibling->header.count * sizeof(struct extent));
+		child->header.count = keep;
+		int retstat = journal_write(sibling_num, sibling);
+		struct extent index = { sibling->entries[0].logical, sibling_num, 0 };
+		free(sibling);
+		if (retstat != EXIT_SUCCESS) {
+			free(child);
+			return -1;
+		}
+		memmove(entries + i + 2, entries + i + 1, (header->count - i - 1) * sizeof(struct extent));
+		entries[i + 1] = index;
+		header->count++;
+	}
+	int retstat = journal_write(child_num, child);
+	free(child);
+	return retstat;
+}
+
+// Maps logical blocks [logical, logical + length) of a (so far unmapped) range to disk blocks starting at physical.
+// Adjacent extents are merged; the caller is responsible for writing the inode afterwards.
+// Status: COMPLETE
+int extent_insert(struct inode *inode, uint32_t logical, uint32_t physical, uint32_t length) {
+	struct extent ext = { logical, physical, length };
+	uint32_t pool[MAX_EXTENT_DEPTH + 1];
+	int pool_size = extent_insert_cost(inode, &ext),
+		pool_used = 0;
+	if (pool_size < 0) return -1;
+	for (int i = 0; i < pool_size; i++) {
+		int blkno = get_avail_blkno();
+		if (blkno == -1) {
+			while (i > 0) release_blkno(pool[--i]);
+			return -ENOSPC;
+		}
+		pool[i] = blkno;
+	}
+	struct extent_header header = inode->extent_root;
+	struct extent entries[INLINE_EXTENTS + 1];
+	memcpy(entries, inode->extents, sizeof(inode->extents));
+	int retstat = extent_insert_node(&header, entries, &ext, pool, &pool_used);
+	if (retstat == EXIT_SUCCESS && header.count > INLINE_EXTENTS) {
+		// The root overflowed: move its entries into a new node and grow the tree by one level.
+		struct extent_block *node = calloc(1, BLOCK_SIZE);
+		if (!node) retstat = -1;
+		else {
+			uint32_t node_num = pool[pool_used++];
+			node->header.magic = EXTENT_MAGIC;
+			node->header.count = header.count;
+			node->header.depth = header.depth;
+			memcpy(node->entries, entries, header.count * sizeof(struct extent));
+			retstat = journal_write(node_num, node);
+			free(node);
+			header.count = 1;
+			header.depth++;
+			entries[0].physical = node_num;
+			entries[0].length = 0;
+		}
+	}
+	if (retstat == EXIT_SUCCESS) {
+		inode->extent_root = header;
+		memcpy(inode->extents, entries, sizeof(inode->extents));
+	}
+	while (pool_used < pool_size) release_blkno(pool[pool_used++]);
+	return retstat;
+}
+
+/*
+ * directory index operations
+ */
+
+// Scans every block of a directory once and records its entries and unused slots in a new index.
+// Status: COMPLETE
+struct dir_index *build_dir_index(struct inode *dir_inode) {
+	struct dir_index *index = dirindex_create();
+	struct dirent *base = malloc(BLOCK_SIZE);
+	if (!index || !base) {
+		dirindex_destroy(index);
+		free(base);
+		return NULL;
+	}
+	size_t inode_block_size = (dir_inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE,
+		block_dirent_size = BLOCK_SIZE / sizeof(struct dirent),
+		size = dir_inode->size;
+	for (unsigned int i = 0; i < inode_block_size; i++) {
+		uint32_t block_num = get_block_num(dir_inode, i);
+		if (block_num == 0 || journal_read(block_num, base) != EXIT_SUCCESS) goto fail;
+		// Free slots are pushed from the back so that the lowest ones are reused first.
+		for (int j = block_dirent_size - 1; j >= 0; j--) {
+			if ((size_t)j * sizeof(struct dirent) + sizeof(struct dirent) > size) continue;
+			if (base[j].valid == FALSE) {
+				if (dirindex_add_free(index, i, j) != EXIT_SUCCESS) goto fail;
+			} else if (dirindex_insert(index, base[j].name, base[j].ino, i, j) != EXIT_SUCCESS) goto fail;
+		}
+		size = size >= BLOCK_SIZE ? size - BLOCK_SIZE : 0;
+	}
 	free(base);
-	return EXIT_SUCCESS;
+	return index;
+	fail:
+	dirindex_destroy(index);
+	free(base);
+	return NULL;
 }
 
-// find the directory entry of file fname within directory, also reports which direct pointer was used and the offset into the block where it was found
-int dir_find_entry_and_location(struct inode inode_of_dir, const char *fname, size_t name_len, int *out_direct_pointer_index, int *out_block_dirent_index, struct dirent *out_dirent){
+// Returns the index of a directory, building it on first use; NULL if it cannot be built.
+// Status: COMPLETE
+// The caller holds the directory's lock, shared or exclusive; an index only changes under the exclusive one.
+struct dir_index *get_dir_index(struct inode *dir_inode) {
+	pthread_mutex_lock(&dir_index_mutex);
+	if (!dir_indexes) dir_indexes = alloc_table(superblock->max_inum * sizeof(struct dir_index *));
+	struct dir_index *index = dir_indexes ? dir_indexes[dir_inode->ino] : NULL;
+	if (dir_indexes && !index) index = dir_indexes[dir_inode->ino] = build_dir_index(dir_inode);
+	pthread_mutex_unlock(&dir_index_mutex);
+	return index;
+}
+
+// Discards the index of a directory; it is rebuilt from disk the next time the directory is searched.
+// Status: COMPLETE
+void drop_dir_index(uint32_t ino) {
+	pthread_mutex_lock(&dir_index_mutex);
+	if (dir_indexes) {
+		dirindex_destroy(dir_indexes[ino]);
+		dir_indexes[ino] = NULL;
+	}
+	pthread_mutex_unlock(&dir_index_mutex);
+}
+
+// Releases every directory index. Indexes are dropped before their inode is freed, so only the inodes in use
+// are visited; the inode bitmap must still be resident.
+// Status: COMPLETE
+void free_dir_indexes() {
+	if (!dir_indexes) return;
+	for (size_t i = find_set_bit(inode_bitmap, 0, superblock->max_inum); i < superblock->max_inum; i = find_set_bit(inode_bitmap, i + 1, superblock->max_inum)) dirindex_destroy(dir_indexes[i]);
+	free_table(dir_indexes, superblock->max_inum * sizeof(struct dir_index *));
+	dir_indexes = NULL;
+}
+
+// find the directory entry of file fname within directory, also reports which (logical) directory block was used and the offset into the block where it was found
+// The lookup is answered by the directory's index, so it costs no disk I/O once the index is built.
+int dir_find_entry_and_location(struct inode inode_of_dir, const char *fname, size_t name_len, int *out_block_index, int *out_block_dirent_index, struct dirent *out_dirent){
 	//debug("dir_find_entry_and_location(): ENTER\n");
     //debug("dir_find_entry_and_location(): TARGET DIRENT IS \"%s\" LOCATED IN INO \"%d\"\n", fname, inode_of_dir);
-    
-    void *base = malloc(BLOCK_SIZE);
-    if (!base) {
-        return -1;
-    }
-    size_t inode_block_size = (inode_of_dir.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (inode_block_size > 16 || inode_of_dir.type != DIRECTORY || inode_of_dir.valid == FALSE) {
-        free(base);
-        return -1;
-    }
-    size_t block_dirent_size = BLOCK_SIZE / sizeof(struct dirent),
-		size = inode_of_dir.size;
-    for (unsigned int i = 0; i < inode_block_size; i++) {
-        int block_num = inode_of_dir.direct_ptr[i];
-        if (bio_read_multi(block_num, 1, base) != EXIT_SUCCESS) {
-            free(base);
-            return -1;
-        }
-        for (unsigned int j = 0; j < block_dirent_size; j++) {
-            if (size < sizeof(struct dirent)) {
-				free(base);
-				return -1;
-			}
-            struct dirent *current_dirent = (struct dirent *)(base + j * sizeof(struct dirent));
-			//debug("dir_find_entry_and_location(): CURRENT DIRENT IS \"%s\" WITH INO \"%d\"\n", current_dirent->name, current_dirent->ino);
-            if (current_dirent->valid == TRUE && strcmp(current_dirent->name, fname) == 0) {
-				//debug("dir_find_entry_and_location(): SUCCESSFULLY FOUND DIRENT \"%s\" WITH INO \"%d\"\n", current_dirent->name, current_dirent->ino);
-				*out_direct_pointer_index = i;
-				*out_block_dirent_index = j;
-				memcpy(out_dirent, current_dirent, sizeof(struct dirent));
-				free(base);
-                return EXIT_SUCCESS;
-            }
-            size = size >= sizeof(struct dirent) ? size - sizeof(struct dirent) : 0;
-        }
-    }
-    free(base);
-	//debug("dir_find_entry_and_location(): TARGET DIRENT \"%s\" NOT LOCATED IN INO \"%d\"\n", fname, inode_of_dir);
+    if (inode_of_dir.type != DIRECTORY || inode_of_dir.valid == FALSE) return -1;
+    struct dir_index *index = get_dir_index(&inode_of_dir);
+    if (!index) return -1;
+    uint32_t ino;
+    uint16_t slot;
+    uint32_t block_index;
+    if (dirindex_lookup(index, fname, &ino, &block_index, &slot) != EXIT_SUCCESS) {
+		//debug("dir_find_entry_and_location(): TARGET DIRENT \"%s\" NOT LOCATED IN INO \"%d\"\n", fname, inode_of_dir);
+		return -1;
+	}
+    *out_block_index = block_index;
+    *out_block_dirent_index = slot;
+    memset(out_dirent, 0, sizeof(struct dirent));
+    out_dirent->ino = ino;
+    out_dirent->valid = TRUE;
+    strncpy(out_dirent->name, fname, sizeof(out_dirent->name) - 1);
+    out_dirent->len = strlen(out_dirent->name);
     //debug("dir_find_entry_and_location(): EXIT\n");
-    return -1;
+    return EXIT_SUCCESS;
 }
 
 /* 
@@ -183,13 +838,13 @@ int dir_find_entry_and_location(struct inode inode_of_dir, const char *fname, si
  */
 
 // Status: COMPLETE
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
 	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
 	// Step 2: Get data block of current directory from inode
   	// Step 3: Read directory's data block and check each directory entry.
   	// If the name matches, then copy directory entry to dirent structure
 	
-	int direct_pointer_index;
+	int block_index;
 	int block_dirent_index;
 
 	struct inode inode_of_dir;
@@ -197,12 +852,12 @@ int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *di
         return -1;
     }
 
-    return dir_find_entry_and_location(inode_of_dir, fname, name_len, &direct_pointer_index, &block_dirent_index, dirent);
+    return dir_find_entry_and_location(inode_of_dir, fname, name_len, &block_index, &block_dirent_index, dirent);
 
 }
 
 // Status: COMPLETE
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+int dir_add(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
 	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
 	// Step 2: Check if fname (directory name) is already used in other entries
 	// Step 3: Add directory entry in dir_inode's data block and write to disk
@@ -212,65 +867,29 @@ int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t na
 	//debug("dir_add(): ENTER\n");
 	//debug("dir_add(): PARENT INO IS \"%d\"; CHILD IS \"%s\" WITH INO \"%d\"\n", dir_inode.ino, fname, f_ino);
 	size_t inode_block_size = (dir_inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	if (inode_block_size > 16 || dir_inode.type != DIRECTORY || dir_inode.valid == FALSE) return -1;
+	if (dir_inode.type != DIRECTORY || dir_inode.valid == FALSE) return -1;
+	// The index answers the duplicate check and supplies a free slot, so the directory is never scanned.
+	struct dir_index *index = get_dir_index(&dir_inode);
+	if (!index || dirindex_lookup(index, fname, NULL, NULL, NULL) == EXIT_SUCCESS) return -1;
 	void *base = malloc(BLOCK_SIZE);
 	if (!base) return -1;
-	size_t block_dirent_size = BLOCK_SIZE / sizeof(struct dirent),
-		size = dir_inode.size;
-	int block_num_target = -1,
-		dirent_index = -1;
-	for (unsigned int i = 0; i < inode_block_size; i++) {
-		int block_num = dir_inode.direct_ptr[i];
-		if (bio_read_multi(block_num, 1, base) != EXIT_SUCCESS) {
-			free(base);
-			return -1;
-		}
-		for (unsigned int j = 0; j < block_dirent_size; j++) {
-			if (size < sizeof(struct dirent)) goto end;
-			struct dirent *current_dirent = (struct dirent *)(base + j * sizeof(struct dirent));
-			if (current_dirent->valid == TRUE && strcmp(current_dirent->name, fname) == 0) {
-				free(base);
-				return -1;
-			}
-			if (current_dirent->valid == FALSE && block_num_target == -1) {
-				block_num_target = i;
-				dirent_index = j;
-			}
-			//debug("dir_add(): EXAMINING DIRENT \"%d\" -- valid = \"%d\", name = \"%s\"\n", j, current_dirent->valid, current_dirent->name);
-			size = size >= sizeof(struct dirent) ? size - sizeof(struct dirent) : 0;
-		}
-	}
-	end:
-	bitmap_t data_bitmap = NULL;
-	if (block_num_target == -1) {
-		if (inode_block_size >= 16) {
-			free(base);
-			return -1;
-		}
-		data_bitmap = get_data_bitmap(superblock);
-		if (!data_bitmap) {
-			free(base);
-			return -1;
-		}
-		int new_block_num = get_avail_blkno_no_wr(data_bitmap, superblock);
+	uint32_t block_index;
+	uint16_t dirent_index;
+	int new_block_num = -1;
+	uint32_t target_block_num;
+	if (dirindex_take_free(index, &block_index, &dirent_index) != EXIT_SUCCESS) {
+		new_block_num = get_avail_blkno();
 		if (new_block_num == -1) {
 			free(base);
-			free(data_bitmap);
 			return -1;
 		}
 		memset(base, 0, BLOCK_SIZE);
-		dir_inode.size += BLOCK_SIZE;
-		dir_inode.direct_ptr[inode_block_size] = new_block_num;
-		block_num_target = inode_block_size;
+		target_block_num = new_block_num;
+		block_index = inode_block_size;
 		dirent_index = 0;
-	} else if (inode_block_size < block_dirent_size && bio_read_multi(dir_inode.direct_ptr[block_num_target], 1, base) != EXIT_SUCCESS) {
+	} else if ((target_block_num = get_block_num(&dir_inode, block_index)) == 0 || journal_read(target_block_num, base) != EXIT_SUCCESS) {
 		free(base);
-		return -1;
-	}
-	dir_inode.link++;
-	if (writei(dir_inode.ino, &dir_inode) != EXIT_SUCCESS) {
-		free(base);
-		if (data_bitmap) free(data_bitmap);
+		drop_dir_index(dir_inode.ino);
 		return -1;
 	}
 	struct dirent *dirent = (struct dirent *)(base + dirent_index * sizeof(struct dirent));
@@ -279,203 +898,477 @@ int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t na
 	memset(dirent->name, 0, 208);
 	memcpy(dirent->name, fname, name_len + 1); // name_len does not account for null terminator
 	dirent->len = name_len;
-	if (bio_write_multi(dir_inode.direct_ptr[block_num_target], 1, base) != EXIT_SUCCESS) {
-		dir_inode.link--;
-		if (data_bitmap) {
-			dir_inode.size -= BLOCK_SIZE;
-			dir_inode.direct_ptr[block_num_target] = 0;
-			free(data_bitmap);
-		}
-		writei(dir_inode.ino, &dir_inode);
+	if (journal_write(target_block_num, base) != EXIT_SUCCESS) {
 		free(base);
-		return -1;
-	}
-	if (data_bitmap && update_data_bitmap(data_bitmap, TRUE, superblock) != EXIT_SUCCESS) {
-		dir_inode.link--;
-		dir_inode.size -= BLOCK_SIZE;
-		dir_inode.direct_ptr[block_num_target] = 0;
-		writei(dir_inode.ino, &dir_inode);
-		free(data_bitmap);
+		if (new_block_num != -1) release_blkno(new_block_num);
+		drop_dir_index(dir_inode.ino);
 		return -1;
 	}
 	free(base);
-	//debug("dir_add(): TARGET BLOCK IS \"%d\"\n", dir_inode.direct_ptr[block_num_target]);
+	// The entry is on disk; only now map a new block into the directory and update its inode.
+	if (new_block_num != -1) {
+		if (extent_insert(&dir_inode, block_index, new_block_num, 1) != EXIT_SUCCESS) {
+			release_blkno(new_block_num);
+			return -1;
+		}
+		dir_inode.size += BLOCK_SIZE;
+	}
+	dir_inode.link++;
+	if (writei(dir_inode.ino, &dir_inode) != EXIT_SUCCESS) return -1;
+	// Keep the index in step with the disk; if it cannot be updated it is dropped and rebuilt later.
+	boolean indexed = dirindex_insert(index, fname, f_ino, block_index, dirent_index) == EXIT_SUCCESS;
+	for (int j = BLOCK_SIZE / sizeof(struct dirent) - 1; new_block_num != -1 && j > 0; j--) {
+		if (dirindex_add_free(index, block_index, j) != EXIT_SUCCESS) indexed = FALSE;
+	}
+	if (!indexed) drop_dir_index(dir_inode.ino);
+	dcache_insert(dir_inode.ino, fname, name_len, f_ino);
+	//debug("dir_add(): TARGET BLOCK IS \"%d\"\n", target_block_num);
 	//debug("dir_add(): EXIT\n");
 	return EXIT_SUCCESS;
 }
 
-//clears data block and marks it available in data block bitmap
-void remove_data_block(int data_block_number){
-
-	// should perhaps add sanity checks (number is in range of 0 to superblock->max_dnum)
-
-	//clear data block
-	struct dirent *block_of_zeroes = malloc(BLOCK_SIZE);
-	memset(block_of_zeroes, 0, BLOCK_SIZE);
-	bio_write_multi(data_block_number, 1, block_of_zeroes);
-	//free(block_of_zeroes);
-
-	//make data block available in data bitmap
-	bitmap_t data_bitmap = get_data_bitmap(superblock);
-	unset_bitmap(data_bitmap, data_block_number);
-	update_data_bitmap(data_bitmap, TRUE, superblock);
-	free(block_of_zeroes);
-}
-
 // Helper function
 //clears an inode (setting mem to all 0 will make it invalid) and removes it from inode bitmap
 void remove_inode(int inode_number){
 
-	//clear data in inode
+	//clear data in inode, all but the generation, which the inode's next user bumps (see make_node())
 	struct inode zero;
+	readi(inode_number, &zero);
+	uint32_t generation = zero.generation;
 	memset(&zero, 0, sizeof(struct inode));
+	zero.generation = generation;
 	writei(inode_number, &zero);
 
+	//the inode number may be reused by a new directory, so forget any index or cached names built for the old one
+	drop_dir_index(inode_number);
+	dcache_invalidate_dir(inode_number);
+
 	//mark cleared inode as available in inode bitmap
-	bitmap_t inode_bitmap = get_inode_bitmap(superblock);
-	unset_bitmap(inode_bitmap, inode_number);
-	update_inode_bitmap(inode_bitmap, TRUE, superblock);
+	release_ino(inode_number);
 }
 
-// Helper function
-//removes the specified file, note it is not actually removed unless its link count drops to 0
-void remove_this_file(struct inode inode_of_file_to_remove){
-
-	// pretty sure this being called for a directory is why the directory inode is why there is a leak, but its link count will always be > 1 (min 2)
-	// commented out for now.
-	/*if(inode_of_file_to_remove.link > 1){
-		inode_of_file_to_remove.link--;
-		writei(inode_of_file_to_remove.ino, &inode_of_file_to_remove);
-		return;
-	}*/
-
-	//clear any allocated blocks pointed to directly
-	for(int direct_pointer_index = 0; direct_pointer_index < 16; direct_pointer_index ++){
-		if(inode_of_file_to_remove.direct_ptr[direct_pointer_index] != 0){
-			remove_data_block(inode_of_file_to_remove.direct_ptr[direct_pointer_index]);
+// Appends the run [start, start + count) to *ranges, growing it as needed; a run continuing the last one is merged into it.
+static int append_range(struct block_range **ranges, unsigned int *range_count, unsigned int *capacity, uint32_t start, uint32_t count) {
+	if (*range_count > 0 && (*ranges)[*range_count - 1].start + (*ranges)[*range_count - 1].count == start) {
+		(*ranges)[*range_count - 1].count += count;
+		return EXIT_SUCCESS;
+	}
+	if (*range_count == *capacity) {
+		unsigned int grown = *capacity ? 2 * *capacity : INLINE_EXTENTS;
+		struct block_range *larger = realloc(*ranges, grown * sizeof(struct block_range));
+		if (!larger) return -1;
+		*ranges = larger;
+		*capacity = grown;
+	}
+	(*ranges)[(*range_count)++] = (struct block_range){ start, count };
+	return EXIT_SUCCESS;
+}
+
+// Appends the data extents below (entries, count, depth) to *ranges. With freeing, the tree nodes are appended
+// as well and dropped from the journal, as everything collected is about to be released.
+static int extent_collect_node(struct extent *entries, int count, int depth, boolean freeing, struct block_range **ranges, unsigned int *range_count, unsigned int *capacity) {
+	for (int i = 0; i < count; i++) {
+		if (depth > 0) {
+			struct extent_block *child = read_extent_block(entries[i].physical);
+			int retstat = child ? extent_collect_node(child->entries, child->header.count, child->header.depth, freeing, ranges, range_count, capacity) : -1;
+			free(child);
+			if (retstat != EXIT_SUCCESS) return -1;
+			if (freeing == FALSE) continue;
+			journal_forget(entries[i].physical);
+			if (append_range(ranges, range_count, capacity, entries[i].physical, 1) != EXIT_SUCCESS) return -1;
+			continue;
+		}
+		if (append_range(ranges, range_count, capacity, entries[i].physical, entries[i].length) != EXIT_SUCCESS) return -1;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Unmaps every logical block at or after first in the subtree (header, entries), appending the freed data
+// runs and emptied tree nodes to *ranges. Only the rightmost path is visited: subtrees that lie entirely at
+// or after first are collected whole. The caller writes (header, entries) back.
+static int extent_truncate_node(struct extent_header *header, struct extent *entries, uint32_t first, struct block_range **ranges, unsigned int *range_count, unsigned int *capacity) {
+	while (header->count > 0) {
+		struct extent *last = &entries[header->count - 1];
+		if (header->depth == 0) {
+			if (last->logical >= first) {
+				if (append_range(ranges, range_count, capacity, last->physical, last->length) != EXIT_SUCCESS) return -1;
+				header->count--;
+				continue;
+			}
+			if (last->logical + last->length > first) {
+				uint32_t keep = first - last->logical;
+				if (append_range(ranges, range_count, capacity, last->physical + keep, last->length - keep) != EXIT_SUCCESS) return -1;
+				last->length = keep;
+			}
+			return EXIT_SUCCESS;
+		}
+		// An index entry bounds its subtree from below, except the first, which also takes smaller blocks.
+		if (header->count > 1 && last->logical >= first) {
+			if (extent_collect_node(last, 1, header->depth, TRUE, ranges, range_count, capacity) != EXIT_SUCCESS) return -1;
+			header->count--;
+			continue;
+		}
+		struct extent_block *child = read_extent_block(last->physical);
+		if (!child) return -1;
+		int retstat = extent_truncate_node(&child->header, child->entries, first, ranges, range_count, capacity);
+		if (retstat == EXIT_SUCCESS && child->header.count == 0) {
+			journal_forget(last->physical);
+			retstat = append_range(ranges, range_count, capacity, last->physical, 1);
+			header->count--;
+		} else if (retstat == EXIT_SUCCESS) retstat = journal_write(last->physical, child);
+		free(child);
+		return retstat;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Unmaps logical blocks first and beyond from a file or directory and frees them, with their emptied tree
+// nodes, in one bitmap pass; their number is added to *out_freed unless it is NULL. A tree left with a
+// single node that fits in the inode loses a level. The caller writes the inode afterwards.
+// Status: COMPLETE
+int extent_truncate(struct inode *inode, uint32_t first, unsigned int *out_freed) {
+	struct block_range *ranges = NULL;
+	unsigned int range_count = 0,
+		capacity = 0;
+	struct extent_header header = inode->extent_root;
+	struct extent entries[INLINE_EXTENTS];
+	memcpy(entries, inode->extents, sizeof(inode->extents));
+	int retstat = extent_truncate_node(&header, entries, first, &ranges, &range_count, &capacity);
+	while (retstat == EXIT_SUCCESS && header.depth > 0 && header.count == 1) {
+		struct extent_block *child = read_extent_block(entries[0].physical);
+		boolean fits = child && child->header.count <= INLINE_EXTENTS;
+		if (!child) retstat = -1;
+		else if (fits == TRUE) {
+			journal_forget(entries[0].physical);
+			retstat = append_range(&ranges, &range_count, &capacity, entries[0].physical, 1);
+			header.count = child->header.count;
+			header.depth = child->header.depth;
+			memcpy(entries, child->entries, child->header.count * sizeof(struct extent));
+		}
+		free(child);
+		if (fits == FALSE) break;
+	}
+	if (retstat == EXIT_SUCCESS) {
+		if (header.count == 0) header.depth = 0;
+		inode->extent_root = header;
+		memcpy(inode->extents, entries, sizeof(inode->extents));
+		// Directory blocks are journaled like tree nodes; file data never is.
+		free_block_ranges(ranges, range_count, inode->type == DIRECTORY);
+		extent_generation[inode->ino]++;
+		for (unsigned int i = 0; out_freed && i < range_count; i++) *out_freed += ranges[i].count;
+	}
+	free(ranges);
+	return retstat;
+}
+
+// Writes the file's dirty cached data blocks to the disk, in block order; its metadata goes through the
+// journal and is left alone. The caller holds the file's lock, at least shared.
+// Status: COMPLETE
+int writeback_file(struct inode *inode) {
+	struct block_range *ranges = NULL;
+	unsigned int range_count = 0,
+		capacity = 0;
+	int retstat = extent_collect_node(inode->extents, inode->extent_root.count, inode->extent_root.depth, FALSE, &ranges, &range_count, &capacity);
+	if (retstat == EXIT_SUCCESS) retstat = bcache_flush_ranges(ranges, range_count);
+	free(ranges);
+	return retstat;
+}
+
+// Gives the delayed blocks of a file (see delalloc.c) disk blocks and writes them out with one bio_writev().
+// The whole pending range is placed at once: each run of consecutive blocks continues the file's data right
+// before it, or else the run placed before it, so that a file written in small pieces still ends up in one
+// extent. The blocks come out of the reservations made when they were written. As in allocate_range(), the
+// data is written before the extents that map it are inserted, so the file never maps blocks that were not
+// written. Returns EXIT_SUCCESS, or -1 with the blocks that could not be placed or written still delayed. The
+// caller holds the file's lock exclusively and a journal handle.
+// Status: COMPLETE
+int flush_delayed(struct inode *inode) {
+	struct delalloc_block *blocks;
+	unsigned int count = delalloc_list(inode->ino, &blocks);
+	if (count == 0) return delalloc_count(inode->ino) == 0 ? EXIT_SUCCESS : -1;
+	unsigned int *block_nums = malloc(count * sizeof(unsigned int));
+	void **bufs = malloc(count * sizeof(void *));
+	struct block_range *runs = malloc(count * sizeof(struct block_range));
+	int retstat = block_nums && bufs && runs ? EXIT_SUCCESS : -1;
+	unsigned int placed = 0,
+		run_count = 0;
+	uint32_t goal = 0;
+	while (retstat == EXIT_SUCCESS && placed < count) {
+		unsigned int end = placed + 1;
+		while (end < count && blocks[end].logical == blocks[end - 1].logical + 1) end++;
+		uint32_t before = blocks[placed].logical > 0 ? get_block_num(inode, blocks[placed].logical - 1) : 0;
+		if (before != 0) goal = before + 1;
+		while (retstat == EXIT_SUCCESS && placed < end) {
+			unsigned int got;
+			int blkno = get_avail_blkno_run(goal, end - placed, TRUE, &got);
+			if (blkno == -1) {
+				retstat = -1;
+				break;
+			}
+			for (unsigned int k = 0; k < got; k++) {
+				block_nums[placed + k] = blkno + k;
+				bufs[placed + k] = blocks[placed + k].data;
+			}
+			runs[run_count++] = (struct block_range){ blkno, got };
+			placed += got;
+			goal = blkno + got;
+		}
+	}
+	// Runs are mapped in order until one fails; the rest go back into the reservation, for the next attempt.
+	unsigned int mapped_runs = 0,
+		mapped = 0;
+	if (placed > 0 && bio_writev(block_nums, placed, bufs) != EXIT_SUCCESS) retstat = -1;
+	else {
+		for (; mapped_runs < run_count; mapped += runs[mapped_runs++].count) {
+			if (extent_insert(inode, blocks[mapped].logical, runs[mapped_runs].start, runs[mapped_runs].count) != EXIT_SUCCESS) {
+				retstat = -1;
+				break;
+			}
 		}
 	}
-
-	int *data_block_number_array = malloc(BLOCK_SIZE);
-
-	//clear any blocks used by indirect pointers
-	for(int indirect_pointer_index = 0; indirect_pointer_index < 8; indirect_pointer_index ++){
-		
-		//0 means it doesn't point to a block
-		// all dirents should reach this continue statement, just something to note.
-		if(inode_of_file_to_remove.indirect_ptr[indirect_pointer_index] == 0){
-			continue;
+	if (mapped_runs < run_count) {
+		release_block_ranges(runs + mapped_runs, run_count - mapped_runs);
+		pthread_mutex_lock(&alloc_mutex);
+		reserved_data_blocks += placed - mapped;
+		pthread_mutex_unlock(&alloc_mutex);
+	}
+	if (mapped > 0) {
+		// Blocks are placed in logical order, so the mapped ones are exactly those up to the last of them.
+		delalloc_drop(inode->ino, 0, blocks[mapped - 1].logical, TRUE);
+		if (writei(inode->ino, inode) != EXIT_SUCCESS) retstat = -1;
+	}
+	free(blocks);
+	free(block_nums);
+	free(bufs);
+	free(runs);
+	return retstat;
+}
+
+// Discards the delayed blocks of a file from logical block first on and gives back their reservations.
+// The caller holds the file's lock exclusively.
+// Status: COMPLETE
+void drop_delayed(uint32_t ino, uint32_t first) {
+	unreserve_blocks(delalloc_drop(ino, first, UINT32_MAX, FALSE));
+}
+
+// Makes what writeback_file() wrote durable, followed by the journal transaction holding the inode's last
+// change; with datasync, a change of timestamps alone is not waited for. Must be called without inode locks
+// or a journal handle. Returns 0 or -EIO.
+// Status: COMPLETE
+int commit_inode(uint32_t ino, boolean datasync) {
+	if (ino >= superblock->max_inum) return -EIO;
+	pthread_mutex_lock(&inode_table_mutex);
+	uint64_t id = datasync == TRUE ? inode_datasync_id[ino] : inode_commit_id[ino];
+	pthread_mutex_unlock(&inode_table_mutex);
+	// Data first, so that a committed inode never maps blocks whose contents are still in flight.
+	if (dev_sync() != EXIT_SUCCESS) return -EIO;
+	if (id != 0) journal_commit_id(id);
+	return 0;
+}
+
+// Writes back all cached data and commits the journal, leaving the whole file system durable. Delayed blocks
+// get disk blocks first, one file at a time. Must be called without inode locks or a journal handle.
+// Status: COMPLETE
+int rufs_sync() {
+	int retstat = EXIT_SUCCESS;
+	uint32_t *inos;
+	unsigned int count = delalloc_inodes(&inos);
+	for (unsigned int i = 0; i < count; i++) {
+		uint32_t ino = inos[i];
+		struct inode inode;
+		journal_start();
+		lock_inode(ino, TRUE);
+		if (readi(ino, &inode) == EXIT_SUCCESS && inode.valid == TRUE && inode.type == FILE && flush_delayed(&inode) != EXIT_SUCCESS) retstat = -1;
+		unlock_inode(ino);
+		journal_stop();
+	}
+	free(inos);
+	if (bcache_flush() != EXIT_SUCCESS || dev_sync() != EXIT_SUCCESS) return -1;
+	return journal_commit() == EXIT_SUCCESS ? retstat : -1;
+}
+
+// Detaches an inode whose directory entry is being removed: it goes on the orphan list, which the superblock
+// keeps across crashes, and the reclaimer frees it and everything below it later (see reclaim_orphan()).
+// An inode still looked up or open stays usable until put_inode_refs() lets go of it. Returns TRUE if
+// nothing refers to it, in which case a file's delayed blocks are dropped right away and never reach the
+// disk and the caller kicks the reclaimer. The caller holds the inode exclusively and a journal handle.
+// Status: COMPLETE
+boolean orphan_add(struct inode *inode) {
+	pthread_mutex_lock(&orphan_mutex);
+	inode->next_orphan = superblock->orphan_head;
+	set_next_orphan(inode->ino, inode->next_orphan);
+	superblock->orphan_head = inode->ino;
+	journal_dirty(0);
+	orphan_id = journal_transaction_id();
+	inode_refs[inode->ino].orphaned = TRUE;
+	boolean unreferenced = inode_referenced(inode->ino) == TRUE ? FALSE : TRUE;
+	pthread_mutex_unlock(&orphan_mutex);
+	if (unreferenced == TRUE && inode->type == FILE) drop_delayed(inode->ino, 0);
+	return unreferenced;
+}
+
+// reclaim_step_t of the reclaimer: frees one batch of the orphan being reclaimed, first taking the next one
+// off the list if there is none; orphans still referred to (see inode_referenced()) are passed over. A file loses up to RECLAIM_BATCH_BLOCKS blocks from its end per call; a
+// directory puts the children listed in its last block on the orphan list and then loses that block. Once
+// nothing is left, the inode itself is released. Each call is one journal transaction.
+// Status: COMPLETE
+int reclaim_orphan(unsigned int *blocks, unsigned int *inodes) {
+	// Nothing is freed before the removals are durable: a crash must not bring back a file whose blocks
+	// were already discarded.
+	pthread_mutex_lock(&orphan_mutex);
+	uint64_t id = orphan_id;
+	pthread_mutex_unlock(&orphan_mutex);
+	if (id != 0) journal_commit_id(id);
+	journal_start();
+	pthread_mutex_lock(&orphan_mutex);
+	uint32_t ino = superblock->orphan_current;
+	if (ino == 0) {
+		struct inode orphan;
+		uint32_t prev = 0;
+		for (ino = superblock->orphan_head; ino != 0 && inode_referenced(ino) == TRUE; prev = ino, ino = orphan.next_orphan) readi(ino, &orphan);
+		if (ino != 0) {
+			readi(ino, &orphan);
+			if (prev == 0) superblock->orphan_head = orphan.next_orphan;
+			else set_next_orphan(prev, orphan.next_orphan);
+			set_next_orphan(ino, 0);
+			inode_refs[ino].orphaned = FALSE;
+			superblock->orphan_current = ino;
+			journal_dirty(0);
+		}
+	}
+	pthread_mutex_unlock(&orphan_mutex);
+	if (ino == 0) {
+		journal_stop();
+		return 0;
+	}
+	struct inode inode;
+	int retstat = EXIT_SUCCESS;
+	lock_inode(ino, TRUE);
+	readi(ino, &inode);
+	if (inode.valid == TRUE && inode.type == DIRECTORY && inode.size >= BLOCK_SIZE) {
+		uint32_t last = inode.size / BLOCK_SIZE - 1,
+			block_num = get_block_num(&inode, last);
+		struct dirent *entries = malloc(BLOCK_SIZE);
+		if (!entries || (block_num != 0 && journal_read(block_num, entries) != EXIT_SUCCESS)) retstat = -1;
+		for (int j = 0; retstat == EXIT_SUCCESS && block_num != 0 && j < BLOCK_SIZE / sizeof(struct dirent); j++) {
+			if (entries[j].valid == FALSE || strcmp(entries[j].name, ".") == 0 || strcmp(entries[j].name, "..") == 0) continue;
+			// The child is locked after its directory, as for any removal.
+			struct inode child;
+			lock_inode(entries[j].ino, TRUE);
+			if (readi(entries[j].ino, &child) == EXIT_SUCCESS && child.valid == TRUE) orphan_add(&child);
+			unlock_inode(entries[j].ino);
 		}
-
-		bio_read_multi(inode_of_file_to_remove.indirect_ptr[indirect_pointer_index], 1, data_block_number_array);
-		
-		//free the blocks pointed to by dirents in indirect block
-		for(int indirect_block_index = 0; indirect_block_index < BLOCK_SIZE / sizeof(int); indirect_block_index ++){
-			if(data_block_number_array[indirect_block_index] != 0){
-				remove_data_block(data_block_number_array[indirect_block_index]);
-			}
+		free(entries);
+		if (retstat == EXIT_SUCCESS) {
+			inode.size = last * BLOCK_SIZE;
+			retstat = extent_truncate(&inode, last, blocks);
+		}
+		if (retstat == EXIT_SUCCESS) writei(ino, &inode);
+		// Lookups by inode number (rufs_ll.c) must not find the children through the index or dentry cache.
+		drop_dir_index(ino);
+		dcache_invalidate_dir(ino);
+	} else if (inode.valid == TRUE && (inode.size > 0 || inode.extent_root.count > 0)) {
+		// Blocks fallocate()d past the end go with the last batch.
+		uint32_t end = ((uint64_t)inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE,
+			first = end > RECLAIM_BATCH_BLOCKS ? end - RECLAIM_BATCH_BLOCKS : 0;
+		inode.size = (uint64_t)first * BLOCK_SIZE;
+		// Delayed blocks written through handles closed since the removal go as well.
+		drop_delayed(ino, first);
+		retstat = extent_truncate(&inode, first, blocks);
+		if (retstat == EXIT_SUCCESS) writei(ino, &inode);
+	} else {
+		pthread_mutex_lock(&orphan_mutex);
+		superblock->orphan_current = 0;
+		journal_dirty(0);
+		pthread_mutex_unlock(&orphan_mutex);
+		if (inode.valid == TRUE) {
+			if (inode.type == FILE) drop_delayed(ino, 0);
+			remove_inode(ino);
+			(*inodes)++;
 		}
-
-		//remove the indirect blocks themselves
-		remove_data_block(inode_of_file_to_remove.indirect_ptr[indirect_pointer_index]);
 	}
-
-	free(data_block_number_array);
-	remove_inode(inode_of_file_to_remove.ino);
+	unlock_inode(ino);
+	journal_stop();
+	return retstat == EXIT_SUCCESS ? 1 : -1;
 }
 
 // Helper function
 //clears an entry that was occupied in a directory by a now removed file
-int remove_entry_from_directory(struct inode dir_inode, int direct_pointer_index, int block_dirent_index){
+int remove_entry_from_directory(struct inode dir_inode, int block_index, int block_dirent_index){
 	struct dirent *block_of_mem = malloc(BLOCK_SIZE);
-	int err_code = bio_read_multi(dir_inode.direct_ptr[direct_pointer_index], 1, block_of_mem);
+	uint32_t block_num = get_block_num(&dir_inode, block_index);
+	int err_code = !block_of_mem || block_num == 0 ? -1 : journal_read(block_num, block_of_mem);
 
 	if(err_code == EXIT_SUCCESS){
+		struct dirent removed = block_of_mem[block_dirent_index];
 		memset(block_of_mem + block_dirent_index, 0, sizeof(struct dirent));
-		err_code = bio_write_multi(dir_inode.direct_ptr[direct_pointer_index], 1, block_of_mem);
-
-	}
-
-	free(block_of_mem);
-
-	return err_code;
-}
-
-//removes the specified directory and recursively removes anything inside of it, directories can only be hard linked once so links are not counted
-void remove_this_dir(struct inode inode_of_dir_to_remove){
+		err_code = journal_write(block_num, block_of_mem);
 
-	struct dirent *block_of_mem = malloc(BLOCK_SIZE);
-
-	//this loop deletes files and directories inside of this directory
-	for(int direct_pointer_index = 0; direct_pointer_index < 16; direct_pointer_index ++){
-		
-		//points to 0th block means it is not a used pointer
-		if(inode_of_dir_to_remove.direct_ptr[direct_pointer_index] == 0){
-			continue;
-		}
-
-		bio_read_multi(inode_of_dir_to_remove.direct_ptr[direct_pointer_index], 1, block_of_mem);
-
-		for(int directory_entry_index = 0; directory_entry_index < BLOCK_SIZE / sizeof(struct dirent); directory_entry_index ++){
-			struct dirent curr_dir_entry = block_of_mem[directory_entry_index];
-
-			if(curr_dir_entry.valid == FALSE || strcmp(curr_dir_entry.name, ".") == 0 || strcmp(curr_dir_entry.name, "..") == 0){
-				continue;
+		//keep the directory's index (if it has one) in step with the block; the directory is locked exclusively, so nobody else builds or drops it
+		struct dir_index *index = dir_indexes ? dir_indexes[dir_inode.ino] : NULL;
+		if(err_code == EXIT_SUCCESS && index && removed.valid == TRUE){
+			if(dirindex_remove(index, removed.name) != EXIT_SUCCESS || dirindex_add_free(index, block_index, block_dirent_index) != EXIT_SUCCESS){
+				drop_dir_index(dir_inode.ino);
 			}
+		}
+		else if(err_code != EXIT_SUCCESS){
+			drop_dir_index(dir_inode.ino);
+		}
 
-			struct inode inode_of_file_to_remove;
-			readi(curr_dir_entry.ino, &inode_of_file_to_remove);
-
-			//if there is a directory within the directory we want to delete, recurse to delete it first
-			if(inode_of_file_to_remove.type == DIRECTORY){
-				remove_this_dir(inode_of_file_to_remove);
-			}
-			else{
-				remove_this_file(inode_of_file_to_remove);
-			}
-			remove_entry_from_directory(inode_of_dir_to_remove, direct_pointer_index, directory_entry_index);
+		//the name is gone from this directory; remember that for path lookups
+		if(err_code == EXIT_SUCCESS && removed.valid == TRUE){
+			dcache_insert_negative(dir_inode.ino, removed.name, strlen(removed.name));
 		}
 	}
 
 	free(block_of_mem);
-	//gets called to remove its actual data blocks and inode
-	remove_this_file(inode_of_dir_to_remove);
+
+	return err_code;
 }
 
 //removes either directory or file from in the parent directory corresponding to dir_inode
 //if file_type_to_remove is -1, it will just remove it based on the file type it is
 // if file_type_to_remove is specified, we will return an error if the given file does not match the type expected
 int remove_from_dir(struct inode dir_inode, const char *fname, size_t name_len, int file_type_to_remove){
-	int direct_pointer_index;
+	int block_index;
 	int block_durent_index;
 	struct dirent found_dir_entry;
-	if(dir_find_entry_and_location(dir_inode, fname, name_len, &direct_pointer_index, &block_durent_index, &found_dir_entry) == -1){
-		return EXIT_FAILURE;
+	if(dir_find_entry_and_location(dir_inode, fname, name_len, &block_index, &block_durent_index, &found_dir_entry) == -1){
+		return -ENOENT;
 	}
 
+	//the caller holds the directory exclusively; the child is locked after it (see the lock order)
 	struct inode inode_of_file_to_remove;
+	lock_inode(found_dir_entry.ino, TRUE);
 	readi(found_dir_entry.ino, &inode_of_file_to_remove);
 
-	if(file_type_to_remove != -1){
-		if(file_type_to_remove == DIRECTORY && inode_of_file_to_remove.type != DIRECTORY){
-			return -ENOTDIR;
-		}
-		else if(file_type_to_remove != DIRECTORY && inode_of_file_to_remove.type == DIRECTORY){
-			return -EISDIR;
-		}
+	int status = EXIT_SUCCESS;
+	boolean reclaim = FALSE;
+	if(file_type_to_remove == DIRECTORY && inode_of_file_to_remove.type != DIRECTORY){
+		status = -ENOTDIR;
 	}
-
-	if(inode_of_file_to_remove.type == DIRECTORY){
-		remove_this_dir(inode_of_file_to_remove);
+	else if(file_type_to_remove != -1 && file_type_to_remove != DIRECTORY && inode_of_file_to_remove.type == DIRECTORY){
+		status = -EISDIR;
 	}
-	else if(inode_of_file_to_remove.type == FILE){
-		remove_this_file(inode_of_file_to_remove);
+	else if(inode_of_file_to_remove.type != DIRECTORY && inode_of_file_to_remove.type != FILE){
+		status = -1;
+	}
+	//the entry goes first: an inode is only orphaned once no entry can lead to it any more
+	else if(remove_entry_from_directory(dir_inode, block_index, block_durent_index) != EXIT_SUCCESS){
+		status = -EIO;
 	}
 	else{
-		return -1;
+		//only detached here, so that removing a whole tree takes constant time; the reclaimer frees it once nothing refers to it
+		reclaim = orphan_add(&inode_of_file_to_remove);
+	}
+	unlock_inode(found_dir_entry.ino);
+	if(status != EXIT_SUCCESS){
+		return status;
+	}
+
+	if(reclaim == TRUE){
+		reclaim_kick();
 	}
-	
-	remove_entry_from_directory(dir_inode, direct_pointer_index, block_durent_index);
 	
 	return EXIT_SUCCESS;
 }
@@ -487,49 +1380,153 @@ int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
 	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
 	return remove_from_dir(dir_inode, fname, name_len, DIRECTORY);
 }
+// extent_lookup() through an open file's map hint: a block inside the last extent found for the handle is
+// mapped without touching the extent tree. handle may be NULL.
+// Status: COMPLETE
+int map_lookup(struct inode *inode, struct rufs_handle *handle, uint32_t logical, uint32_t *out_physical, uint32_t *out_run) {
+	if (handle) {
+		// Readers sharing one open file may get here concurrently, so the hint has its own mutex.
+		struct extent *hint = &handle->map_hint;
+		pthread_mutex_lock(&handle->hint_mutex);
+		if (handle->map_generation != extent_generation[inode->ino]) {
+			hint->length = 0;
+			handle->map_generation = extent_generation[inode->ino];
+		}
+		boolean hit = logical >= hint->logical && logical - hint->logical < hint->length;
+		if (hit == TRUE) {
+			*out_physical = hint->physical + (logical - hint->logical);
+			*out_run = hint->length - (logical - hint->logical);
+		}
+		pthread_mutex_unlock(&handle->hint_mutex);
+		if (hit == TRUE) return EXIT_SUCCESS;
+	}
+	if (extent_lookup(inode, logical, out_physical, out_run) != EXIT_SUCCESS) return -1;
+	if (handle && *out_physical != 0) {
+		pthread_mutex_lock(&handle->hint_mutex);
+		handle->map_hint.logical = logical;
+		handle->map_hint.physical = *out_physical;
+		handle->map_hint.length = *out_run;
+		pthread_mutex_unlock(&handle->hint_mutex);
+	}
+	return EXIT_SUCCESS;
+}
+
+// Resolves logical blocks [start, start + count) of a file to disk block numbers; 0 marks a hole.
+// The extent tree is consulted once per extent rather than once per block. handle may be NULL.
+// Status: COMPLETE
+int get_block_map(struct inode *inode, struct rufs_handle *handle, int start, int count, unsigned int *out_block_nums) {
+	for (int k = 0; k < count;) {
+		uint32_t physical, run;
+		if (map_lookup(inode, handle, start + k, &physical, &run) != EXIT_SUCCESS) return -1;
+		for (; run > 0 && k < count; run--, k++) {
+			out_block_nums[k] = physical;
+			if (physical != 0) physical++;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+// Readahead worker callback: maps logical blocks [first, first + count) of a file, which brings the extent
+// tree nodes describing them into the cache on the way, and prefetches the mapped blocks. The file's lock is
+// held shared throughout, so none of the blocks can be freed and reused while they are being loaded.
+// Status: COMPLETE
+void readahead_file(uint32_t ino, uint32_t first, uint32_t count) {
+	struct inode inode;
+	lock_inode(ino, FALSE);
+	if (readi(ino, &inode) == EXIT_SUCCESS && inode.valid == TRUE && inode.type == FILE) {
+		uint32_t file_blocks = ((uint64_t)inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if (first < file_blocks) count = min(count, file_blocks - first);
+		else count = 0;
+		unsigned int *block_nums = count > 0 ? malloc(count * sizeof(unsigned int)) : NULL;
+		if (block_nums && get_block_map(&inode, NULL, first, count, block_nums) == EXIT_SUCCESS) {
+			unsigned int mapped = 0;
+			for (uint32_t i = 0; i < count; i++) {
+				if (block_nums[i] != 0) block_nums[mapped++] = block_nums[i];
+			}
+			bcache_prefetch(block_nums, mapped);
+		}
+		free(block_nums);
+	}
+	unlock_inode(ino);
+}
+
 /* 
  * namei operation
  */
 
+// Resolves one name in directory dir_ino through the dentry cache; only a miss searches the directory, and
+// its outcome (found or not) is cached for the next lookup. The caller holds the directory's lock.
+// Status: COMPLETE
+int lookup_name(uint32_t dir_ino, const char *name, uint32_t *out_ino) {
+	size_t name_len = strlen(name);
+	int cached = dcache_lookup(dir_ino, name, name_len, out_ino);
+	if (cached == DCACHE_HIT) return EXIT_SUCCESS;
+	if (cached == DCACHE_NEGATIVE) return -1;
+	struct dirent dirent;
+	if (dir_find(dir_ino, name, name_len, &dirent) == -1) {
+		dcache_insert_negative(dir_ino, name, name_len);
+		return -1;
+	}
+	dcache_insert(dir_ino, name, name_len, dirent.ino);
+	*out_ino = dirent.ino;
+	return EXIT_SUCCESS;
+}
+
+// Resolves path from directory ino and returns with the inode it names locked (exclusively if exclusive is
+// TRUE) and copied into inode. Each directory stays locked shared until the next component is locked.
+// Status: COMPLETE
+int lock_node_by_path(const char *path, uint32_t ino, boolean exclusive, struct inode *inode) {
+	if (!path || path[0] != '/') return -1;
+	uint32_t current_ino = ino;
+	char target_directory[sizeof(((struct dirent *)0)->name)];
+	const char *component = path + strspn(path, "/");
+	lock_inode(current_ino, *component == '\0' ? exclusive : FALSE);
+	while (*component != '\0') {
+		size_t component_len = strcspn(component, "/");
+		const char *next = component + component_len;
+		next += strspn(next, "/");
+		uint32_t next_ino;
+		if (component_len >= sizeof(target_directory)) goto fail;
+		memcpy(target_directory, component, component_len);
+		target_directory[component_len] = '\0';
+		//debug("lock_node_by_path(): taking a look at \"%s\"\n", target_directory);
+		if (lookup_name(current_ino, target_directory, &next_ino) != EXIT_SUCCESS) goto fail;
+		if (next_ino != current_ino) {
+			boolean next_exclusive = *next == '\0' ? exclusive : FALSE;
+			if (strcmp(target_directory, "..") == 0) {
+				// The parent comes before this directory in the lock order.
+				unlock_inode(current_ino);
+				lock_inode(next_ino, next_exclusive);
+			} else {
+				lock_inode(next_ino, next_exclusive);
+				unlock_inode(current_ino);
+			}
+			current_ino = next_ino;
+		} else if (*next == '\0' && exclusive == TRUE) {
+			// "." as the last component: upgrade by relocking, as rwlocks cannot be upgraded in place.
+			unlock_inode(current_ino);
+			lock_inode(current_ino, TRUE);
+		}
+		component = next;
+	}
+	if (readi(current_ino, inode) != EXIT_SUCCESS || inode->valid == FALSE) goto fail;
+	return EXIT_SUCCESS;
+	fail:
+	unlock_inode(current_ino);
+	return -1;
+}
+
 // Status: COMPLETE
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
 	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
 	// Note: You could either implement it in a iterative way or recursive way
+	// Each component is resolved with lookup_name(), so a cached path never searches a directory. The
+	// returned copy is a snapshot; use lock_node_by_path() to keep the inode locked.
     //debug("get_node_by_path(): ENTER\n");
     //debug("get_node_by_path(): STARTING PATH IS \"%s\"\n", path);
-    if (!path || path[0] != '/') return -1;
-	struct dirent *current_dirent = malloc(sizeof(struct dirent));
-	if (!current_dirent) return -1;
-    int current_ino = ino;
-	int start_ind = 1;
-	int end_ind = split_string(start_ind, path);
-	memset(current_dirent, 0, sizeof(struct dirent));
-    while (end_ind != -1) {
-		char *target_directory = malloc(end_ind - start_ind + 1);
-		if (!target_directory) {
-			free(current_dirent);
-			return -1;
-		}
-		memcpy(target_directory, path + start_ind, end_ind - start_ind + 1);
-		if (path[end_ind] == '/') target_directory[end_ind - start_ind] = '\0';
-		//debug("get_node_by_path(): taking a look at \"%s\"\n", target_directory);
-        if (dir_find(current_ino, target_directory, end_ind - start_ind + 1, current_dirent) == -1) {
-			free(current_dirent);
-			free(target_directory);
-            return -1;
-        }
-        current_ino = current_dirent->ino;
-        start_ind = end_ind + 1;
-		free(target_directory);
-		if (start_ind >= strlen(path) + 1) break;
-		end_ind = split_string(start_ind, path);
-    }
-    if (readi(current_ino, inode) != EXIT_SUCCESS) {
-		free(current_dirent);
-        return -1;
-    }
-	free(current_dirent);
-	//debug("get_node_by_path(): FINAL INO IS \"%d\"\n", current_ino);
+	if (lock_node_by_path(path, ino, FALSE, inode) != EXIT_SUCCESS) return -1;
+	unlock_inode(inode->ino);
+	//debug("get_node_by_path(): FINAL INO IS \"%d\"\n", inode->ino);
     //debug("get_node_by_path(): EXIT\n");
     return EXIT_SUCCESS;
 }
@@ -538,6 +1535,48 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
  * Make file system
  */
 
+// Reads a size such as 512M or 2T (K, M, G and T being powers of 1024) into *out_size. Returns EXIT_SUCCESS,
+// or -1 if text is not a size.
+// Status: COMPLETE
+int parse_size(const char *text, uint64_t *out_size) {
+	const char *units = "KMGT";
+	char *end;
+	if (*text < '0' || *text > '9') return -1;
+	errno = 0;
+	unsigned long long size = strtoull(text, &end, 10);
+	const char *unit = *end != '\0' ? strchr(units, toupper((unsigned char)*end)) : NULL;
+	if (errno != 0 || (*end != '\0' && (!unit || end[1] != '\0'))) return -1;
+	for (long i = unit ? unit - units : -1; i >= 0; i--) {
+		if (size > UINT64_MAX / 1024) return -1;
+		size *= 1024;
+	}
+	*out_size = size;
+	return EXIT_SUCCESS;
+}
+
+// Fills in the geometry of a new disk of block_count blocks with inode_count inodes. The journal grows with
+// the disk, from JOURNAL_DEFAULT_BLOCKS up to JOURNAL_MAX_BLOCKS. Returns EXIT_SUCCESS, or -1 if a count is
+// out of range or the metadata leaves no room for data.
+// Status: COMPLETE
+int layout_disk(struct superblock *superblock, uint64_t block_count, uint64_t inode_count) {
+	if (block_count > MAX_DISK_BLOCKS || inode_count == 0 || inode_count > MAX_INODES) return -1;
+	uint64_t journal_block_count = block_count / 1024;
+	if (journal_block_count < JOURNAL_DEFAULT_BLOCKS) journal_block_count = JOURNAL_DEFAULT_BLOCKS;
+	if (journal_block_count > JOURNAL_MAX_BLOCKS) journal_block_count = JOURNAL_MAX_BLOCKS;
+	superblock->magic_num = MAGIC_NUM;
+	superblock->version = RUFS_VERSION;
+	superblock->max_dnum = block_count;
+	superblock->max_inum = inode_count;
+	superblock->j_start_blk = 1;
+	superblock->j_block_count = journal_block_count;
+	superblock->i_bitmap_blk = superblock->j_start_blk + journal_block_count;
+	superblock->d_bitmap_blk = superblock->i_bitmap_blk + bitmap_block_size(inode_count);
+	superblock->i_start_blk = superblock->d_bitmap_blk + bitmap_block_size(block_count);
+	superblock->d_start_blk = superblock->i_start_blk + (inode_count * sizeof(struct inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	// Room for at least the root directory and the extent tree nodes of a first file.
+	return superblock->d_start_blk + ALLOC_RESERVE_SLACK <= block_count ? EXIT_SUCCESS : -1;
+}
+
 // Status: COMPLETE
 int rufs_mkfs() {
 	// Call dev_init() to initialize (Create) Diskfile
@@ -548,121 +1587,728 @@ int rufs_mkfs() {
 	// update inode for root directory
 	/* Hierarchy of blocks:
 	 * 1) Superblock
-	 * 2) Inode bitmap
-	 * 3) Data bitmap
-	 * 4) Inodes
-	 * 5) Data
+	 * 2) Journal
+	 * 3) Inode bitmap
+	 * 4) Data bitmap
+	 * 5) Inodes
+	 * 6) Data
 	 */
 	//debug("rufs_mkfs(): ENTER\n");
-	dev_init(diskfile_path);
-	// Superblock initialization
-	size_t superblock_block_size = (sizeof(struct superblock) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	struct superblock *superblock = malloc(superblock_block_size * BLOCK_SIZE);
-	memset(superblock, 0, superblock_block_size * BLOCK_SIZE);
-	superblock->magic_num = MAGIC_NUM;
-	superblock->max_inum = MAX_INUM;
-	superblock->max_dnum = MAX_DNUM;
-	unsigned int block_num = superblock_block_size;
-	// Inode bitmap initialization
-	superblock->i_bitmap_blk = block_num;
-	size_t inode_bitmap_byte_size = (MAX_INUM + 7) / 8,
-		inode_bitmap_block_size = (inode_bitmap_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	bitmap_t inode_bitmap = malloc(inode_bitmap_block_size * BLOCK_SIZE);
-	memset(inode_bitmap, 0, inode_bitmap_block_size * BLOCK_SIZE);
-	block_num += inode_bitmap_block_size;
-	// Data bitmap initialization
-	superblock->d_bitmap_blk = block_num;
-	size_t data_bitmap_byte_size = (MAX_DNUM + 7) / 8,
-		data_bitmap_block_size = (data_bitmap_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	bitmap_t data_bitmap = malloc(data_bitmap_block_size * BLOCK_SIZE);
-	memset(data_bitmap, 0, data_bitmap_block_size * BLOCK_SIZE);
-	block_num += data_bitmap_block_size;
-	// Inodes initialization
-	superblock->i_start_blk = block_num;
-	size_t inodes_byte_size = MAX_INUM * sizeof(struct inode),
-		inodes_block_size = (inodes_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	unsigned char *inodes = malloc(inodes_block_size * BLOCK_SIZE);
-	memset(inodes, 0, inodes_block_size * BLOCK_SIZE);
-	block_num += inodes_block_size;
-	// Data initialization
-	superblock->d_start_blk = block_num;
-	// Update data bitmap
-	for (unsigned int current_block_num = 0; current_block_num < block_num; current_block_num++) set_bitmap(data_bitmap, current_block_num);
-	// Initialize root directory
-	struct inode *rootdir_inode = (struct inode *)inodes;
-	set_bitmap(inode_bitmap, 0);
-	rootdir_inode->ino = 0;
-	rootdir_inode->link = 0;
-	rootdir_inode->size = 0/*BLOCK_SIZE*/;
-	rootdir_inode->type = DIRECTORY;
-	rootdir_inode->valid = TRUE;
-	rootdir_inode->vstat.st_atime = rootdir_inode->vstat.st_mtime = time(NULL);
-	// Write data to disk
-	if (bio_write_multi(0, superblock_block_size, superblock) != EXIT_SUCCESS) return EXIT_FAILURE;
-	if (bio_write_multi(superblock->i_bitmap_blk, inode_bitmap_block_size, inode_bitmap) != EXIT_SUCCESS) return EXIT_FAILURE;
-	if (bio_write_multi(superblock->d_bitmap_blk, data_bitmap_block_size, data_bitmap) != EXIT_SUCCESS) return EXIT_FAILURE;
-	if (bio_write_multi(superblock->i_start_blk, inodes_block_size, inodes) != EXIT_SUCCESS) return EXIT_FAILURE;
+	// The geometry comes from the disk_size, inodes and bytes_per_inode options and is checked before the
+	// disk file is created.
+	uint64_t disk_size = DEFAULT_DISK_SIZE;
+	if (options.disk_size && parse_size(options.disk_size, &disk_size) != EXIT_SUCCESS) {
+		fprintf(stderr, "rufs: cannot read disk_size=%s\n", options.disk_size);
+		return EXIT_FAILURE;
+	}
+	uint64_t inode_count = options.inodes ? options.inodes : options.bytes_per_inode ? disk_size / options.bytes_per_inode : 0;
+	struct superblock *superblock = calloc(1, BLOCK_SIZE);
+	if (!superblock) return EXIT_FAILURE;
+	if (layout_disk(superblock, disk_size / BLOCK_SIZE, inode_count) != EXIT_SUCCESS) {
+		fprintf(stderr, "rufs: cannot lay out %llu inodes on a disk of %llu bytes\n", (unsigned long long)inode_count, (unsigned long long)disk_size);
+		free(superblock);
+		return EXIT_FAILURE;
+	}
+	if (dev_init(diskfile_path, superblock->max_dnum * BLOCK_SIZE) != EXIT_SUCCESS) {
+		free(superblock);
+		return EXIT_FAILURE;
+	}
+	// The new disk file reads as zeroes, so only the blocks with something set in them are written: the
+	// superblock, the first inode bitmap block, the data bitmap blocks covering the metadata and the root
+	// directory's inode block. The rest of the metadata stays a hole in the file.
+	size_t data_bitmap_block_size = bitmap_block_size(superblock->d_start_blk);
+	bitmap_t inode_bitmap = calloc(1, BLOCK_SIZE),
+		data_bitmap = calloc(data_bitmap_block_size, BLOCK_SIZE);
+	unsigned char *inodes = calloc(1, BLOCK_SIZE);
+	int retstat = inode_bitmap && data_bitmap && inodes ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (retstat == EXIT_SUCCESS) {
+		set_bitmap(inode_bitmap, ROOT_INO);
+		for (size_t block_num = 0; block_num < superblock->d_start_blk; block_num++) set_bitmap(data_bitmap, block_num);
+		// Initialize root directory
+		struct inode *rootdir_inode = (struct inode *)inodes;
+		rootdir_inode->ino = ROOT_INO;
+		rootdir_inode->link = 0;
+		rootdir_inode->size = 0/*BLOCK_SIZE*/;
+		rootdir_inode->type = DIRECTORY;
+		rootdir_inode->valid = TRUE;
+		rootdir_inode->vstat.st_atime = rootdir_inode->vstat.st_mtime = time(NULL);
+	}
+	// Write data to disk, bypassing the buffer cache: the journal expects a durable file system to start from
+	if (retstat != EXIT_SUCCESS
+		|| bio_write_range(0, 1, superblock) != EXIT_SUCCESS
+		|| bio_write_range(superblock->i_bitmap_blk, 1, inode_bitmap) != EXIT_SUCCESS
+		|| bio_write_range(superblock->d_bitmap_blk, data_bitmap_block_size, data_bitmap) != EXIT_SUCCESS
+		|| bio_write_range(superblock->i_start_blk, 1, inodes) != EXIT_SUCCESS
+		|| journal_format(superblock->j_start_blk, superblock->j_block_count) != EXIT_SUCCESS) retstat = EXIT_FAILURE;
 	free(superblock);
 	free(inode_bitmap);
 	free(data_bitmap);
 	free(inodes);
 	//debug("rufs_mkfs(): EXIT\n");
-	return EXIT_SUCCESS;
+	return retstat;
 }
 
-/* 
- * FUSE file operations
+// Releases the tables with an entry per inode; the superblock, which gives their size, is still resident.
+// Status: COMPLETE
+void free_per_inode_tables() {
+	free_table(extent_generation, superblock->max_inum * sizeof(uint32_t));
+	free_table(inode_commit_id, superblock->max_inum * sizeof(uint64_t));
+	free_table(inode_datasync_id, superblock->max_inum * sizeof(uint64_t));
+	free_table(inode_refs, superblock->max_inum * sizeof(struct inode_refs));
+	extent_generation = NULL;
+	inode_commit_id = inode_datasync_id = NULL;
+	inode_refs = NULL;
+	destroy_inode_locks(superblock->max_inum);
+	free_inode_table();
+}
+
+/*
+ * inode-level operations shared by the high-level (rufs.c) and low-level (rufs_ll.c) FUSE front ends
  */
 
+// Mounts the disk file, formatting it first if it does not exist yet.
 // Status: COMPLETE
-static void *rufs_init(struct fuse_conn_info *conn) {
+int rufs_mount() {
 	// Step 1a: If disk file is not found, call mkfs
 	// Step 1b: If disk file is found, just initialize in-memory data structures
 	// and read superblock from disk
-	//debug("rufs_init(): ENTER\n");
+	//debug("rufs_mount(): ENTER\n");
 	boolean init = FALSE;
 	pthread_mutex_lock(&mutex);
 	if (access(diskfile_path, F_OK) != 0) {
 		if (rufs_mkfs() != EXIT_SUCCESS) {
 			dev_close();
 			pthread_mutex_unlock(&mutex);
-			return NULL;
+			return -1;
 		}
 		init = TRUE;
 	} else if (dev_open(diskfile_path) == -1) {
 		pthread_mutex_unlock(&mutex);
-		return NULL;
+		return -1;
+	}
+	// Without io_uring in the kernel, the disk stays on preadv()/pwritev().
+	if (options.uring_depth > 0) dev_use_uring(options.uring_depth);
+	// A mapped disk is cached by the kernel's page cache; the buffer cache is not set up, so that every block
+	// access goes straight to the mapping and bio_map() pointers never miss a newer cached copy.
+	boolean mapped = options.mmap == TRUE && dev_use_mmap() == EXIT_SUCCESS;
+	if (mapped == FALSE && bcache_init((size_t)options.cache_size * 1024 * 1024) != EXIT_SUCCESS) {
+		dev_close();
+		pthread_mutex_unlock(&mutex);
+		return -1;
 	}
 	if (!(superblock = get_superblock())) {
-		dev_close(diskfile_path);
+		bcache_destroy();
+		dev_close();
 		pthread_mutex_unlock(&mutex);
-		return NULL;
+		return -1;
+	}
+	if (superblock->magic_num != MAGIC_NUM || superblock->version != RUFS_VERSION) {
+		if (superblock->magic_num != MAGIC_NUM) fprintf(stderr, "rufs: %s is not a RUFS disk of this version (magic 0x%x)\n", diskfile_path, superblock->magic_num);
+		else fprintf(stderr, "rufs: %s has layout version %u; this RUFS reads version %u\n", diskfile_path, superblock->version, RUFS_VERSION);
+		free(superblock);
+		superblock = NULL;
+		bcache_destroy();
+		dev_close();
+		pthread_mutex_unlock(&mutex);
+		return -1;
+	}
+	// The journal is replayed first, so that the tables below are loaded in their last committed state.
+	if (journal_init(superblock->j_start_blk, superblock->j_block_count, options.journal_commit) != EXIT_SUCCESS) {
+		fprintf(stderr, "rufs: cannot recover the journal of %s\n", diskfile_path);
+		free(superblock);
+		superblock = NULL;
+		bcache_destroy();
+		dev_close();
+		pthread_mutex_unlock(&mutex);
+		return -1;
+	}
+	extent_generation = alloc_table(superblock->max_inum * sizeof(uint32_t));
+	inode_commit_id = alloc_table(superblock->max_inum * sizeof(uint64_t));
+	inode_datasync_id = alloc_table(superblock->max_inum * sizeof(uint64_t));
+	inode_refs = alloc_table(superblock->max_inum * sizeof(struct inode_refs));
+	if (load_superblock() != EXIT_SUCCESS || !extent_generation || !inode_commit_id || !inode_datasync_id || !inode_refs || init_inode_locks(superblock->max_inum) != EXIT_SUCCESS || load_inode_table() != EXIT_SUCCESS || load_bitmaps() != EXIT_SUCCESS || dcache_init(options.dcache_entries) != EXIT_SUCCESS) {
+		journal_shutdown();
+		free_per_inode_tables();
+		free_bitmaps();
+		free(superblock);
+		superblock = NULL;
+		bcache_destroy();
+		dev_close();
+		pthread_mutex_unlock(&mutex);
+		return -1;
 	}
 	if (init == TRUE) {
 		struct inode *rootdir_inode = malloc(sizeof(struct inode));
 		memset(rootdir_inode, 0, sizeof(struct inode));
+		journal_start();
 		readi(ROOT_INO, rootdir_inode);
 		dir_add(*rootdir_inode, 0, ".", 1);
+		// dir_add updates the inode on disk; reload it so ".." lands in the same block as "."
+		readi(ROOT_INO, rootdir_inode);
 		dir_add(*rootdir_inode, 0, "..", 2);
-		writei(ROOT_INO, rootdir_inode);
+		journal_stop();
 		free(rootdir_inode);
 	}
-	pthread_mutex_unlock(&mutex);
-	//debug("rufs_init(): EXIT\n");
+	readahead_init((size_t)options.readahead_kb * 1024 / BLOCK_SIZE, readahead_file);
+	// Without memory for the table, writes allocate their blocks right away.
+	delalloc_init((size_t)options.delalloc_kb * 1024);
+	// Also picks up where the last mount left the orphan list.
+	reclaim_init(reclaim_orphan);
+	pthread_mutex_unlock(&mutex);
+	//debug("rufs_mount(): EXIT\n");
+	return EXIT_SUCCESS;
+}
+
+// Writes everything back and releases all in-memory state.
+// Status: COMPLETE
+void rufs_unmount() {
+	// Step 1: De-allocate in-memory data structures
+	// Step 2: Close diskfile
+	if (BENCHMARK) printf("TOTAL INODE BLOCKS ALLOCATED: %llu\nTOTAL DATA BLOCKS ALLOCATED: %llu\n", TOTAL_INODE_BLOCKS, TOTAL_DATA_BLOCKS);
+	//debug("rufs_unmount(): ENTER\n");
+	pthread_mutex_lock(&mutex);
+	reclaim_shutdown();
+	readahead_shutdown();
+	if (superblock) {
+		// File data first, then the metadata: lazily written access times go out with a last transaction.
+		rufs_sync();
+		journal_start();
+		journal_inode_table();
+		journal_stop();
+		journal_shutdown();
+	}
+	if (BENCHMARK || options.stats) {
+		struct bcache_stats stats;
+		bcache_get_stats(&stats);
+		printf("BUFFER CACHE: %llu HITS, %llu MISSES, %llu EVICTIONS, %llu WRITEBACKS\n", stats.hits, stats.misses, stats.evictions, stats.writebacks);
+		struct readahead_stats rstats;
+		readahead_get_stats(&rstats);
+		printf("READAHEAD: %llu WINDOWS, %llu BLOCKS, %llu DROPPED, %llu RESETS; %llu PREFETCHED, %llu USED, %llu EVICTED UNUSED\n", rstats.windows, rstats.blocks, rstats.dropped, rstats.resets, stats.prefetched, stats.prefetch_hits, stats.prefetch_unused);
+		struct dcache_stats dstats;
+		dcache_get_stats(&dstats);
+		printf("DENTRY CACHE: %llu HITS, %llu NEGATIVE HITS, %llu MISSES\n", dstats.hits, dstats.negative_hits, dstats.misses);
+		struct journal_stats jstats;
+		journal_get_stats(&jstats);
+		struct reclaim_stats cstats;
+		reclaim_get_stats(&cstats);
+		struct delalloc_stats astats;
+		delalloc_get_stats(&astats);
+		printf("DELALLOC: %llu BLOCKS, %llu WRITTEN, %llu DROPPED, %llu OVER BUDGET\n", astats.blocks, astats.written, astats.dropped, astats.pressure);
+		printf("RECLAIM: %llu STEPS, %llu BLOCKS, %llu INODES, %llu WAITS\n", cstats.steps, cstats.blocks, cstats.inodes, cstats.waits);
+		printf("JOURNAL: %llu HANDLES, %llu COMMITS, %llu BLOCKS LOGGED, %llu CHECKPOINTS, %llu REPLAYED\n", jstats.handles, jstats.commits, jstats.blocks_logged, jstats.checkpoints, jstats.replayed);
+		if (uring_enabled()) {
+			struct uring_stats ustats;
+			uring_get_stats(&ustats);
+			printf("IO_URING: %llu OPS, %llu ENTERS, %llu RINGS\n", ustats.ops, ustats.enters, ustats.rings);
+		}
+	}
+	bcache_destroy();
+	dcache_destroy();
+	delalloc_destroy();
+	// The directory indexes are found through the inode bitmap, so they go first.
+	if (superblock) {
+		free_dir_indexes();
+		free_per_inode_tables();
+	}
+	free_bitmaps();
+	free(superblock);
+	superblock = NULL;
+	dev_close();
+	pthread_mutex_unlock(&mutex);
+	//debug("rufs_unmount(): EXIT\n");
+}
+
+// Allocates the fuse_file_info->fh state for an open regular file, which keeps the file from being reclaimed
+// until close_handle() even if it is removed meanwhile. The caller holds the file's lock or its directory's.
+// Returns 0 or a negative errno value.
+// Status: COMPLETE
+int open_handle(struct inode *inode, int flags, struct rufs_handle **out_handle) {
+	struct rufs_handle *handle = malloc(sizeof(struct rufs_handle));
+	if (!handle) return -ENOMEM;
+	handle->ino = inode->ino;
+	handle->generation = inode->generation;
+	handle->flags = flags;
+	handle->map_generation = extent_generation[inode->ino];
+	handle->dirty = FALSE;
+	memset(&handle->readahead, 0, sizeof(struct readahead_state));
+	memset(&handle->map_hint, 0, sizeof(struct extent));
+	pthread_mutex_init(&handle->hint_mutex, NULL);
+	get_inode_refs(inode->ino, 0, 1);
+	*out_handle = handle;
+	return 0;
+}
+
+// Releases a handle from open_handle(); handle may be NULL.
+// Status: COMPLETE
+void close_handle(struct rufs_handle *handle) {
+	if (!handle) return;
+	put_inode_refs(handle->ino, 0, 1);
+	pthread_mutex_destroy(&handle->hint_mutex);
+	free(handle);
+}
+
+// Locks the inode behind an open handle (exclusively if exclusive is TRUE) and reads it; it must still be the
+// regular file that was opened. Returns 0 with the lock held, or -ENOENT.
+// Status: COMPLETE
+int lock_handle_inode(struct rufs_handle *handle, boolean exclusive, struct inode *inode) {
+	lock_inode(handle->ino, exclusive);
+	if (readi(handle->ino, inode) != EXIT_SUCCESS || inode->valid == FALSE || inode->type != FILE || inode->generation != handle->generation) {
+		unlock_inode(handle->ino);
+		return -ENOENT;
+	}
+	return 0;
+}
+
+// Writes back the data written through handle since its last flush, so that it survives the FUSE process
+// (it is durable only after fsync()). Delayed blocks of the file get their disk blocks here, which takes the
+// file's lock exclusively and a journal handle. Called when a descriptor of the file is closed. Returns 0,
+// -ENOSPC or -EIO.
+// Status: COMPLETE
+int flush_handle(struct rufs_handle *handle) {
+	struct inode inode;
+	// A removed file is gone after a crash anyway; its data stays in memory until the reclaimer drops it.
+	if (!handle || inode_orphaned(handle->ino) == TRUE) return 0;
+	boolean delayed = delalloc_count(handle->ino) > 0 ? TRUE : FALSE;
+	if (delayed == TRUE) journal_start();
+	if (lock_handle_inode(handle, delayed, &inode) != 0) {
+		if (delayed == TRUE) journal_stop();
+		return 0;
+	}
+	pthread_mutex_lock(&handle->hint_mutex);
+	int dirty = handle->dirty;
+	handle->dirty = FALSE;
+	pthread_mutex_unlock(&handle->hint_mutex);
+	int retstat = delayed == TRUE && flush_delayed(&inode) != EXIT_SUCCESS ? -ENOSPC : 0;
+	if (retstat == 0 && dirty == TRUE && writeback_file(&inode) != EXIT_SUCCESS) retstat = -EIO;
+	if (retstat != 0) {
+		pthread_mutex_lock(&handle->hint_mutex);
+		handle->dirty = TRUE;
+		pthread_mutex_unlock(&handle->hint_mutex);
+	}
+	unlock_inode(inode.ino);
+	if (delayed == TRUE) journal_stop();
+	return retstat;
+}
+
+// Writes back a file's cached data and commits it: its inode too, unless datasync is TRUE and only its
+// timestamps changed. Returns 0 or a negative errno value.
+// Status: COMPLETE
+int sync_handle(struct rufs_handle *handle, boolean datasync) {
+	struct inode inode;
+	if (!handle) return -EBADF;
+	if (inode_orphaned(handle->ino) == TRUE) return 0;
+	// As in flush_handle(), delayed blocks are placed first.
+	boolean delayed = delalloc_count(handle->ino) > 0 ? TRUE : FALSE;
+	if (delayed == TRUE) journal_start();
+	int retstat = lock_handle_inode(handle, delayed, &inode);
+	if (retstat == 0) {
+		if (delayed == TRUE && flush_delayed(&inode) != EXIT_SUCCESS) retstat = -ENOSPC;
+		if (retstat == 0 && writeback_file(&inode) != EXIT_SUCCESS) retstat = -EIO;
+		unlock_inode(inode.ino);
+	}
+	if (delayed == TRUE) journal_stop();
+	return retstat == 0 ? commit_inode(handle->ino, datasync) : retstat;
+}
+
+// Fills stbuf from an inode.
+// Status: COMPLETE
+void fill_stat(struct inode *inode, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = inode->ino;
+	stbuf->st_mode = inode->type == DIRECTORY ? DIRECTORY_MODE : FILE_MODE;
+	stbuf->st_nlink = inode->link;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_size = inode->size;
+	stbuf->st_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	stbuf->st_atime = inode->vstat.st_atime;
+	stbuf->st_mtime = inode->vstat.st_mtime;
+}
+
+// Creates name (a FILE or a DIRECTORY) in the directory dir_inode and returns its inode in out_inode.
+// Returns 0 or a negative errno value. The caller holds dir_inode exclusively.
+// Status: COMPLETE
+int make_node(struct inode *dir_inode, const char *name, int type, struct inode *out_inode) {
+	// Step 1: Call get_avail_ino() to get an available inode number
+	// Step 2: Call dir_add() to add directory entry of target to parent directory
+	// Step 3: Update inode for target and call writei() to write it to disk
+	if (dir_inode->type != DIRECTORY) return -ENOTDIR;
+	if (strlen(name) >= sizeof(((struct dirent *)0)->name)) return -ENAMETOOLONG;
+	int base_ino;
+	if ((base_ino = get_avail_ino()) == -1) return -ENOSPC;
+	// Once linked the new node can be found by name, so keep it locked until it is fully initialized.
+	lock_inode(base_ino, TRUE);
+	if (dir_add(*dir_inode, base_ino, name, strlen(name)) == -1) {
+		unlock_inode(base_ino);
+		release_ino(base_ino);
+		return dir_find(dir_inode->ino, name, strlen(name), &(struct dirent){0}) == EXIT_SUCCESS ? -EEXIST : -ENOSPC;
+	}
+	// A new generation tells the node apart from earlier ones with the same number (see lock_handle_inode()).
+	readi(base_ino, out_inode);
+	uint32_t generation = out_inode->generation + 1;
+	memset(out_inode, 0, sizeof(struct inode));
+	out_inode->ino = base_ino;
+	out_inode->generation = generation;
+	out_inode->link = type == FILE ? 1 : 0;
+	out_inode->size = 0;
+	out_inode->type = type;
+	out_inode->valid = TRUE;
+	out_inode->vstat.st_atime = out_inode->vstat.st_mtime = time(NULL);
+	writei(base_ino, out_inode);
+	if (type == DIRECTORY) {
+		dir_add(*out_inode, base_ino, ".", 1);
+		readi(base_ino, out_inode);
+		dir_add(*out_inode, dir_inode->ino, "..", 2);
+		readi(base_ino, out_inode);
+	}
+	unlock_inode(base_ino);
+	return 0;
+}
+
+// Calls visit for every valid entry of a directory whose position is at least offset; positions count
+// dirent slots from the start of the directory. Stops early when visit returns non-zero.
+// Returns 0 or a negative errno value. The caller holds the directory's lock.
+// Status: COMPLETE
+int list_dir(struct inode *inode, off_t offset, int (*visit)(void *ctx, struct dirent *dirent, off_t next_offset), void *ctx) {
+	if (inode->type != DIRECTORY) return -ENOTDIR;
+	struct dirent *base = malloc(BLOCK_SIZE);
+	if (!base) return -ENOMEM;
+	size_t inode_block_size = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE,
+		block_dirent_size = BLOCK_SIZE / sizeof(struct dirent);
+	for (unsigned int i = offset / block_dirent_size; i < inode_block_size; i++) {
+		uint32_t block_num = get_block_num(inode, i);
+		if (block_num == 0 || journal_read(block_num, base) != EXIT_SUCCESS) {
+			free(base);
+			return -EIO;
+		}
+		for (unsigned int j = 0; j < block_dirent_size; j++) {
+			off_t position = (off_t)i * block_dirent_size + j;
+			if (position < offset || base[j].valid == FALSE) continue;
+			if (visit(ctx, &base[j], position + 1) != 0) {
+				free(base);
+				return 0;
+			}
+		}
+	}
+	free(base);
+	return 0;
+}
+
+// Reads up to size bytes at offset from a file, mapping blocks through handle (which may be NULL).
+// Returns the number of bytes read or a negative errno value. The caller holds the file's lock, at least shared.
+// Status: COMPLETE
+int read_file(struct inode *inode, struct rufs_handle *handle, char *buffer, size_t size, off_t offset) {
+	// Step 1: Based on size and offset, read its data blocks from disk
+	// Step 2: copy the correct amount of data from offset to buffer
+	// Whole blocks are read straight into buffer and only a partial first/last block goes through
+	// block_buffer; all of them are submitted together with bio_readv(). Holes read as zeroes.
+	if (inode->type != FILE) return -EISDIR;
+	if (size == 0 || offset >= inode->size) return 0;
+	char *block_buffer = malloc(2 * BLOCK_SIZE);
+	if (!block_buffer) return -ENOMEM;
+	if (inode->size - offset < size) size = inode->size - offset;
+	int starting_block_index = offset / BLOCK_SIZE;
+	int ending_block_index = (offset + size - 1) / BLOCK_SIZE;
+	int block_count = ending_block_index - starting_block_index + 1;
+	unsigned int *block_nums = malloc(block_count * sizeof(unsigned int));
+	void **bufs = malloc(block_count * sizeof(void *));
+	if (!block_nums || !bufs || get_block_map(inode, handle, starting_block_index, block_count, block_nums) != EXIT_SUCCESS) {
+		free(block_buffer);
+		free(block_nums);
+		free(bufs);
+		return -EIO;
+	}
+	int bytes_left = size,
+		bytes_read = 0,
+		block_offset = offset % BLOCK_SIZE,
+		submit_count = 0;
+	boolean head_staged = FALSE,
+		tail_staged = FALSE,
+		delayed = delalloc_count(inode->ino) > 0 ? TRUE : FALSE;
+	for (int k = 0; k < block_count; k++) {
+		int bytes_to_read = min(bytes_left, BLOCK_SIZE - block_offset);
+		bytes_left -= bytes_to_read;
+		char *mapped = block_nums[k] != 0 ? bio_map(block_nums[k]) : NULL;
+		// A hole may have data written into it that has no disk block yet.
+		if (block_nums[k] == 0 && delayed == TRUE && (mapped = delalloc_lookup(inode->ino, starting_block_index + k))) {
+			memcpy(buffer + bytes_read, mapped + block_offset, bytes_to_read);
+		} else if (block_nums[k] == 0) {
+			memset(buffer + bytes_read, 0, bytes_to_read);
+		} else if (mapped) {
+			// The disk is mapped (and then uncached): copy straight out of the mapping.
+			memcpy(buffer + bytes_read, mapped + block_offset, bytes_to_read);
+		} else if (bytes_to_read == BLOCK_SIZE) {
+			block_nums[submit_count] = block_nums[k];
+			bufs[submit_count++] = buffer + bytes_read;
+		} else {
+			// Partial first or last block: read it whole into block_buffer and copy the slice out afterwards.
+			block_nums[submit_count] = block_nums[k];
+			if (k == 0) {
+				bufs[submit_count++] = block_buffer;
+				head_staged = TRUE;
+			} else {
+				bufs[submit_count++] = block_buffer + BLOCK_SIZE;
+				tail_staged = TRUE;
+			}
+		}
+		bytes_read += bytes_to_read;
+		block_offset = 0;
+	}
+	int retstat = bio_readv(block_nums, submit_count, bufs);
+	if (retstat == EXIT_SUCCESS && handle) {
+		pthread_mutex_lock(&handle->hint_mutex);
+		readahead_update(&handle->readahead, inode->ino, starting_block_index, ending_block_index, ((uint64_t)inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		pthread_mutex_unlock(&handle->hint_mutex);
+	}
+	if (retstat == EXIT_SUCCESS && head_staged == TRUE) memcpy(buffer, block_buffer + offset % BLOCK_SIZE, min(size, BLOCK_SIZE - offset % BLOCK_SIZE));
+	if (retstat == EXIT_SUCCESS && tail_staged == TRUE) memcpy(buffer + size - (offset + size) % BLOCK_SIZE, block_buffer + BLOCK_SIZE, (offset + size) % BLOCK_SIZE);
+	free(block_buffer);
+	free(block_nums);
+	free(bufs);
+	return retstat == EXIT_SUCCESS ? bytes_read : -EIO;
+}
+
+// Writes size bytes at offset into blocks of a file that are all mapped already, with one bio_writev().
+// Whole blocks go straight from buffer; only a partial first or last block is merged in block_buffer, after
+// reading its old contents, unless it is fresh (just allocated), in which case the rest of it is zeroed.
+// Returns size or -EIO.
+static int write_mapped(struct inode *inode, struct rufs_handle *handle, const char *buffer, size_t size, off_t offset, boolean head_fresh, boolean tail_fresh) {
+	int starting_block_index = offset / BLOCK_SIZE;
+	int block_count = (offset + size - 1) / BLOCK_SIZE - starting_block_index + 1;
+	size_t head_offset = offset % BLOCK_SIZE,
+		tail_bytes = (offset + size) % BLOCK_SIZE;
+	// The partial first and last blocks; a single block can be both.
+	boolean head_partial = head_offset != 0 || (block_count == 1 && tail_bytes != 0),
+		tail_partial = block_count > 1 && tail_bytes != 0;
+	unsigned int *block_nums = malloc(block_count * sizeof(unsigned int));
+	void **bufs = malloc(block_count * sizeof(void *));
+	char *block_buffer = malloc(2 * BLOCK_SIZE);
+	int retstat = block_nums && bufs && block_buffer ? get_block_map(inode, handle, starting_block_index, block_count, block_nums) : -1;
+	if (retstat == EXIT_SUCCESS) {
+		unsigned int read_nums[2];
+		void *read_bufs[2];
+		unsigned int read_count = 0;
+		if (head_partial == TRUE) {
+			if (head_fresh == TRUE) memset(block_buffer, 0, BLOCK_SIZE);
+			else {
+				read_nums[read_count] = block_nums[0];
+				read_bufs[read_count++] = block_buffer;
+			}
+		}
+		if (tail_partial == TRUE) {
+			if (tail_fresh == TRUE) memset(block_buffer + BLOCK_SIZE, 0, BLOCK_SIZE);
+			else {
+				read_nums[read_count] = block_nums[block_count - 1];
+				read_bufs[read_count++] = block_buffer + BLOCK_SIZE;
+			}
+		}
+		if (read_count > 0) retstat = bio_readv(read_nums, read_count, read_bufs);
+	}
+	if (retstat == EXIT_SUCCESS) {
+		for (int k = 0; k < block_count; k++) bufs[k] = (char *)buffer - head_offset + (size_t)k * BLOCK_SIZE;
+		if (head_partial == TRUE) {
+			memcpy(block_buffer + head_offset, buffer, min(size, BLOCK_SIZE - head_offset));
+			bufs[0] = block_buffer;
+		}
+		if (tail_partial == TRUE) {
+			memcpy(block_buffer + BLOCK_SIZE, buffer + size - tail_bytes, tail_bytes);
+			bufs[block_count - 1] = block_buffer + BLOCK_SIZE;
+		}
+		retstat = bio_writev(block_nums, block_count, bufs);
+	}
+	free(block_nums);
+	free(bufs);
+	free(block_buffer);
+	return retstat == EXIT_SUCCESS ? (int)size : -EIO;
+}
+
+// Maps the holes among logical blocks [first, last] of a file to newly claimed blocks, in contiguous runs
+// placed right after the preceding data of the file. With zero, new blocks are zeroed (see bio_zero()) before
+// they are mapped. *head_fresh and *tail_fresh tell whether blocks first and last were among them. Returns
+// last, or the last block mapped (first - 1 if none) when the disk fills up or an error occurs.
+static int allocate_range(struct inode *inode, struct rufs_handle *handle, int first, int last, boolean zero, boolean *head_fresh, boolean *tail_fresh) {
+	uint32_t goal = first > 0 ? get_block_num(inode, first - 1) : 0;
+	if (goal != 0) goal++;
+	for (int i = first; i <= last;) {
+		uint32_t physical, run;
+		if (map_lookup(inode, handle, i, &physical, &run) != EXIT_SUCCESS) return i - 1;
+		if (physical != 0) {
+			// Already mapped: skip the whole extent.
+			i += run;
+			goal = physical + run;
+			continue;
+		}
+		unsigned int want = run < (uint32_t)(last - i + 1) ? run : (uint32_t)(last - i + 1),
+			got;
+		int blkno = get_avail_blkno_run(goal, want, FALSE, &got);
+		// Out of space: stop at the blocks that are already mapped.
+		if (blkno == -1) return i - 1;
+		if ((zero == TRUE && bio_zero(blkno, got) != EXIT_SUCCESS) || extent_insert(inode, i, blkno, got) != EXIT_SUCCESS) {
+			release_block_ranges(&(struct block_range){ blkno, got }, 1);
+			return i - 1;
+		}
+		if (i == first) *head_fresh = TRUE;
+		if (i + (int)got > last) *tail_fresh = TRUE;
+		i += got;
+		goal = blkno + got;
+	}
+	return last;
+}
+
+// Copies size bytes at offset into delayed blocks of a file (see delalloc.c), where the file has holes. Each new
+// delayed block reserves a disk block, so that running out of space is still reported by write(). Returns the
+// number of bytes copied, or -ENOSPC or -ENOMEM if that is none. The caller holds the file's lock exclusively.
+static int write_delayed(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+	size_t done = 0;
+	while (done < size) {
+		uint32_t logical = (offset + done) / BLOCK_SIZE;
+		size_t block_offset = (offset + done) % BLOCK_SIZE,
+			bytes = min(size - done, BLOCK_SIZE - block_offset);
+		char *data = delalloc_lookup(inode->ino, logical);
+		if (!data) {
+			if (reserve_blocks(1) != EXIT_SUCCESS) return done > 0 ? (int)done : -ENOSPC;
+			if (!(data = delalloc_insert(inode->ino, logical))) {
+				unreserve_blocks(1);
+				return done > 0 ? (int)done : -ENOMEM;
+			}
+		}
+		memcpy(data + block_offset, buffer + done, bytes);
+		done += bytes;
+	}
+	return size;
+}
+
+// Writes size bytes at offset into a file, allocating blocks as needed (or delaying that, see write_delayed()),
+// and updates the inode (also in the caller's copy). Blocks are mapped through handle, which may be NULL.
+// Returns the number of bytes written or a negative errno value. The caller holds the file's lock exclusively
+// and a journal handle.
+// Status: COMPLETE
+int write_file(struct inode *inode, struct rufs_handle *handle, const char *buffer, size_t size, off_t offset) {
+	// Step 1: Based on size and offset, read its data blocks from disk
+	// Step 2: Write the correct amount of data from offset to disk
+	// Step 3: Update the inode info and write it to disk
+	// Note: this function should return the amount of bytes you write to disk
+	if (inode->type != FILE) return -EISDIR;
+	if (size == 0) return 0;
+	if ((uint64_t)(offset + size) > MAX_FILE_SIZE) return -EFBIG;
+    int starting_block_index = offset / BLOCK_SIZE;
+    int ending_block_index = (offset + size - 1) / BLOCK_SIZE;
+	int bytes_written = -ENOSPC;
+	if (delalloc_enabled()) {
+		// Mapped blocks are overwritten in place; holes take the data in delayed blocks, which get disk blocks
+		// together when the file is flushed (see flush_delayed()) or the budget for them is exceeded.
+		bytes_written = 0;
+		for (int i = starting_block_index; i <= ending_block_index;) {
+			uint32_t physical, run;
+			if (map_lookup(inode, handle, i, &physical, &run) != EXIT_SUCCESS) {
+				if (bytes_written == 0) bytes_written = -EIO;
+				break;
+			}
+			int count = run > 0 && run < (uint32_t)(ending_block_index - i + 1) ? run : ending_block_index - i + 1;
+			off_t start = (off_t)i * BLOCK_SIZE > offset ? (off_t)i * BLOCK_SIZE : offset,
+				end = (off_t)(i + count) * BLOCK_SIZE < offset + (off_t)size ? (off_t)(i + count) * BLOCK_SIZE : offset + (off_t)size;
+			int written = physical != 0 ? write_mapped(inode, handle, buffer + (start - offset), end - start, start, FALSE, FALSE)
+				: write_delayed(inode, buffer + (start - offset), end - start, start);
+			if (written < 0 && bytes_written == 0) bytes_written = written;
+			if (written < 0) break;
+			bytes_written += written;
+			if (written < end - start) break;
+			i += count;
+		}
+		// A failure leaves the blocks delayed, still reserved, for the next flush.
+		if (delalloc_over_budget()) flush_delayed(inode);
+	} else {
+		// Whether the partial first/last block was allocated here: its old contents are then not worth reading.
+		boolean head_fresh = FALSE,
+			tail_fresh = FALSE;
+		ending_block_index = allocate_range(inode, handle, starting_block_index, ending_block_index, FALSE, &head_fresh, &tail_fresh);
+		if (ending_block_index >= starting_block_index) {
+			bytes_written = min(size, (size_t)(ending_block_index - starting_block_index + 1) * BLOCK_SIZE - offset % BLOCK_SIZE);
+			bytes_written = write_mapped(inode, handle, buffer, bytes_written, offset, head_fresh, tail_fresh);
+		}
+	}
+	// One inode update covers the new mapping, the size and the modification time.
+	if (bytes_written > 0 && offset + bytes_written > inode->size) inode->size = offset + bytes_written;
+	if (bytes_written > 0 && handle) {
+		pthread_mutex_lock(&handle->hint_mutex);
+		handle->dirty = TRUE;
+		pthread_mutex_unlock(&handle->hint_mutex);
+	}
+	if (bytes_written > 0) time(&inode->vstat.st_mtime);
+	writei(inode->ino, inode);
+    return bytes_written;
+}
+
+// Sets the size of a file. Shrinking frees every block past the new end (see extent_truncate()) and zeroes
+// the rest of the new last block, so that the bytes past the end read as zeroes if the file grows again;
+// growing leaves a hole. Returns 0 or a negative errno value. The caller holds the file's lock exclusively.
+// Status: COMPLETE
+int truncate_file(struct inode *inode, off_t size) {
+	if (inode->type != FILE) return -EISDIR;
+	if (size < 0) return -EINVAL;
+	if ((uint64_t)size > MAX_FILE_SIZE) return -EFBIG;
+	if (size < inode->size) {
+		uint32_t block_num = size % BLOCK_SIZE ? get_block_num(inode, size / BLOCK_SIZE) : 0;
+		char *delayed = size % BLOCK_SIZE && block_num == 0 ? delalloc_lookup(inode->ino, size / BLOCK_SIZE) : NULL;
+		if (delayed) memset(delayed + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+		if (block_num != 0) {
+			char *block_buffer = malloc(BLOCK_SIZE);
+			int retstat = block_buffer ? bio_read_multi(block_num, 1, block_buffer) : -1;
+			if (retstat == EXIT_SUCCESS) {
+				memset(block_buffer + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+				retstat = bio_write_multi(block_num, 1, block_buffer);
+			}
+			free(block_buffer);
+			if (retstat != EXIT_SUCCESS) return -EIO;
+		}
+		drop_delayed(inode->ino, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		if (extent_truncate(inode, (size + BLOCK_SIZE - 1) / BLOCK_SIZE, NULL) != EXIT_SUCCESS) return -EIO;
+	}
+	inode->size = size;
+	time(&inode->vstat.st_mtime);
+	writei(inode->ino, inode);
+	return 0;
+}
+
+// Preallocates the bytes [offset, offset + length) of a file: the holes among them get zeroed blocks (see
+// bio_zero()), so no data is written; delayed blocks are placed first, so that none is left in a block mapped
+// here. Unless mode has FALLOC_FL_KEEP_SIZE, the file grows to cover the range. Returns 0 or a negative errno
+// value. The caller holds the file's lock exclusively and a journal handle.
+// Status: COMPLETE
+int fallocate_file(struct inode *inode, struct rufs_handle *handle, int mode, off_t offset, off_t length) {
+	if (inode->type != FILE) return -EISDIR;
+	if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0) return -EOPNOTSUPP;
+	if (offset < 0 || length <= 0) return -EINVAL;
+	if ((uint64_t)(offset + length) > MAX_FILE_SIZE) return -EFBIG;
+	if (flush_delayed(inode) != EXIT_SUCCESS) return -ENOSPC;
+	boolean head_fresh = FALSE,
+		tail_fresh = FALSE;
+	int first = offset / BLOCK_SIZE,
+		last = (offset + length - 1) / BLOCK_SIZE;
+	int retstat = allocate_range(inode, handle, first, last, TRUE, &head_fresh, &tail_fresh) == last ? 0 : -ENOSPC;
+	if (retstat == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > inode->size) {
+		inode->size = offset + length;
+		time(&inode->vstat.st_mtime);
+	}
+	writei(inode->ino, inode);
+	return retstat;
+}
+
+#ifndef RUFS_LOWLEVEL
+
+/*
+ * FUSE file operations
+ */
+
+// Status: COMPLETE
+static void *rufs_init(struct fuse_conn_info *conn) {
+	rufs_mount();
 	return NULL;
 }
 
 // Status: COMPLETE
 static void rufs_destroy(void *userdata) {
-	// Step 1: De-allocate in-memory data structures
-	// Step 2: Close diskfile 
-	if (BENCHMARK) printf("TOTAL INODE BLOCKS ALLOCATED: %llu\nTOTAL DATA BLOCKS ALLOCATED: %llu\n", TOTAL_INODE_BLOCKS, TOTAL_DATA_BLOCKS);
-	//debug("rufs_destroy(): ENTER\n");
-	pthread_mutex_lock(&mutex);
-	free(superblock);
-	dev_close(diskfile_path);
-	pthread_mutex_unlock(&mutex);
-	//debug("rufs_destroy(): EXIT\n");
+	rufs_unmount();
 }
 
 // Status: COMPLETE
@@ -672,23 +2318,15 @@ static int rufs_getattr(const char *path, struct stat *stbuf) {
 	//debug("rufs_getattr(): ENTER\n");
 	struct inode *inode = malloc(sizeof(struct inode));
 	if (!inode) return -ENOMEM;
-	pthread_mutex_lock(&mutex);
-	if (get_node_by_path(path, ROOT_INO, inode) != EXIT_SUCCESS) {
-		pthread_mutex_unlock(&mutex);
+	if (lock_node_by_path(path, ROOT_INO, FALSE, inode) != EXIT_SUCCESS) {
 		free(inode);
 		return -ENOENT;
 	}
-	memset(stbuf, 0, sizeof(struct stat));
-	stbuf->st_mode = inode->type == DIRECTORY ? DIRECTORY_MODE : FILE_MODE;
-	stbuf->st_nlink = inode->link;
-	stbuf->st_uid = getuid();
-	stbuf->st_gid = getgid();
-	stbuf->st_size = inode->size;
-	stbuf->st_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	stbuf->st_atime = inode->vstat.st_atime = time(NULL);
-	stbuf->st_mtime = inode->vstat.st_mtime;
-	writei(inode->ino, inode);
-	pthread_mutex_unlock(&mutex);
+	// Holders of the shared lock change nothing but the access time, so the copy written back is current.
+	inode->vstat.st_atime = time(NULL);
+	writei_lazy(inode->ino, inode);
+	fill_stat(inode, stbuf);
+	unlock_inode(inode->ino);
 	free(inode);
 	//debug("rufs_getattr(): EXIT\n");
 	return 0;
@@ -701,89 +2339,69 @@ static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
 	//debug("rufs_opendir(): ENTER\n");
 	struct inode *inode = malloc(sizeof(struct inode));
 	if (!inode) return -ENOMEM;
-	pthread_mutex_lock(&mutex);
 	if (get_node_by_path(path, ROOT_INO, inode) != EXIT_SUCCESS) {
-		pthread_mutex_unlock(&mutex);
 		free(inode);
 		return -1;
 	}
 	if (inode->type != DIRECTORY) {
-		pthread_mutex_unlock(&mutex);
 		free(inode);
 		return -ENOTDIR;
 	}
-	pthread_mutex_unlock(&mutex);
+	// Kept for rufs_readdir() and rufs_fsyncdir(), which FUSE calls without a path: the inode number, with the
+	// generation above it so that a directory removed and reused meanwhile is not mistaken for this one
+	fi->fh = (uint64_t)inode->generation << 32 | inode->ino;
 	free(inode);
 	//debug("rufs_opendir(): EXIT\n");
     return 0;
 }
 
+struct readdir_context {
+	void *buffer;
+	fuse_fill_dir_t filler;
+};
+
+// list_dir() visitor for rufs_readdir(); "." and ".." are supplied by FUSE.
+static int readdir_visit(void *ctx, struct dirent *dirent, off_t next_offset) {
+	struct readdir_context *context = ctx;
+	if (strcmp(dirent->name, ".") == 0 || strcmp(dirent->name, "..") == 0) return 0;
+	//debug("rufs_readdir(): CURRENT DIRENT IS \"%s\" WITH INO \"%d\"\n", dirent->name, dirent->ino);
+	context->filler(context->buffer, dirent->name, NULL, 0);
+	return 0;
+}
+
 // Status: COMPLETE
 static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: Call get_node_by_path() to get inode from path
+	// Step 1: Lock the directory rufs_opendir() kept in fi->fh (FUSE passes no path)
 	// Step 2: Read directory entries from its data blocks, and copy them to filler
 	//debug("rufs_readdir(): ENTER\n");
 	struct inode *inode = malloc(sizeof(struct inode));
 	if (!inode) return -ENOMEM;
-	void *base = malloc(BLOCK_SIZE);
-	if (!base) {
+	uint32_t ino = (uint32_t)fi->fh;
+	if (ino >= superblock->max_inum) {
 		free(inode);
-		return -ENOMEM;
+		return -ENOENT;
 	}
-	pthread_mutex_lock(&mutex);
-    if (get_node_by_path(path, ROOT_INO, inode) != EXIT_SUCCESS) {
-		pthread_mutex_unlock(&mutex);
-        free(inode);
-		free(base);
-        return -ENOENT;
-    }
-	if (inode->type != DIRECTORY) {
-		pthread_mutex_unlock(&mutex);
+	lock_inode(ino, FALSE);
+	if (readi(ino, inode) != EXIT_SUCCESS || inode->valid == FALSE || inode->type != DIRECTORY || inode->generation != (uint32_t)(fi->fh >> 32)) {
+		unlock_inode(ino);
 		free(inode);
-		free(base);
-		return -ENOTDIR;
+		return -ENOENT;
 	}
-	size_t inode_block_size = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE,
-		block_dirent_size = BLOCK_SIZE / sizeof(struct dirent),
-		size = inode->size;
-	for (unsigned int i = 0; i < inode_block_size; i++) {
-		int block_num = inode->direct_ptr[i];
-		if (bio_read_multi(block_num, 1, base) != EXIT_SUCCESS) {
-			pthread_mutex_unlock(&mutex);
-			free(inode);
-			free(base);
-			return -EIO;
-		}
-		for (unsigned int j = 0; j < block_dirent_size; j++) {
-			if (size < sizeof(struct dirent)) goto end;
-			struct dirent *current_dirent = (struct dirent *)(base + j * sizeof(struct dirent));
-			if (current_dirent->valid == TRUE && strcmp(current_dirent->name, ".") != 0 && strcmp(current_dirent->name, "..") != 0) {
-				filler(buffer, current_dirent->name, NULL, 0);
-				//debug("rufs_readdir(): CURRENT DIRENT IS \"%s\" WITH INO \"%d\"\n", current_dirent->name, current_dirent->ino);
-			}
-			size = size >= sizeof(struct dirent) ? size - sizeof(struct dirent) : 0;
-		}
+	struct readdir_context context = { buffer, filler };
+	int retstat = list_dir(inode, 0, readdir_visit, &context);
+	if (retstat == 0) {
+		time(&inode->vstat.st_atime);
+		writei_lazy(inode->ino, inode);
 	}
-	end:
-	time(&inode->vstat.st_atime);
-	writei(inode->ino, inode);
-	pthread_mutex_unlock(&mutex);
+	unlock_inode(inode->ino);
 	free(inode);
-	free(base);
 	//debug("rufs_readdir(): EXIT\n");
-	return 0;
+	return retstat;
 }
 
-// Status: COMPLETE
-static int rufs_mkdir(const char *path, mode_t mode) {
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	// Step 3: Call get_avail_ino() to get an available inode number
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	// Step 5: Update inode for target directory
-	// Step 6: Call writei() to write inode to disk
-	//debug("rufs_mkdir(): ENTER\n");
-	//debug("rufs_mkdir(): TARGET PATH IS \"%s\"\n", path);
+// Resolves the parent directory of path and the final component. Returns 0 or a negative errno value; on
+// success the parent is locked exclusively, and the caller unlocks it and frees *out_copy.
+static int resolve_parent(const char *path, struct inode *dir_inode, char **out_copy, char **out_base) {
 	char *path_dir = strdup(path);
 	if (!path_dir) return -ENOMEM;
 	char *path_base = strdup(path);
@@ -791,108 +2409,57 @@ static int rufs_mkdir(const char *path, mode_t mode) {
 		free(path_dir);
 		return -ENOMEM;
 	}
-	struct inode *dir_inode = malloc(sizeof(struct inode));
-	if (!dir_inode) {
-		free(path_dir);
-		free(path_base);
-		return -ENOMEM;
-	}
-	struct inode *base_inode = malloc(sizeof(struct inode));
-	if (!base_inode) {
-		free(path_dir);
-		free(path_base);
-		free(dir_inode);
-		return -ENOMEM;
-	}
-	char *dir_path = dirname(path_dir);
-	char *base = basename(path_base);
-	pthread_mutex_lock(&mutex);
-	if (get_node_by_path(dir_path, ROOT_INO, dir_inode) != EXIT_SUCCESS) {
-		pthread_mutex_unlock(&mutex);
-		free(path_dir);
+	int retstat = lock_node_by_path(dirname(path_dir), ROOT_INO, TRUE, dir_inode) == EXIT_SUCCESS ? 0 : -ENOENT;
+	free(path_dir);
+	if (retstat != 0) {
 		free(path_base);
-		free(dir_inode);
-		free(base_inode);
-		return -ENOENT;
+		return retstat;
 	}
-	int base_ino;
-	if ((base_ino = get_avail_ino()) == -1) {
-		pthread_mutex_unlock(&mutex);
-		free(path_dir);
-		free(path_base);
-		free(dir_inode);
-		free(base_inode);
-		return -ENOSPC;
-	}
-	if (dir_add(*dir_inode, base_ino, base, strlen(base)) == -1) {
-		bitmap_t inode_bitmap = get_inode_bitmap(superblock);
-		unset_bitmap(inode_bitmap, base_ino);
-		update_inode_bitmap(inode_bitmap, TRUE, superblock);
-		pthread_mutex_unlock(&mutex);
-		free(path_dir);
-		free(path_base);
-		free(dir_inode);
-		free(base_inode);
-		return -ENOSPC;
-	}
-	memset(base_inode, 0, sizeof(struct inode));
-	base_inode->ino = base_ino;
-	base_inode->link = 0;
-	base_inode->size = 0;
-	base_inode->type = DIRECTORY;
-	base_inode->valid = TRUE;
-	base_inode->vstat.st_atime = base_inode->vstat.st_mtime = time(NULL);
-	writei(base_ino, base_inode);
-	dir_add(*base_inode, base_ino, ".", 1);
-	dir_add(*base_inode, dir_inode->ino, "..", 2);
-	pthread_mutex_unlock(&mutex);
-	free(path_dir);
-	free(path_base);
-	free(dir_inode);
-	free(base_inode);
-	//debug("rufs_mkdir(): EXIT\n");
+	*out_copy = path_base;
+	*out_base = basename(path_base);
 	return 0;
 }
 
-//splits a path into the base path and the final destination ex: /bar/foo/baz -> base: /bar/foo, name -> baz
-/*void split_path_into_base_path_and_name(const char *path, char **base_path_out, char **name_out){
-	int ind_of_last_slash;
-	for(int curr_slash_ind = 0; curr_slash_ind != -1; curr_slash_ind = split_string(ind_of_last_slash, path)){
-		ind_of_last_slash = curr_slash_ind;
-	}
-	
-	int base_path_length_without_nullterm = ind_of_last_slash;
-	*base_path_out = malloc(sizeof(char) * (base_path_length_without_nullterm + 1));
-
-	strncpy(*base_path_out, path, base_path_length_without_nullterm);
-	(*base_path_out)[base_path_length_without_nullterm] = '\0';
-
-
-	int dir_name_length_without_nullterm = strlen(path) - ind_of_last_slash;
-	*name_out = malloc(sizeof(char) * (dir_name_length_without_nullterm + 1));
-
-	strncpy(*name_out, path + base_path_length_without_nullterm, dir_name_length_without_nullterm);
-	(*name_out)[dir_name_length_without_nullterm] = '\0';
-
-}*/
+// Status: COMPLETE
+static int rufs_mkdir(const char *path, mode_t mode) {
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	// Step 3: Call make_node() to allocate, link and initialize the target directory
+	//debug("rufs_mkdir(): ENTER\n");
+	//debug("rufs_mkdir(): TARGET PATH IS \"%s\"\n", path);
+	struct inode dir_inode,
+		base_inode;
+	char *path_copy,
+		*base;
+	int retstat,
+		retried = FALSE;
+	do {
+		journal_start();
+		retstat = resolve_parent(path, &dir_inode, &path_copy, &base);
+		if (retstat == 0) {
+			retstat = make_node(&dir_inode, base, DIRECTORY, &base_inode);
+			unlock_inode(dir_inode.ino);
+			free(path_copy);
+		}
+		journal_stop();
+		// Out of space with removed files still being reclaimed: wait for the reclaimer and try once more
+	} while (retstat == -ENOSPC && !retried && (retried = reclaim_wait()));
+	//debug("rufs_mkdir(): EXIT\n");
+	return retstat;
+}
 
 //removes file or directory, specified by file_to_remove_type
 static int remove_given_path(const char *path, int file_to_remove_type){
-	char *dir_copy = strdup(path);
-	if (!dir_copy) return EXIT_FAILURE; // not sure if correct success flag, correct as needed
-	char *base_copy = strdup(path);
-	if (!base_copy) {
-		free(dir_copy);
-		return -1; // same concern as above
-	}
-	char *dir_name = dirname(dir_copy);
-	char *base_name = basename(base_copy);
-	//split_path_into_base_path_and_name(path, &base_path, &remove_target_name);
 	struct inode base_dir_inode;
-	get_node_by_path(dir_name, ROOT_INO, &base_dir_inode);
-	int status = remove_from_dir(base_dir_inode, base_name, strlen(base_name), file_to_remove_type);
-	free(dir_copy);
-	free(base_copy);
+	char *path_copy, *base_name;
+	journal_start();
+	int status = resolve_parent(path, &base_dir_inode, &path_copy, &base_name);
+	if (status == 0) {
+		status = remove_from_dir(base_dir_inode, base_name, strlen(base_name), file_to_remove_type);
+		unlock_inode(base_dir_inode.ino);
+		free(path_copy);
+	}
+	journal_stop();
 	return status;
 }
 
@@ -904,13 +2471,7 @@ static int rufs_rmdir(const char *path) {
 	// Step 5: Call get_node_by_path() to get inode of parent directory
 	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
 
-	pthread_mutex_lock(&mutex);
-
-	int ret = remove_given_path(path, DIRECTORY);
-
-	pthread_mutex_unlock(&mutex);
-
-	return ret;
+	return remove_given_path(path, DIRECTORY);
 }
 
 static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
@@ -923,311 +2484,129 @@ static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
 static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
 	// Step 2: Call get_node_by_path() to get inode of parent directory
-	// Step 3: Call get_avail_ino() to get an available inode number
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	// Step 5: Update inode for target file
-	// Step 6: Call writei() to write inode to disk
+	// Step 3: Call make_node() to allocate, link and initialize the target file
+	// Step 4: Keep a handle for the new file in fi->fh
 	//debug("rufs_create(): ENTER\n");
 	//debug("rufs_create(): TARGET PATH IS \"%s\"\n", path);
-	char *path_dir = strdup(path);
-	if (!path_dir) return -ENOMEM;
-	char *path_base = strdup(path);
-	if (!path_base) {
-		free(path_dir);
-		return -ENOMEM;
-	}
-	struct inode *dir_inode = malloc(sizeof(struct inode));
-	if (!dir_inode) {
-		free(path_dir);
-		free(path_base);
-		return -ENOMEM;
-	}
-	struct inode *base_inode = malloc(sizeof(struct inode));
-	if (!base_inode) {
-		free(path_dir);
-		free(path_base);
-		free(dir_inode);
-		return -ENOMEM;
-	}
-	char *dir_path = dirname(path_dir);
-	char *base = basename(path_base);
-	pthread_mutex_lock(&mutex);
-	if (get_node_by_path(dir_path, ROOT_INO, dir_inode) != EXIT_SUCCESS) {
-		pthread_mutex_unlock(&mutex);
-		free(path_dir);
-		free(path_base);
-		free(dir_inode);
-		free(base_inode);
-		return -ENOENT;
-	}
-	int base_ino;
-	if ((base_ino = get_avail_ino()) == -1) {
-		pthread_mutex_unlock(&mutex);
-		free(path_dir);
-		free(path_base);
-		free(dir_inode);
-		free(base_inode);
-		return -ENOSPC;
-	}
-	if (dir_add(*dir_inode, base_ino, base, strlen(base)) == -1) {
-		bitmap_t inode_bitmap = get_inode_bitmap(superblock);
-		unset_bitmap(inode_bitmap, base_ino);
-		update_inode_bitmap(inode_bitmap, TRUE, superblock);
-		pthread_mutex_unlock(&mutex);
-		free(path_dir);
-		free(path_base);
-		free(dir_inode);
-		free(base_inode);
-		return -ENOSPC;
-	}
-	memset(base_inode, 0, sizeof(struct inode));
-	base_inode->link = 1;
-	base_inode->ino = base_ino;
-	base_inode->size = 0;
-	base_inode->type = FILE;
-	base_inode->valid = TRUE;
-	base_inode->vstat.st_mtime = base_inode->vstat.st_atime = time(NULL);
-	writei(base_ino, base_inode);
-	pthread_mutex_unlock(&mutex);
-	free(path_dir);
-	free(path_base);
-	free(dir_inode);
-	free(base_inode);
+	struct inode dir_inode,
+		base_inode;
+	char *path_copy,
+		*base;
+	struct rufs_handle *handle;
+	int retstat,
+		retried = FALSE;
+	do {
+		journal_start();
+		retstat = resolve_parent(path, &dir_inode, &path_copy, &base);
+		if (retstat == 0) {
+			retstat = make_node(&dir_inode, base, FILE, &base_inode);
+			// Opened before the directory is unlocked, so that the file cannot be removed and reclaimed first.
+			if (retstat == 0 && (retstat = open_handle(&base_inode, fi->flags, &handle)) == 0) fi->fh = (uint64_t)(uintptr_t)handle;
+			unlock_inode(dir_inode.ino);
+			free(path_copy);
+		}
+		journal_stop();
+	} while (retstat == -ENOSPC && !retried && (retried = reclaim_wait()));
 	//debug("rufs_create(): EXIT\n");
-	return 0;
+	return retstat;
 }
 
 // Status: COMPLETE
 static int rufs_open(const char *path, struct fuse_file_info *fi) {
 	// Step 1: Call get_node_by_path() to get inode from path
 	// Step 2: If not find, return -1
+	// Step 3: Keep a handle for the file in fi->fh so later calls skip the path walk
 	//debug("rufs_open(): ENTER\n");
 	struct inode *inode = malloc(sizeof(struct inode));
 	if (!inode) return -1;
-	pthread_mutex_lock(&mutex);
-	if (get_node_by_path(path, ROOT_INO, inode) != EXIT_SUCCESS || inode->type != FILE) {
-		pthread_mutex_unlock(&mutex);
+	if (lock_node_by_path(path, ROOT_INO, FALSE, inode) != EXIT_SUCCESS) {
 		free(inode);
 		return -1;
 	}
-	pthread_mutex_unlock(&mutex);
+	int retstat = -1;
+	struct rufs_handle *handle;
+	if (inode->type == FILE && (retstat = open_handle(inode, fi->flags, &handle)) == 0) fi->fh = (uint64_t)(uintptr_t)handle;
+	unlock_inode(inode->ino);
 	free(inode);
 	//debug("rufs_open(): EXIT\n");
-    return 0;
+	return retstat;
+}
+
+// Returns the handle rufs_open()/rufs_create() stored in fi, or NULL when the call carries none.
+static struct rufs_handle *get_handle(struct fuse_file_info *fi) {
+	return fi ? (struct rufs_handle *)(uintptr_t)fi->fh : NULL;
+}
+
+// Locks the file a read/write/fgetattr call refers to (exclusively if exclusive is TRUE) and reads its
+// inode: through its open handle when there is one, else by path. Returns 0 with the lock held, or a
+// negative errno value.
+static int lock_file(const char *path, struct rufs_handle *handle, boolean exclusive, struct inode *inode) {
+	if (handle) return lock_handle_inode(handle, exclusive, inode);
+	if (!path || lock_node_by_path(path, ROOT_INO, exclusive, inode) != EXIT_SUCCESS) return -ENOENT;
+	if (inode->type != FILE) {
+		unlock_inode(inode->ino);
+		return -ENOENT;
+	}
+	return 0;
 }
 
 // Status: COMPLETE
 static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-	// Step 2: Based on size and offset, read its data blocks from disk
-	// Step 3: copy the correct amount of data from offset to buffer
+	// Step 1: Lock the inode through the open handle (or from path, if there is none)
+	// Step 2: Call read_file() to copy the correct amount of data from offset to buffer
 	// Note: this function should return the amount of bytes you copied to buffer
 	//debug("rufs_read(): ENTER\n");
-	if (size == 0) return 0;
 	struct inode *inode = malloc(sizeof(struct inode));
 	if (!inode) return 0;
-	char *block_buffer = malloc(BLOCK_SIZE);
-	if (!block_buffer) {
-		free(inode);
-		return 0;
-	}
-	pthread_mutex_lock(&mutex);
-	if (get_node_by_path(path, ROOT_INO, inode) != EXIT_SUCCESS || inode->type != FILE) {
-		pthread_mutex_unlock(&mutex);
-		free(inode);
-		free(block_buffer);
-		return 0;
-	}
-	memset(block_buffer, 0, BLOCK_SIZE);
-	int starting_block_index = offset / BLOCK_SIZE;
-	int ending_block_index = min(16 + 8 * (BLOCK_SIZE / sizeof(int)), (offset + size - 1) / BLOCK_SIZE);
-	if (ending_block_index - starting_block_index < 0) {
-		pthread_mutex_unlock(&mutex);
-		free(inode);
-		free(block_buffer);
-		return 0;
+	struct rufs_handle *handle = get_handle(fi);
+	int retstat = 0;
+	if (lock_file(path, handle, FALSE, inode) == 0) {
+		retstat = read_file(inode, handle, buffer, size, offset);
+		unlock_inode(inode->ino);
 	}
-	int bytes_left = size,
-		bytes_read = 0,
-		block_offset = offset % BLOCK_SIZE;
-	for (int i = starting_block_index; i <= ending_block_index; i++) {
-		int bytes_to_read = min(bytes_left, BLOCK_SIZE - block_offset);
-		bytes_left = max(0, bytes_left - bytes_to_read);
-		if (i < 16) {
-			if (inode->direct_ptr[i] != 0) {
-				bio_read_multi(inode->direct_ptr[i], 1, block_buffer);
-				memcpy(buffer + bytes_read, block_buffer + block_offset, bytes_to_read);
-				bytes_read += bytes_to_read;
-			}
-		} else {
-			int new_i = i - 16;
-			int val_index = new_i % (BLOCK_SIZE / sizeof(int));
-			int ptr_index = new_i / (BLOCK_SIZE / sizeof(int));
-			if (inode->indirect_ptr[ptr_index] != 0) {
-				bio_read_multi(inode->indirect_ptr[ptr_index], 1, block_buffer);
-				int blkno = ((int *)block_buffer)[val_index];
-				if (blkno != 0) {
-					bio_read_multi(blkno, 1, block_buffer);
-					memcpy(buffer + bytes_read, block_buffer + block_offset, bytes_to_read);
-					bytes_read += bytes_to_read;
-				}
-			}
-		}
-		block_offset = 0;
-	}
-	pthread_mutex_unlock(&mutex);
 	free(inode);
-	free(block_buffer);
 	//debug("rufs_read(): EXIT\n");
-	return bytes_read;
+	return retstat;
 }
 
 // Status: COMPLETE
 static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
-	// Step 2: Based on size and offset, read its data blocks from disk
-	// Step 3: Write the correct amount of data from offset to disk
-	// Step 4: Update the inode info and write it to disk
+	// Step 1: Lock the inode exclusively through the open handle (or from path, if there is none)
+	// Step 2: Call write_file() to write the data and update the inode
 	// Note: this function should return the amount of bytes you write to disk
     //debug("rufs_write(): ENTER\n");
 	//debug("rufs_write(): WRITING \"%lu\" BYTES WITH AN OFFSET OF \"%ld\"\n", size, offset);
-    if (size == 0) return 0;
     struct inode *inode = malloc(sizeof(struct inode));
-    if (!inode) return 0;
-    char *block_buffer = malloc(BLOCK_SIZE);
-    if (!block_buffer) {
-        free(inode);
-        return -ENOMEM;
-    }
-	char *alloc_buffer = malloc(BLOCK_SIZE);
-	if (!alloc_buffer) {
-		free(inode);
-		free(block_buffer);
-		return -ENOMEM;
-	}
-	pthread_mutex_lock(&mutex);
-    bitmap_t data_bitmap = get_data_bitmap(superblock);
-    if (!data_bitmap) {
-		pthread_mutex_unlock(&mutex);
-        free(inode);
-        free(block_buffer);
-		free(alloc_buffer);
-        return -ENOMEM;
-    }
-    if (get_node_by_path(path, ROOT_INO, inode) != EXIT_SUCCESS || inode->type != FILE) {
-		pthread_mutex_unlock(&mutex);
-        free(inode);
-        free(block_buffer);
-        free(data_bitmap);
-		free(alloc_buffer);
-        return -ENOENT;
-    }
-    memset(block_buffer, 0, BLOCK_SIZE);
-    int starting_block_index = offset / BLOCK_SIZE;
-    int ending_block_index = min(15 + 8 * (BLOCK_SIZE / sizeof(int)), (offset + size - 1) / BLOCK_SIZE);
-    if (ending_block_index - starting_block_index < 0) {
-		pthread_mutex_unlock(&mutex);
-        free(inode);
-        free(block_buffer);
-        free(data_bitmap);
-		free(alloc_buffer);
-        return -ENOSPC;
-    }
-	boolean should_save = FALSE;
-    int size_increase = 0;
-    for (int i = starting_block_index; i <= ending_block_index; i++) {
-		int blkno;
-		if (i < 16) {
-			if (inode->direct_ptr[i] == 0) {
-				blkno = get_avail_blkno_no_wr(data_bitmap, superblock);
-				if (blkno == -1) {
-					pthread_mutex_unlock(&mutex);
-					free(inode);
-					free(block_buffer);
-					free(data_bitmap);
-					free(alloc_buffer);
-					return -ENOSPC;
-				}
-				size_increase += BLOCK_SIZE;
-				should_save = TRUE;
-				inode->direct_ptr[i] = blkno;
-				bio_write_multi(blkno, 1, block_buffer);
-			}
-		} else {
-			int new_i = i - 16;
-			int val_index = new_i % (BLOCK_SIZE / sizeof(int));
-			int ptr_index = new_i / (BLOCK_SIZE / sizeof(int));
-			if (inode->indirect_ptr[ptr_index] == 0) {
-				blkno = get_avail_blkno_no_wr(data_bitmap, superblock);
-				if (blkno == -1) {
-					pthread_mutex_unlock(&mutex);
-					free(inode);
-					free(block_buffer);
-					free(data_bitmap);
-					free(alloc_buffer);
-					return -ENOSPC;
-				}
-				//size_increase += BLOCK_SIZE; // should realistically not contribute.
-				should_save = TRUE;
-				inode->indirect_ptr[ptr_index] = blkno;
-				bio_write_multi(blkno, 1, block_buffer);
-			}
-			bio_read_multi(inode->indirect_ptr[ptr_index], 1, alloc_buffer);
-			int *list = (int *)alloc_buffer;
-			if (list[val_index] == 0) {
-				blkno = get_avail_blkno_no_wr(data_bitmap, superblock);
-				if (blkno == -1) {
-					pthread_mutex_unlock(&mutex);
-					free(inode);
-					free(block_buffer);
-					free(data_bitmap);
-					free(alloc_buffer);
-					return -ENOSPC;
-				}
-				size_increase += BLOCK_SIZE;
-				should_save = TRUE;
-				list[val_index] = blkno;
-				bio_write_multi(blkno, 1, block_buffer);
-				bio_write_multi(inode->indirect_ptr[ptr_index], 1, alloc_buffer);
-			}
-		}
-    }
-	free(alloc_buffer);
-    if (should_save == TRUE) {
-        inode->size += size_increase;
-        writei(inode->ino, inode);
-        update_data_bitmap(data_bitmap, TRUE, superblock);
-    } else { free(data_bitmap); }
-    int bytes_left = size,
-		bytes_read = 0,
-		block_offset = offset % BLOCK_SIZE;
-    for (int i = starting_block_index; i <= ending_block_index; i++) {
-        int bytes_to_read = min(bytes_left, BLOCK_SIZE - block_offset);
-        bytes_left = max(0, bytes_left - bytes_to_read);
-		if (i < 16) {
-			bio_read_multi(inode->direct_ptr[i], 1, block_buffer);
-			memcpy(block_buffer + block_offset, buffer + bytes_read, bytes_to_read);
-			bio_write_multi(inode->direct_ptr[i], 1, block_buffer);
-		} else {
-			int new_i = i - 16;
-			int val_index = new_i % (BLOCK_SIZE / sizeof(int));
-			int ptr_index = new_i / (BLOCK_SIZE / sizeof(int));
-			bio_read_multi(inode->indirect_ptr[ptr_index], 1, block_buffer);
-			int blkno = ((int *)block_buffer)[val_index];
-			bio_read_multi(blkno, 1, block_buffer);
-			memcpy(block_buffer + block_offset, buffer + bytes_read, bytes_to_read);
-			bio_write_multi(blkno, 1, block_buffer);
+    if (!inode) return -ENOMEM;
+	struct rufs_handle *handle = get_handle(fi);
+	int retstat,
+		retried = FALSE;
+	do {
+		journal_start();
+		retstat = lock_file(path, handle, TRUE, inode);
+		if (retstat == 0) {
+			retstat = write_file(inode, handle, buffer, size, offset);
+			unlock_inode(inode->ino);
 		}
-		bytes_read += bytes_to_read;
-		block_offset = 0;
-    }
-	time(&inode->vstat.st_mtime);
-	writei(inode->ino, inode);
-	pthread_mutex_unlock(&mutex);
+		journal_stop();
+	} while (retstat == -ENOSPC && !retried && (retried = reclaim_wait()));
     free(inode);
-    free(block_buffer);
     //debug("rufs_write(): EXIT\n");
-    return bytes_read;
+    return retstat;
+}
+
+// Status: COMPLETE
+static int rufs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	// Same as rufs_getattr(), but through the open handle
+	struct rufs_handle *handle = get_handle(fi);
+	if (!handle) return rufs_getattr(path, stbuf);
+	struct inode inode;
+	int retstat = lock_handle_inode(handle, FALSE, &inode);
+	if (retstat == 0) {
+		fill_stat(&inode, stbuf);
+		unlock_inode(inode.ino);
+	}
+	return retstat;
 }
 
 static int rufs_unlink(const char *path) {
@@ -1238,32 +2617,77 @@ static int rufs_unlink(const char *path) {
 	// Step 5: Call get_node_by_path() to get inode of parent directory
 	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
 
-	// gotta put multithreading locks for this and other rufs functions at the end
-	pthread_mutex_lock(&mutex);
-
-	int ret = remove_given_path(path, FILE);
-
-	pthread_mutex_unlock(&mutex);
+	// remove_given_path() locks the parent directory and then the file
+	return remove_given_path(path, FILE);
+}
 
-	return ret;
+// Status: COMPLETE
+static int rufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	// Same as rufs_truncate(), but through the open handle
+	struct inode *inode = malloc(sizeof(struct inode));
+	if (!inode) return -ENOMEM;
+	journal_start();
+	int retstat = lock_file(path, get_handle(fi), TRUE, inode);
+	if (retstat == 0) {
+		retstat = truncate_file(inode, size);
+		unlock_inode(inode->ino);
+	}
+	journal_stop();
+	free(inode);
+	return retstat;
 }
 
+// Status: COMPLETE
 static int rufs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	// Also reached for open(O_TRUNC): FUSE truncates the file before opening it
+	return rufs_ftruncate(path, size, NULL);
 }
 
+// Status: COMPLETE
+static int rufs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	struct inode *inode = malloc(sizeof(struct inode));
+	if (!inode) return -ENOMEM;
+	struct rufs_handle *handle = get_handle(fi);
+	int retstat,
+		retried = FALSE;
+	do {
+		journal_start();
+		retstat = lock_file(path, handle, TRUE, inode);
+		if (retstat == 0) {
+			retstat = fallocate_file(inode, handle, mode, offset, length);
+			unlock_inode(inode->ino);
+		}
+		journal_stop();
+	} while (retstat == -ENOSPC && !retried && (retried = reclaim_wait()));
+	free(inode);
+	return retstat;
+}
+
+// Status: COMPLETE
 static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+	// Write back what is left (a failure can no longer be reported) and drop the handle rufs_open()/rufs_create()
+	// stored in fi->fh
+	flush_handle(get_handle(fi));
+	close_handle(get_handle(fi));
+	fi->fh = 0;
 	return 0;
 }
 
+// Status: COMPLETE
 static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	// Called on every close(): write back the file's dirty blocks if this handle wrote any
+	return flush_handle(get_handle(fi));
+}
+
+// Status: COMPLETE
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	return sync_handle(get_handle(fi), datasync ? TRUE : FALSE);
+}
+
+// Status: COMPLETE
+static int rufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	// Directory blocks are journaled, so committing the directory's last change is all there is to do
+	return commit_inode((uint32_t)fi->fh, datasync ? TRUE : FALSE);
 }
 
 static int rufs_utimens(const char *path, const struct timespec tv[2]) {
@@ -1280,6 +2704,7 @@ static struct fuse_operations rufs_ope = {
 	.readdir	= rufs_readdir,
 	.opendir	= rufs_opendir,
 	.releasedir	= rufs_releasedir,
+	.fsyncdir	= rufs_fsyncdir,
 	.mkdir		= rufs_mkdir,
 	.rmdir		= rufs_rmdir,
 
@@ -1292,13 +2717,27 @@ static struct fuse_operations rufs_ope = {
 	.truncate   = rufs_truncate,
 	.flush      = rufs_flush,
 	.utimens    = rufs_utimens,
-	.release	= rufs_release
+	.release	= rufs_release,
+	.fsync		= rufs_fsync,
+
+	.fgetattr	= rufs_fgetattr,
+	.ftruncate	= rufs_ftruncate,
+	.fallocate	= rufs_fallocate,
+
+	// read/write/flush/release/fsync/fgetattr/ftruncate/fallocate/readdir/fsyncdir work from fi->fh, so FUSE need not build paths for them
+	.flag_nullpath_ok = 1,
+	.flag_nopath = 1
 };
 
 int main(int argc, char *argv[]) {
 	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	if (fuse_opt_parse(&args, &options, rufs_opts, NULL) == -1) return EXIT_FAILURE;
+	fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
+	fuse_opt_free_args(&args);
 	return fuse_stat;
-}
\ No newline at end of file
+}
+
+#endif
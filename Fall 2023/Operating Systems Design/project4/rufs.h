@@ -11,13 +11,25 @@
 #include <unistd.h>
 #include <stdarg.h> // User-defined
 #include <pthread.h> // User-defined
+#include <stdint.h> // User-defined
+#include <string.h> // User-defined
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // User-defined
+#endif
 
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+#include "readahead.h" // User-defined
+
+#define MAGIC_NUM 0x5C3D // Bumped from 0x5C3A when inodes switched to extent mapping, from 0x5C3B for the journal and from 0x5C3C when the superblock got a version
+#define RUFS_VERSION 1 // Layout version in the superblock; later layout changes bump this instead of MAGIC_NUM
+
+#define DEFAULT_DISK_SIZE (64ULL * 1024 * 1024) // Size of a new disk unless the disk_size option says otherwise
+#define DEFAULT_BYTES_PER_INODE 65536 // Disk bytes per inode of a new disk unless inodes or bytes_per_inode is given
+#define MAX_DISK_BLOCKS INT32_MAX // Block numbers are handed around as ints, so disks end short of 8 TiB
+#define MAX_INODES INT32_MAX // Inode numbers are handed around as ints, too
+#define MAX_FILE_SIZE ((uint64_t)INT32_MAX * BLOCK_SIZE) // Logical block indexes are ints
 
 /*
  * User-defined headers
@@ -34,6 +46,12 @@
 
 #define ROOT_INO 0
 
+#define INLINE_EXTENTS 6 // Extent tree root entries stored inside the inode
+#define EXTENT_MAGIC 0xE47E // Identifies an on-disk extent tree node
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+#define ALLOC_GROW_SPAN 256 // Free blocks sought, and left to grow into, when a file cannot continue at its goal block
+#define ALLOC_RESERVE_SLACK 64 // Free blocks that reservations for delayed blocks leave to extent tree nodes and directories
+
 #define DEBUG FALSE // Enable for debug statements as the program is running.
 #define BENCHMARK FALSE // Enable for benchmark results when calling rufs_destroy().
 
@@ -41,32 +59,79 @@
 extern unsigned long long TOTAL_INODE_BLOCKS,
 	TOTAL_DATA_BLOCKS;
 
+// Next-fit cursors of the inode and data allocators
+static size_t inode_cursor = 0,
+	data_cursor = 0;
+
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
-	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
-	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
-	uint32_t	i_start_blk;		/* start block of inode region */
-	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	version;			/* layout version (RUFS_VERSION) */
+	uint64_t	max_dnum;			/* size of the disk in blocks, every one of them tracked by the data block bitmap */
+	uint32_t	max_inum;			/* number of inodes */
+	uint32_t	j_block_count;		/* size of the metadata journal in blocks */
+	uint64_t	i_bitmap_blk;		/* start block of inode bitmap */
+	uint64_t	d_bitmap_blk;		/* start block of data block bitmap */
+	uint64_t	i_start_blk;		/* start block of inode region */
+	uint64_t	d_start_blk;		/* start block of data block region */
+	uint64_t	j_start_blk;		/* start block of the metadata journal */
+	uint32_t	orphan_head;		/* first detached inode waiting to be reclaimed (0 if none) */
+	uint32_t	orphan_current;		/* inode taken off the list and being reclaimed (0 if none) */
+};
+
+/*
+ * File data is mapped by an extent tree whose root lives in the inode. At depth 0 the entries are data
+ * extents (logical start, physical start, length); at depth > 0 they index child nodes, each stored in a
+ * data block as a struct extent_block, and only logical/physical are used. Entries are sorted by logical.
+ */
+struct extent {
+	uint32_t	logical;			/* first logical block covered */
+	uint32_t	physical;			/* first disk block (or child node block in an index) */
+	uint32_t	length;				/* number of blocks (unused in an index) */
+};
+
+struct extent_header {
+	uint16_t	magic;				/* EXTENT_MAGIC in on-disk nodes (unused in the inode) */
+	uint16_t	count;				/* number of entries in use */
+	uint16_t	depth;				/* 0 for data extents, otherwise the height above the leaves */
+	uint16_t	reserved;
+};
+
+struct extent_block {
+	struct extent_header header;
+	struct extent entries[(BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent)];
 };
 
 struct inode {
-	uint16_t	ino;				/* inode number */
+	uint32_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint16_t	type;				/* type of the file */
+	uint64_t	size;				/* size of the file */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	uint32_t	next_orphan;		/* next inode on the orphan list (0 at its end) */
+	struct extent_header extent_root;			/* header of the inline extent tree root */
+	struct extent	extents[INLINE_EXTENTS];	/* inline extent tree root */
+	uint32_t	generation;			/* bumped each time the inode number is reused */
+	uint32_t	reserved;			/* pads the inode to 256 bytes, so that none straddles two blocks */
 	struct stat	vstat;				/* inode stat */
 };
 
+// Per-open state kept in fuse_file_info->fh from open/create until release.
+struct rufs_handle {
+	uint32_t	ino;				/* inode of the open file */
+	uint32_t	generation;			/* its generation when opened */
+	int			flags;				/* open(2) flags */
+	uint32_t	map_generation;		/* extent_generation[ino] when map_hint was filled */
+	struct extent	map_hint;		/* last mapped extent found for this file (length 0 if none) */
+	pthread_mutex_t	hint_mutex;		/* guards map_generation, map_hint and dirty */
+	int			dirty;				/* TRUE if written through since the last flush */
+	struct readahead_state	readahead;	/* sequential stream detection; guarded by hint_mutex */
+};
+
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
+	uint32_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
-	char name[208];					/* name of the directory entry */
 	uint16_t len;					/* length of name */
+	char name[208];					/* name of the directory entry */
 };
 
 /*
@@ -75,6 +140,8 @@ struct dirent {
 
 typedef unsigned char* bitmap_t;
 
+typedef unsigned char boolean; // User-defined
+
 void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
@@ -83,140 +150,211 @@ void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
+// Clears bits [start, start + count): the bytes in between are cleared whole. (User-defined)
+void unset_bitmap_range(bitmap_t b, size_t start, size_t count) {
+	size_t end = start + count;
+	while (start < end && (start & 7)) unset_bitmap(b, start++);
+	if (end - start >= 8) {
+		memset(b + start / 8, 0, (end - start) / 8);
+		start += (end - start) / 8 * 8;
+	}
+	while (start < end) unset_bitmap(b, start++);
+}
+
 uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
 /*
- * helper functions (user-defined)
+ * bitmap search (user-defined)
+ *
+ * Free bits are located a 64-bit word at a time with count-trailing-zeros. Long runs of fully allocated
+ * bytes are skipped with AVX2 or SSE2 when the CPU supports it (chosen once at runtime), or 8 bytes at a
+ * time otherwise. Bit i lives in byte i / 8 at position i & 7, so a little-endian word load keeps bit i
+ * at position i & 63 of word i / 64.
  */
 
-typedef unsigned char boolean;
+// Loads the 64-bit word that starts at byte_ind, reading only the bytes below byte_size.
+// Status: COMPLETE
+static inline uint64_t bitmap_load_word(const unsigned char *b, size_t byte_ind, size_t byte_size) {
+	uint64_t word = ~0ULL;
+	if (byte_ind + 8 <= byte_size) {
+		memcpy(&word, b + byte_ind, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		word = __builtin_bswap64(word);
+#endif
+		return word;
+	}
+	for (size_t i = 0; byte_ind + i < byte_size; i++) {
+		word &= ~(0xFFULL << (8 * i));
+		word |= (uint64_t)b[byte_ind + i] << (8 * i);
+	}
+	return word;
+}
 
-// Returns an instantiation of the superblock written from the disk.
+// Returns the first byte index in [byte_ind, byte_end) that is not 0xFF, eight bytes at a time.
 // Status: COMPLETE
-struct superblock *get_superblock() {
-	size_t superblock_block_size = (sizeof(struct superblock) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	struct superblock *superblock = malloc(superblock_block_size * BLOCK_SIZE);
-	if (!superblock) return NULL;
-	struct superblock *superblock_real = malloc(sizeof(struct superblock));
-	if (!superblock_real) {
-		free(superblock);
-		return NULL;
+static size_t bitmap_skip_full_scalar(const unsigned char *b, size_t byte_ind, size_t byte_end) {
+	while (byte_ind + 8 <= byte_end) {
+		uint64_t word;
+		memcpy(&word, b + byte_ind, 8);
+		if (word != ~0ULL) break;
+		byte_ind += 8;
 	}
-	if (bio_read_multi(0, superblock_block_size, (void *)superblock) != EXIT_SUCCESS) {
-		free(superblock);
-		free(superblock_real);
-		return NULL;
+	return byte_ind;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 variant of bitmap_skip_full_scalar(); 16 bytes per comparison.
+// Status: COMPLETE
+__attribute__((target("sse2")))
+static size_t bitmap_skip_full_sse2(const unsigned char *b, size_t byte_ind, size_t byte_end) {
+	const __m128i ones = _mm_set1_epi8((char)0xFF);
+	while (byte_ind + 16 <= byte_end) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(b + byte_ind));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, ones)) != 0xFFFF) break;
+		byte_ind += 16;
 	}
-	memcpy(superblock_real, superblock, sizeof(struct superblock));
-	free(superblock);
-	return superblock_real; // Must be manually freed by the user.
+	return bitmap_skip_full_scalar(b, byte_ind, byte_end);
 }
 
-// Returns an instantiation of the inode bitmap written from the disk.
+// AVX2 variant of bitmap_skip_full_scalar(); 32 bytes per comparison.
 // Status: COMPLETE
-bitmap_t get_inode_bitmap(struct superblock *superblock) {
-	if (!superblock) return NULL;
-	size_t inode_bitmap_byte_size = (superblock->max_inum + 7) / 8,
-		inode_bitmap_block_size = (inode_bitmap_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	bitmap_t inode_bitmap = malloc(inode_bitmap_block_size * BLOCK_SIZE);
-	if (!inode_bitmap) return NULL;
-	bitmap_t inode_bitmap_real = malloc(inode_bitmap_byte_size);
-	if (!inode_bitmap_real) {
-		free(inode_bitmap);
-		return NULL;
+__attribute__((target("avx2")))
+static size_t bitmap_skip_full_avx2(const unsigned char *b, size_t byte_ind, size_t byte_end) {
+	const __m256i ones = _mm256_set1_epi8((char)0xFF);
+	while (byte_ind + 32 <= byte_end) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(b + byte_ind));
+		if (!_mm256_testc_si256(chunk, ones)) break;
+		byte_ind += 32;
 	}
-	if (bio_read_multi(superblock->i_bitmap_blk, inode_bitmap_block_size, inode_bitmap) != EXIT_SUCCESS) {
-		free(inode_bitmap);
-		free(inode_bitmap_real);
-		return NULL;
+	return bitmap_skip_full_scalar(b, byte_ind, byte_end);
+}
+#endif
+
+static size_t (*bitmap_skip_full)(const unsigned char *, size_t, size_t) = NULL;
+
+// Picks the widest all-ones skipping routine the CPU supports; force_scalar disables the SIMD variants.
+// Status: COMPLETE
+void bitmap_select_search(boolean force_scalar) {
+	bitmap_skip_full = bitmap_skip_full_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	if (force_scalar) return;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) bitmap_skip_full = bitmap_skip_full_avx2;
+	else if (__builtin_cpu_supports("sse2")) bitmap_skip_full = bitmap_skip_full_sse2;
+#endif
+}
+
+// Returns the index of the first clear bit in [start, end), or -1 if every bit in the range is set.
+// Status: COMPLETE
+long find_clear_bit(bitmap_t b, size_t start, size_t end) {
+	if (!bitmap_skip_full) bitmap_select_search(FALSE);
+	size_t byte_size = (end + 7) / 8,
+		i = start;
+	while (i < end) {
+		if ((i & 63) == 0) {
+			// Word aligned: skip whole runs of allocated bytes before examining the next word.
+			i = bitmap_skip_full(b, i / 8, byte_size) * 8;
+			if (i >= end) break;
+			i &= ~(size_t)63;
+		}
+		uint64_t word = bitmap_load_word(b, (i / 64) * 8, byte_size) | ((1ULL << (i & 63)) - 1);
+		if (word != ~0ULL) {
+			size_t bit = (i & ~(size_t)63) + __builtin_ctzll(~word);
+			return bit < end ? (long)bit : -1;
+		}
+		i = (i & ~(size_t)63) + 64;
 	}
-	memcpy(inode_bitmap_real, inode_bitmap, inode_bitmap_byte_size);
-	free(inode_bitmap);
-	return inode_bitmap_real;
+	return -1;
 }
 
-// Writes the parametrized inode bitmap to the disk, which can also be optionally freed.
+// Next-fit search: looks for a clear bit from *cursor to bit_count, then wraps around to the start.
+// The cursor is left just past the returned bit so that successive searches never rescan full regions.
 // Status: COMPLETE
-int update_inode_bitmap(bitmap_t inode_bitmap, boolean free_bitmap, struct superblock *superblock) {
-	// Note that inode_bitmap has a precise size (i.e., not rounded up to the nearest block).
-	if (!superblock) return -1;
-	size_t inode_bitmap_byte_size = (superblock->max_inum + 7) / 8,
-		inode_bitmap_block_size = (inode_bitmap_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	bitmap_t inode_bitmap_real = malloc(inode_bitmap_block_size * BLOCK_SIZE);
-	if (!inode_bitmap_real) return -1;
-	memset(inode_bitmap_real, 0, inode_bitmap_block_size * BLOCK_SIZE);
-	memcpy(inode_bitmap_real, inode_bitmap, inode_bitmap_byte_size);
-	if (bio_write_multi(superblock->i_bitmap_blk, inode_bitmap_block_size, inode_bitmap_real) != EXIT_SUCCESS) {
-		free(inode_bitmap_real);
-		return -1;
+long find_clear_bit_next_fit(bitmap_t b, size_t bit_count, size_t *cursor) {
+	if (*cursor >= bit_count) *cursor = 0;
+	long bit = find_clear_bit(b, *cursor, bit_count);
+	if (bit == -1 && *cursor > 0) bit = find_clear_bit(b, 0, *cursor);
+	if (bit != -1) *cursor = (size_t)bit + 1;
+	return bit;
+}
+
+// Returns the index of the first set bit in [start, end), or end if every bit in the range is clear.
+// Status: COMPLETE
+size_t find_set_bit(bitmap_t b, size_t start, size_t end) {
+	size_t byte_size = (end + 7) / 8,
+		i = start;
+	while (i < end) {
+		uint64_t word = bitmap_load_word(b, (i / 64) * 8, byte_size) & ~((1ULL << (i & 63)) - 1);
+		if (word != 0) {
+			size_t bit = (i & ~(size_t)63) + __builtin_ctzll(word);
+			return bit < end ? bit : end;
+		}
+		i = (i & ~(size_t)63) + 64;
 	}
-	if (free_bitmap == TRUE) free(inode_bitmap);
-	free(inode_bitmap_real);
-	return EXIT_SUCCESS;
+	return end;
 }
 
-// Additional implementation of get_avail_blkno() that does not write to the disk.
+// Finds a run of want clear bits in [start, end). The first run that is long enough wins; otherwise the
+// longest run seen is returned. *out_len receives the usable length (at most want); -1 means no clear bit.
 // Status: COMPLETE
-int get_avail_ino_no_wr(bitmap_t inode_bitmap, struct superblock *superblock) {
-	// Note that inode_bitmap must be externally freed.
-    if (!inode_bitmap) return -1;
-    size_t inode_bitmap_byte_size = (superblock->max_inum + 7) / 8;
-    for (unsigned int i = 0; i < inode_bitmap_byte_size; i++) {
-		if (inode_bitmap[i] == 255) continue;
-		for (int j = 0; j < 8; j++) {
-			if (get_bitmap(inode_bitmap, i * 8 + j) == FALSE) {
-				set_bitmap(inode_bitmap, i * 8 + j);
-				TOTAL_INODE_BLOCKS++;
-				return i * 8 + j;
-			}
+long find_clear_run(bitmap_t b, size_t start, size_t end, size_t want, size_t *out_len) {
+	long best = -1;
+	size_t best_len = 0,
+		i = start;
+	while (i < end) {
+		long bit = find_clear_bit(b, i, end);
+		if (bit == -1) break;
+		size_t limit = (size_t)bit + want < end ? (size_t)bit + want : end,
+			stop = find_set_bit(b, (size_t)bit, limit),
+			len = stop - (size_t)bit;
+		if (len > best_len) {
+			best = bit;
+			best_len = len;
+			if (len == want) break;
 		}
-    }
-    return -1;
+		i = stop + 1;
+	}
+	*out_len = best_len;
+	return best;
 }
 
-// Returns an instantiation of the data bitmap written from the disk.
+/*
+ * helper functions (user-defined)
+ */
+
+// Returns an instantiation of the superblock written from the disk.
 // Status: COMPLETE
-bitmap_t get_data_bitmap(struct superblock *superblock) {
+struct superblock *get_superblock() {
+	size_t superblock_block_size = (sizeof(struct superblock) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	struct superblock *superblock = malloc(superblock_block_size * BLOCK_SIZE);
 	if (!superblock) return NULL;
-	size_t data_bitmap_byte_size = (superblock->max_dnum + 7) / 8,
-		data_bitmap_block_size = (data_bitmap_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	bitmap_t data_bitmap = malloc(data_bitmap_block_size * BLOCK_SIZE);
-	if (!data_bitmap) return NULL;
-	bitmap_t data_bitmap_real = malloc(data_bitmap_byte_size);
-	if (!data_bitmap_real) {
-		free(data_bitmap);
+	struct superblock *superblock_real = malloc(sizeof(struct superblock));
+	if (!superblock_real) {
+		free(superblock);
 		return NULL;
 	}
-	if (bio_read_multi(superblock->d_bitmap_blk, data_bitmap_block_size, data_bitmap) != EXIT_SUCCESS) {
-		free(data_bitmap);
-		free(data_bitmap_real);
+	if (bio_read_multi(0, superblock_block_size, (void *)superblock) != EXIT_SUCCESS) {
+		free(superblock);
+		free(superblock_real);
 		return NULL;
 	}
-	memcpy(data_bitmap_real, data_bitmap, data_bitmap_byte_size);
-	free(data_bitmap);
-	return data_bitmap_real;
+	memcpy(superblock_real, superblock, sizeof(struct superblock));
+	free(superblock);
+	return superblock_real; // Must be manually freed by the user.
 }
 
-// Writes the parametrized data bitmap to the disk, which can also be optionally freed.
+// Additional implementation of get_avail_blkno() that does not write to the disk.
 // Status: COMPLETE
-int update_data_bitmap(bitmap_t data_bitmap, boolean free_bitmap, struct superblock *superblock) {
-	// Note that data_bitmap has a precise size (i.e., not rounded up to the nearest block).
-	if (!superblock) return -1;
-	size_t data_bitmap_byte_size = (superblock->max_dnum + 7) / 8,
-		data_bitmap_block_size = (data_bitmap_byte_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	bitmap_t data_bitmap_real = malloc(data_bitmap_block_size * BLOCK_SIZE);
-	if (!data_bitmap_real) return -1;
-	memset(data_bitmap_real, 0, data_bitmap_block_size * BLOCK_SIZE);
-	memcpy(data_bitmap_real, data_bitmap, data_bitmap_byte_size);
-	if (bio_write_multi(superblock->d_bitmap_blk, data_bitmap_block_size, data_bitmap_real) != EXIT_SUCCESS) {
-		free(data_bitmap_real);
-		return -1;
-	}
-	if (free_bitmap == TRUE) free(data_bitmap);
-	free(data_bitmap_real);
-	return EXIT_SUCCESS;
+int get_avail_ino_no_wr(bitmap_t inode_bitmap, struct superblock *superblock) {
+	// Note that inode_bitmap must be externally freed.
+    if (!inode_bitmap) return -1;
+	long ino = find_clear_bit_next_fit(inode_bitmap, superblock->max_inum, &inode_cursor);
+	if (ino == -1) return -1;
+	set_bitmap(inode_bitmap, ino);
+	TOTAL_INODE_BLOCKS++;
+	return ino;
 }
 
 // Additional implementation of get_avail_blkno() that does not write to the disk.
@@ -224,18 +362,50 @@ int update_data_bitmap(bitmap_t data_bitmap, boolean free_bitmap, struct superbl
 int get_avail_blkno_no_wr(bitmap_t data_bitmap, struct superblock *superblock) {
 	// Note that data_bitmap must be externally freed.
     if (!data_bitmap) return -1;
-    size_t data_bitmap_byte_size = (superblock->max_dnum + 7) / 8;
-    for (unsigned int i = 0; i < data_bitmap_byte_size; i++) {
-		if (data_bitmap[i] == 255) continue;
-		for (int j = 0; j < 8; j++) {
-			if (get_bitmap(data_bitmap, i * 8 + j) == FALSE) {
-				set_bitmap(data_bitmap, i * 8 + j);
-				TOTAL_DATA_BLOCKS++;
-				return i * 8 + j;
+	long blkno = find_clear_bit_next_fit(data_bitmap, superblock->max_dnum, &data_cursor);
+	if (blkno == -1) return -1;
+	set_bitmap(data_bitmap, blkno);
+	TOTAL_DATA_BLOCKS++;
+	return blkno;
+}
+
+// Contiguous variant of get_avail_blkno_no_wr(): claims up to want adjacent blocks starting at goal when it is
+// free, otherwise from the first region of ALLOC_GROW_SPAN free blocks after the next-fit cursor (or the largest
+// region found when the disk is too fragmented). *out_count receives the number claimed.
+// Status: COMPLETE
+int get_avail_blkno_run_no_wr(bitmap_t data_bitmap, struct superblock *superblock, size_t goal, size_t want, size_t *out_count) {
+	*out_count = 0;
+	if (!data_bitmap || want == 0) return -1;
+	size_t len,
+		wrap_len = 0;
+	long blkno;
+	if (goal != 0 && goal < superblock->max_dnum && !get_bitmap(data_bitmap, goal)) {
+		// The goal is free: extend the file in place as far as the free space reaches.
+		size_t limit = goal + want < superblock->max_dnum ? goal + want : superblock->max_dnum;
+		blkno = goal;
+		len = find_set_bit(data_bitmap, goal, limit) - goal;
+	} else {
+		// Otherwise look for a region with room for the file to keep growing contiguously.
+		size_t span = want < ALLOC_GROW_SPAN ? ALLOC_GROW_SPAN : want;
+		goal = data_cursor < superblock->max_dnum ? data_cursor : 0;
+		blkno = find_clear_run(data_bitmap, goal, superblock->max_dnum, span, &len);
+		if (len < span && goal > 0) {
+			long wrap = find_clear_run(data_bitmap, 0, goal, span, &wrap_len);
+			if (wrap_len > len) {
+				blkno = wrap;
+				len = wrap_len;
 			}
 		}
-    }
-    return -1;
+		if (blkno == -1) return -1;
+		// Leave the rest of the region to this file: other files start their searches beyond it.
+		data_cursor = blkno + len;
+		if (len > want) len = want;
+	}
+	for (size_t i = 0; i < len; i++) set_bitmap(data_bitmap, blkno + i);
+	if (data_cursor < blkno + len) data_cursor = blkno + len;
+	TOTAL_DATA_BLOCKS += len;
+	*out_count = len;
+	return blkno;
 }
 
 // Returns the next entry from the path
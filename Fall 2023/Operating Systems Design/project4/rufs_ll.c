@@ -0,0 +1,450 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	rufs_ll.c
+ *
+ */
+
+/*
+ * Low-level FUSE front end. The kernel addresses files by inode number here, so paths are never resolved:
+ * a name is looked up only in rufs_ll_lookup(), one component at a time. rufs.c is compiled into this
+ * translation unit with RUFS_LOWLEVEL defined, which keeps its inode, directory and block code and drops its
+ * path-based callbacks and main(). FUSE inode numbers are RUFS inode numbers plus one, since FUSE reserves
+ * 1 (FUSE_ROOT_ID) for the root while RUFS uses 0, with the inode's generation in the upper 32 bits: a number
+ * the kernel kept from before the inode was reused no longer matches it. Every entry reply counts a lookup
+ * (see get_inode_refs()) until the kernel forgets it, so that a removed inode outlives the kernel's use of it.
+ */
+
+#define RUFS_LOWLEVEL
+#include "rufs.c"
+
+#include <fuse_lowlevel.h>
+
+#define RUFS_LL_TIMEOUT 1.0 // Seconds the kernel may cache attributes and names
+
+// Converts between FUSE and RUFS inode numbers; fuse_ino_t is 64 bits wide on the platforms RUFS builds for.
+#define TO_FUSE_INO(ino, generation) (((fuse_ino_t)(generation) << 32) | ((fuse_ino_t)(ino) + 1))
+#define TO_RUFS_INO(ino) ((uint32_t)(ino) - 1)
+#define FUSE_INO_GENERATION(ino) ((uint32_t)((ino) >> 32))
+
+// Locks the inode behind a FUSE inode number (exclusively if exclusive is TRUE) and reads it; fails for
+// numbers that do not name a live inode of the same generation. On success the caller unlocks it with
+// unlock_inode().
+// Status: COMPLETE
+static int ll_lock_inode(fuse_ino_t ino, boolean exclusive, struct inode *inode) {
+	if ((uint32_t)ino == 0 || TO_RUFS_INO(ino) >= superblock->max_inum) return -1;
+	lock_inode(TO_RUFS_INO(ino), exclusive);
+	if (readi(TO_RUFS_INO(ino), inode) != EXIT_SUCCESS || inode->valid == FALSE || inode->generation != FUSE_INO_GENERATION(ino)) {
+		unlock_inode(TO_RUFS_INO(ino));
+		return -1;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Fills a FUSE entry reply for inode and counts the lookup it hands the kernel; if the reply cannot be sent,
+// the caller drops it again with put_inode_refs(). The caller holds the inode's directory, so that the inode
+// cannot be removed before it is counted.
+// Status: COMPLETE
+static void ll_fill_entry(struct inode *inode, struct fuse_entry_param *e) {
+	get_inode_refs(inode->ino, 1, 0);
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = TO_FUSE_INO(inode->ino, inode->generation);
+	e->generation = inode->generation;
+	e->attr_timeout = RUFS_LL_TIMEOUT;
+	e->entry_timeout = RUFS_LL_TIMEOUT;
+	fill_stat(inode, &e->attr);
+	e->attr.st_ino = e->ino;
+}
+
+// Status: COMPLETE
+static void rufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	rufs_mount();
+}
+
+// Status: COMPLETE
+static void rufs_ll_destroy(void *userdata) {
+	rufs_unmount();
+}
+
+// Status: COMPLETE
+static void rufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	struct inode dir_inode,
+		inode;
+	struct fuse_entry_param e;
+	uint32_t ino;
+	if (ll_lock_inode(parent, FALSE, &dir_inode) != EXIT_SUCCESS) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (dir_inode.type != DIRECTORY) {
+		unlock_inode(dir_inode.ino);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	// No entry can hold such a name; the kernel must not cache it as a negative entry either.
+	if (strlen(name) >= sizeof(((struct dirent *)0)->name)) {
+		unlock_inode(dir_inode.ino);
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	// The directory stays locked while the entry's inode is read, so the name cannot be removed meanwhile.
+	if (lookup_name(dir_inode.ino, name, &ino) != EXIT_SUCCESS || readi(ino, &inode) != EXIT_SUCCESS) {
+		unlock_inode(dir_inode.ino);
+		// A zero inode number lets the kernel cache the negative lookup as well.
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+		e.entry_timeout = RUFS_LL_TIMEOUT;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	ll_fill_entry(&inode, &e);
+	unlock_inode(dir_inode.ino);
+	if (fuse_reply_entry(req, &e) != 0) put_inode_refs(inode.ino, 1, 0);
+}
+
+// The kernel dropped nlookup of the lookups counted by ll_fill_entry().
+// Status: COMPLETE
+static void rufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	put_inode_refs(TO_RUFS_INO(ino), nlookup, 0);
+	fuse_reply_none(req);
+}
+
+// Status: COMPLETE
+static void rufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct inode inode;
+	struct stat stbuf;
+	if (ll_lock_inode(ino, FALSE, &inode) != EXIT_SUCCESS) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	// Only the access time changes under the shared lock (see rufs_getattr()).
+	inode.vstat.st_atime = time(NULL);
+	writei_lazy(inode.ino, &inode);
+	fill_stat(&inode, &stbuf);
+	unlock_inode(inode.ino);
+	stbuf.st_ino = ino;
+	fuse_reply_attr(req, &stbuf, RUFS_LL_TIMEOUT);
+}
+
+// Changes the size (see truncate_file()) and timestamps; mode and ownership are fixed.
+// Status: COMPLETE
+static void rufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	struct inode inode;
+	struct stat stbuf;
+	journal_start();
+	if (ll_lock_inode(ino, TRUE, &inode) != EXIT_SUCCESS) {
+		journal_stop();
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	int retstat = to_set & FUSE_SET_ATTR_SIZE ? truncate_file(&inode, attr->st_size) : 0;
+	if (retstat != 0) {
+		unlock_inode(inode.ino);
+		journal_stop();
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_ATIME) inode.vstat.st_atime = attr->st_atime;
+	if (to_set & FUSE_SET_ATTR_MTIME) inode.vstat.st_mtime = attr->st_mtime;
+	if (to_set & FUSE_SET_ATTR_ATIME_NOW) inode.vstat.st_atime = time(NULL);
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW) inode.vstat.st_mtime = time(NULL);
+	writei(inode.ino, &inode);
+	fill_stat(&inode, &stbuf);
+	unlock_inode(inode.ino);
+	journal_stop();
+	stbuf.st_ino = ino;
+	fuse_reply_attr(req, &stbuf, RUFS_LL_TIMEOUT);
+}
+
+// Shared body of rufs_ll_mkdir() and rufs_ll_create(); returns 0 or a negative errno value.
+// When fi is given, the new node is also opened into fi->fh.
+static int ll_make_node(fuse_ino_t parent, const char *name, int type, struct fuse_entry_param *e, struct fuse_file_info *fi) {
+	struct inode dir_inode,
+		inode;
+	struct rufs_handle *handle;
+	int retstat,
+		retried = FALSE;
+	do {
+		journal_start();
+		if (ll_lock_inode(parent, TRUE, &dir_inode) != EXIT_SUCCESS) {
+			journal_stop();
+			return -ENOENT;
+		}
+		retstat = make_node(&dir_inode, name, type, &inode);
+		// The node is counted and opened before the directory is unlocked, so that it cannot be removed and
+		// reclaimed first.
+		if (retstat == 0 && fi && (retstat = open_handle(&inode, fi->flags, &handle)) == 0) fi->fh = (uint64_t)(uintptr_t)handle;
+		if (retstat == 0) ll_fill_entry(&inode, e);
+		unlock_inode(dir_inode.ino);
+		journal_stop();
+		// Out of space with removed files still being reclaimed: wait for the reclaimer and try once more
+	} while (retstat == -ENOSPC && !retried && (retried = reclaim_wait()));
+	return retstat;
+}
+
+// Status: COMPLETE
+static void rufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	struct fuse_entry_param e;
+	int retstat = ll_make_node(parent, name, DIRECTORY, &e, NULL);
+	if (retstat != 0) fuse_reply_err(req, -retstat);
+	else if (fuse_reply_entry(req, &e) != 0) put_inode_refs(TO_RUFS_INO(e.ino), 1, 0);
+}
+
+// Status: COMPLETE
+static void rufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	struct fuse_entry_param e;
+	int retstat = ll_make_node(parent, name, FILE, &e, fi);
+	if (retstat != 0) fuse_reply_err(req, -retstat);
+	else if (fuse_reply_create(req, &e, fi) != 0) {
+		// The kernel never learnt of the handle or the lookup.
+		close_handle((struct rufs_handle *)(uintptr_t)fi->fh);
+		fi->fh = 0;
+		put_inode_refs(TO_RUFS_INO(e.ino), 1, 0);
+	}
+}
+
+// Shared body of rufs_ll_unlink() and rufs_ll_rmdir().
+static void ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int type) {
+	struct inode dir_inode;
+	int retstat = -ENOENT;
+	journal_start();
+	if (ll_lock_inode(parent, TRUE, &dir_inode) == EXIT_SUCCESS) {
+		retstat = remove_from_dir(dir_inode, name, strlen(name), type);
+		unlock_inode(dir_inode.ino);
+	}
+	journal_stop();
+	fuse_reply_err(req, retstat == 0 ? 0 : retstat < 0 && retstat != -1 ? -retstat : EIO);
+}
+
+// Status: COMPLETE
+static void rufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	ll_remove(req, parent, name, FILE);
+}
+
+// Status: COMPLETE
+static void rufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	ll_remove(req, parent, name, DIRECTORY);
+}
+
+// Shared body of rufs_ll_open() and rufs_ll_opendir(); checks that ino is of the expected type.
+// Regular files get a handle in fi->fh.
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, int type) {
+	struct inode inode;
+	struct rufs_handle *handle;
+	if (ll_lock_inode(ino, FALSE, &inode) != EXIT_SUCCESS) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	int retstat = inode.type != type ? (type == FILE ? EISDIR : ENOTDIR) : 0;
+	if (retstat == 0 && type == FILE) {
+		retstat = -open_handle(&inode, fi->flags, &handle);
+		if (retstat == 0) fi->fh = (uint64_t)(uintptr_t)handle;
+	}
+	unlock_inode(inode.ino);
+	if (retstat != 0) fuse_reply_err(req, retstat);
+	else fuse_reply_open(req, fi);
+}
+
+// Status: COMPLETE
+static void rufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	ll_open(req, ino, fi, FILE);
+}
+
+// Status: COMPLETE
+static void rufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	ll_open(req, ino, fi, DIRECTORY);
+}
+
+// Locks the file behind a read/write request (exclusively if exclusive is TRUE) and reads its inode: through
+// the open handle when there is one. Returns 0 with the lock held, or a negative errno value.
+static int ll_lock_file(fuse_ino_t ino, struct rufs_handle *handle, boolean exclusive, struct inode *inode) {
+	if (handle) return lock_handle_inode(handle, exclusive, inode);
+	return ll_lock_inode(ino, exclusive, inode) == EXIT_SUCCESS ? 0 : -ENOENT;
+}
+
+// Status: COMPLETE
+static void rufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct inode inode;
+	char *buffer = malloc(size);
+	if (!buffer) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	struct rufs_handle *handle = (struct rufs_handle *)(uintptr_t)fi->fh;
+	int retstat = ll_lock_file(ino, handle, FALSE, &inode);
+	if (retstat == 0) {
+		retstat = read_file(&inode, handle, buffer, size, off);
+		unlock_inode(inode.ino);
+	}
+	if (retstat < 0) fuse_reply_err(req, -retstat);
+	else fuse_reply_buf(req, buffer, retstat);
+	free(buffer);
+}
+
+// Status: COMPLETE
+static void rufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct inode inode;
+	struct rufs_handle *handle = (struct rufs_handle *)(uintptr_t)fi->fh;
+	int retstat,
+		retried = FALSE;
+	do {
+		journal_start();
+		retstat = ll_lock_file(ino, handle, TRUE, &inode);
+		if (retstat == 0) {
+			retstat = write_file(&inode, handle, buf, size, off);
+			unlock_inode(inode.ino);
+		}
+		journal_stop();
+	} while (retstat == -ENOSPC && !retried && (retried = reclaim_wait()));
+	if (retstat < 0) fuse_reply_err(req, -retstat);
+	else fuse_reply_write(req, retstat);
+}
+
+// Status: COMPLETE
+static void rufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	struct inode inode;
+	struct rufs_handle *handle = (struct rufs_handle *)(uintptr_t)fi->fh;
+	int retstat,
+		retried = FALSE;
+	do {
+		journal_start();
+		retstat = ll_lock_file(ino, handle, TRUE, &inode);
+		if (retstat == 0) {
+			retstat = fallocate_file(&inode, handle, mode, offset, length);
+			unlock_inode(inode.ino);
+		}
+		journal_stop();
+	} while (retstat == -ENOSPC && !retried && (retried = reclaim_wait()));
+	fuse_reply_err(req, -retstat);
+}
+
+struct ll_readdir_context {
+	fuse_req_t req;
+	char *buffer;
+	size_t size,
+		used;
+};
+
+// list_dir() visitor for rufs_ll_readdir(); stops once the reply buffer is full.
+static int ll_readdir_visit(void *ctx, struct dirent *dirent, off_t next_offset) {
+	struct ll_readdir_context *context = ctx;
+	struct inode inode;
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(struct stat));
+	if (readi(dirent->ino, &inode) == EXIT_SUCCESS) {
+		stbuf.st_ino = TO_FUSE_INO(dirent->ino, inode.generation);
+		stbuf.st_mode = inode.type == DIRECTORY ? DIRECTORY_MODE : FILE_MODE;
+	}
+	size_t entry_size = fuse_add_direntry(context->req, context->buffer + context->used, context->size - context->used, dirent->name, &stbuf, next_offset);
+	if (entry_size > context->size - context->used) return 1;
+	context->used += entry_size;
+	return 0;
+}
+
+// Status: COMPLETE
+static void rufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct inode inode;
+	struct ll_readdir_context context = { req, malloc(size), size, 0 };
+	if (!context.buffer) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int retstat = -ENOENT;
+	if (ll_lock_inode(ino, FALSE, &inode) == EXIT_SUCCESS) {
+		retstat = list_dir(&inode, off, ll_readdir_visit, &context);
+		if (retstat == 0) {
+			time(&inode.vstat.st_atime);
+			writei_lazy(inode.ino, &inode);
+		}
+		unlock_inode(inode.ino);
+	}
+	if (retstat < 0) fuse_reply_err(req, -retstat);
+	else fuse_reply_buf(req, context.buffer, context.used);
+	free(context.buffer);
+}
+
+// Called on every close(): writes back the file's dirty blocks if this handle wrote any.
+// Status: COMPLETE
+static void rufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -flush_handle((struct rufs_handle *)(uintptr_t)fi->fh));
+}
+
+// Status: COMPLETE
+static void rufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -sync_handle((struct rufs_handle *)(uintptr_t)fi->fh, datasync ? TRUE : FALSE));
+}
+
+// Directory blocks are journaled, so committing the directory's last change is all there is to do.
+// Status: COMPLETE
+static void rufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -commit_inode(TO_RUFS_INO(ino), datasync ? TRUE : FALSE));
+}
+
+// Status: COMPLETE
+static void rufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, 0);
+}
+
+// Writes back what is left and drops the handle ll_open() or ll_make_node() stored in fi->fh.
+// Status: COMPLETE
+static void rufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct rufs_handle *handle = (struct rufs_handle *)(uintptr_t)fi->fh;
+	flush_handle(handle);
+	close_handle(handle);
+	fi->fh = 0;
+	fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops rufs_ll_ope = {
+	.init		= rufs_ll_init,
+	.destroy	= rufs_ll_destroy,
+
+	.lookup		= rufs_ll_lookup,
+	.forget		= rufs_ll_forget,
+	.getattr	= rufs_ll_getattr,
+	.setattr	= rufs_ll_setattr,
+	.readdir	= rufs_ll_readdir,
+	.opendir	= rufs_ll_opendir,
+	.releasedir	= rufs_ll_releasedir,
+	.fsyncdir	= rufs_ll_fsyncdir,
+	.mkdir		= rufs_ll_mkdir,
+	.rmdir		= rufs_ll_rmdir,
+
+	.create		= rufs_ll_create,
+	.open		= rufs_ll_open,
+	.read		= rufs_ll_read,
+	.write		= rufs_ll_write,
+	.unlink		= rufs_ll_unlink,
+	.fallocate	= rufs_ll_fallocate,
+
+	.flush		= rufs_ll_flush,
+	.fsync		= rufs_ll_fsync,
+	.release	= rufs_ll_release
+};
+
+int main(int argc, char *argv[]) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch;
+	char *mountpoint = NULL;
+	int multithreaded,
+		foreground,
+		err = -1;
+	getcwd(diskfile_path, PATH_MAX);
+	strcat(diskfile_path, "/DISKFILE");
+	if (fuse_opt_parse(&args, &options, rufs_opts, NULL) == -1) return EXIT_FAILURE;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 && (ch = fuse_mount(mountpoint, &args)) != NULL) {
+		struct fuse_session *se = fuse_lowlevel_new(&args, &rufs_ll_ope, sizeof(rufs_ll_ope), NULL);
+		if (se) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				if (fuse_daemonize(foreground) != -1) err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
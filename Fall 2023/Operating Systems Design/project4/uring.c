@@ -0,0 +1,234 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	uring.c
+ *
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/*
+ * io_uring backend for the vectored block transfers in block.c, driven through the raw system calls. Every
+ * thread that does I/O gets its own ring the first time it needs one, so FUSE threads never contend for a
+ * submission queue; a ring is torn down when its thread exits or at uring_destroy(). uring_submit() keeps
+ * up to queue_depth operations in flight and returns once all of them have completed. Nothing here retries
+ * a failed or short transfer: callers finish those synchronously.
+ */
+
+struct ring {
+	int fd;
+	void *sq_ptr,
+		*cq_ptr;
+	size_t sq_len,
+		cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *sq_head,
+		*sq_tail,
+		*sq_mask,
+		*sq_array;
+	unsigned int *cq_head,
+		*cq_tail,
+		*cq_mask;
+	struct io_uring_cqe *cqes;
+	struct ring *prev,
+		*next;					/* in the list of all rings */
+};
+
+static pthread_mutex_t uring_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards rings and stats.
+static pthread_key_t ring_key;
+static struct ring *rings = NULL;
+static int disk_fd = -1;
+static unsigned int queue_depth = 0; // 0 while the backend is off
+static struct uring_stats stats;
+
+static void ring_free(struct ring *ring) {
+	if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->fd >= 0) close(ring->fd);
+	free(ring);
+}
+
+// Creates a ring with room for queue_depth submissions and maps its queues.
+static struct ring *ring_setup() {
+	struct io_uring_params params;
+	struct ring *ring = calloc(1, sizeof(struct ring));
+	if (!ring) return NULL;
+	memset(&params, 0, sizeof(params));
+	if ((ring->fd = syscall(__NR_io_uring_setup, queue_depth, &params)) < 0) {
+		free(ring);
+		return NULL;
+	}
+	ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring_free(ring);
+		return NULL;
+	}
+	ring->cq_ptr = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_ptr
+		: mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		ring_free(ring);
+		return NULL;
+	}
+	char *sq = ring->sq_ptr,
+		*cq = ring->cq_ptr;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return ring;
+}
+
+// pthread_key destructor: releases the ring of an exiting thread.
+static void ring_release(void *arg) {
+	struct ring *ring = arg;
+	pthread_mutex_lock(&uring_mutex);
+	if (ring->prev) ring->prev->next = ring->next;
+	else rings = ring->next;
+	if (ring->next) ring->next->prev = ring->prev;
+	pthread_mutex_unlock(&uring_mutex);
+	ring_free(ring);
+}
+
+// Returns the calling thread's ring, setting it up on first use; NULL if that fails.
+static struct ring *get_ring() {
+	struct ring *ring = pthread_getspecific(ring_key);
+	if (ring || !(ring = ring_setup())) return ring;
+	pthread_mutex_lock(&uring_mutex);
+	ring->next = rings;
+	if (rings) rings->prev = ring;
+	rings = ring;
+	stats.rings++;
+	pthread_mutex_unlock(&uring_mutex);
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+// Routes the block transfers on fd through io_uring with up to depth operations in flight. Returns 0, or -1
+// if the kernel offers no io_uring (the caller then keeps using preadv()/pwritev()).
+// Status: COMPLETE
+int uring_init(int fd, unsigned int depth) {
+	if (queue_depth > 0) uring_destroy();
+	if (depth == 0) return EXIT_SUCCESS;
+	if (pthread_key_create(&ring_key, ring_release) != 0) return -1;
+	disk_fd = fd;
+	queue_depth = depth < URING_MAX_DEPTH ? depth : URING_MAX_DEPTH;
+	memset(&stats, 0, sizeof(stats));
+	// Set up the mounting thread's ring now, so that a kernel without io_uring is noticed here.
+	if (!get_ring()) {
+		perror("io_uring_setup failed");
+		pthread_key_delete(ring_key);
+		queue_depth = 0;
+		return -1;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Status: COMPLETE
+int uring_enabled() {
+	return queue_depth > 0;
+}
+
+// Performs all op_count operations and stores each one's outcome in its result. Returns 0 once every
+// operation has completed, or -1 if this thread has no ring; operations that could not be submitted are left
+// with result -ECANCELED.
+// Status: COMPLETE
+int uring_submit(struct uring_op *ops, unsigned int op_count) {
+	struct ring *ring = get_ring();
+	if (!ring) return -1;
+	unsigned int queued = 0,	// handed to the submission queue
+		submitted = 0,			// taken by the kernel
+		completed = 0,
+		enters = 0;
+	int failed = 0;
+	for (unsigned int i = 0; i < op_count; i++) ops[i].result = -ECANCELED;
+	while (completed < submitted || (!failed && completed < op_count)) {
+		unsigned int tail = *ring->sq_tail;
+		while (!failed && queued < op_count && queued - completed < queue_depth) {
+			unsigned int index = tail & *ring->sq_mask;
+			struct io_uring_sqe *sqe = &ring->sqes[index];
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			sqe->opcode = ops[queued].is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = disk_fd;
+			sqe->off = ops[queued].offset;
+			sqe->addr = (uintptr_t)ops[queued].iov;
+			sqe->len = ops[queued].iov_count;
+			sqe->user_data = queued;
+			ring->sq_array[index] = index;
+			tail++;
+			queued++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		// Submit whatever the kernel has not taken yet and wait for at least one completion.
+		int retstat = syscall(__NR_io_uring_enter, ring->fd, queued - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		enters++;
+		if (retstat > 0) submitted += retstat;
+		else if (retstat < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			// Withdraw what was never submitted; operations already in flight still have to be waited for.
+			__atomic_store_n(ring->sq_tail, tail - (queued - submitted), __ATOMIC_RELEASE);
+			queued = submitted;
+			failed = 1;
+		}
+		unsigned int head = *ring->cq_head,
+			cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != cq_tail; head++, completed++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			ops[cqe->user_data].result = cqe->res;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_lock(&uring_mutex);
+	stats.ops += completed;
+	stats.enters += enters;
+	pthread_mutex_unlock(&uring_mutex);
+	return EXIT_SUCCESS;
+}
+
+// Tears down every ring; called when the disk is closed, while no I/O is running.
+// Status: COMPLETE
+void uring_destroy() {
+	if (queue_depth == 0) return;
+	pthread_mutex_lock(&uring_mutex);
+	while (rings) {
+		struct ring *ring = rings;
+		rings = ring->next;
+		ring_free(ring);
+	}
+	pthread_mutex_unlock(&uring_mutex);
+	pthread_key_delete(ring_key);
+	queue_depth = 0;
+	disk_fd = -1;
+}
+
+// Status: COMPLETE
+void uring_get_stats(struct uring_stats *out_stats) {
+	pthread_mutex_lock(&uring_mutex);
+	*out_stats = stats;
+	pthread_mutex_unlock(&uring_mutex);
+}
@@ -0,0 +1,36 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	uring.h
+ *
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_MAX_DEPTH 4096 // Largest queue depth accepted by uring_init()
+
+struct uring_op {
+	int			is_write;		/* IORING_OP_WRITEV instead of IORING_OP_READV */
+	off_t		offset;			/* byte offset in the disk file */
+	struct iovec	*iov;		/* buffers, transferred in order */
+	unsigned int	iov_count;
+	ssize_t		result;			/* set by uring_submit(): bytes transferred or a negative errno value */
+};
+
+struct uring_stats {
+	unsigned long long ops;			/* reads and writes completed through a ring */
+	unsigned long long enters;		/* io_uring_enter() calls that submitted or waited for them */
+	unsigned long long rings;		/* rings set up (one per thread that did I/O) */
+};
+
+int uring_init(int fd, unsigned int queue_depth);
+int uring_enabled();
+int uring_submit(struct uring_op *ops, unsigned int op_count);
+void uring_destroy();
+void uring_get_stats(struct uring_stats *stats);
+
+#endif